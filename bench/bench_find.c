@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "../src/isd.h"
+
+// Throughput benchmark of the restriction fragment lookup. A synthetic
+// chromosome (MboI-like, one site every ~256 bp) is written raw and packed
+// to temporary digestions, and random positions are looked up with the
+// original bisection, with isd_find and with isd_find_batch; the fragments
+// must be equal.
+
+#define DEFAULT_MB      256
+#define DEFAULT_LOOKUPS 10000000
+#define BATCH           32
+
+double
+now
+(
+ void
+)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+unsigned long
+xorshift
+(
+ unsigned long * x
+)
+{
+   *x ^= *x << 13; *x ^= *x >> 7; *x ^= *x << 17;
+   return *x;
+}
+
+long
+reference_bisection
+(
+ const int64_t * data,
+ long            beg,
+ long            end,
+ long            target
+)
+{
+   // Original lookup of parse_contacts.
+   if (end - beg < 2) return beg;
+   long mid = (beg+end)/2;
+   if (target < data[mid]) return reference_bisection(data, beg, mid, target);
+   else if (target > data[mid]) return reference_bisection(data, mid, end, target);
+   else return mid;
+}
+
+isd_t *
+write_digestion
+(
+ const char * path,
+ long         len,
+ int64_t    * site,
+ long         cnt,
+ int          encoding
+)
+{
+   char * seq[] = {"GATC"};
+   int    cut_fw[] = {0}, cut_rv[] = {4};
+   isdw_t * w = isd_create(path, "bench", 1, seq, cut_fw, cut_rv, encoding);
+   if (w == NULL || isd_write_chr(w, "chr1", len, site, cnt) || isd_finish(w))
+      return NULL;
+   return isd_open(path, 0);
+}
+
+int main(int argc, char *argv[])
+{
+   long mb = argc > 1 ? atol(argv[1]) : DEFAULT_MB;
+   long nq = argc > 2 ? atol(argv[2]) : DEFAULT_LOOKUPS;
+   long len = mb << 20;
+   unsigned long x = 0x9e3779b97f4a7c15UL;
+   int fail = 0;
+
+   // Sites (with the chromosome start and end).
+   long cnt = 0, max = len/128 + 2;
+   int64_t * site = malloc(max*sizeof(int64_t));
+   site[cnt++] = 0;
+   for (long p = 1 + xorshift(&x) % 512; p < len-1 && cnt < max-1; p += 1 + xorshift(&x) % 512)
+      site[cnt++] = p;
+   site[cnt++] = len-1;
+
+   // Positions and reference fragments.
+   long * pos = malloc(nq*sizeof(long));
+   long * ref = malloc(nq*sizeof(long));
+   long * idx = malloc(nq*sizeof(long));
+   for (long i = 0; i < nq; i++)
+      pos[i] = xorshift(&x) % len;
+   double t = now();
+   for (long i = 0; i < nq; i++)
+      ref[i] = reference_bisection(site, 0, cnt-1, pos[i]);
+   t = now() - t;
+   fprintf(stdout, "chromosome: %ld MB, %ld sites, %ld lookups\n", mb, cnt, nq);
+   fprintf(stdout, "%-8s %-12s %10.1f Mlookups/s\n", "raw", "bisection", nq/t/1e6);
+
+   char * names[] = {"raw", "packed"};
+   int    encodings[] = {ISD_RAW64, ISD_PACKED};
+   for (int e = 0; e < 2; e++) {
+      char path[] = "/tmp/bench_find_XXXXXX";
+      int fd = mkstemp(path);
+      if (fd < 0) {
+         fprintf(stderr, "error creating temporary file.\n");
+         return 1;
+      }
+      close(fd);
+      isd_t * isd = write_digestion(path, len, site, cnt, encodings[e]);
+      unlink(path);
+      if (isd == NULL) {
+         fprintf(stderr, "error writing digestion.\n");
+         return 1;
+      }
+      isdchr_t * chr = isd->chrom;
+
+      // One lookup at a time.
+      long beg, end;
+      t = now();
+      for (long i = 0; i < nq; i++)
+         idx[i] = isd_find(chr, pos[i], &beg, &end);
+      t = now() - t;
+      int same = memcmp(idx, ref, nq*sizeof(long)) == 0;
+      fprintf(stdout, "%-8s %-12s %10.1f Mlookups/s%s\n",
+              names[e], "isd_find", nq/t/1e6, same ? "" : "  MISMATCH");
+      fail |= !same;
+
+      // Batches.
+      isdq_t q[BATCH];
+      t = now();
+      for (long i = 0; i < nq; i += BATCH) {
+         long n = i + BATCH < nq ? BATCH : nq - i;
+         for (long j = 0; j < n; j++)
+            q[j] = (isdq_t) {.chr = chr, .pos = pos[i+j]};
+         isd_find_batch(q, n);
+         for (long j = 0; j < n; j++)
+            idx[i+j] = q[j].idx;
+      }
+      t = now() - t;
+      same = memcmp(idx, ref, nq*sizeof(long)) == 0;
+      fprintf(stdout, "%-8s %-12s %10.1f Mlookups/s%s\n",
+              names[e], "batch", nq/t/1e6, same ? "" : "  MISMATCH");
+      fail |= !same;
+
+      isd_close(isd);
+   }
+
+   free(site);
+   free(pos);
+   free(ref);
+   free(idx);
+   return fail;
+}
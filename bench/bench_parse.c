@@ -0,0 +1,327 @@
+// Throughput benchmark of the contact path of parse_contacts. The SAM file
+// (e.g. from gen_hic) is loaded to memory and its records are run through
+// parse_sam, fill_re_fragment_info and find_pe_contacts, each timed on its
+// own. The functions are those of parse_contacts.c (its main is renamed), a
+// checksum of their results is printed so that runs can be compared.
+
+#define main parse_contacts_main
+#include "../src/parse_contacts.c"
+#undef main
+
+#define DEFAULT_ROUNDS 3
+
+typedef struct {
+   long   nmaps;
+   long   maxmaps;
+   map_t * map;
+   long   ngroups;
+   long   maxgroups;
+   long * first;
+   int  * nf;
+   int  * nr;
+} groups_t;
+
+double
+now
+(
+ void
+)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+uint64_t
+mix
+(
+ uint64_t h,
+ long     v
+)
+{
+   return (h ^ (uint64_t) v) * 0x100000001b3ULL;
+}
+
+// Keeps the mapped fragments of a read group (fw then rv).
+void
+groups_push
+(
+ groups_t   * g,
+ mapstack_t * f,
+ mapstack_t * r
+)
+{
+   if (g->ngroups >= g->maxgroups) {
+      g->maxgroups = g->maxgroups ? 2*g->maxgroups : 1024;
+      g->first = realloc(g->first, g->maxgroups * sizeof(long));
+      g->nf = realloc(g->nf, g->maxgroups * sizeof(int));
+      g->nr = realloc(g->nr, g->maxgroups * sizeof(int));
+   }
+   while (g->nmaps + f->pos + r->pos > g->maxmaps) {
+      g->maxmaps = g->maxmaps ? 2*g->maxmaps : 4096;
+      g->map = realloc(g->map, g->maxmaps * sizeof(map_t));
+   }
+   g->first[g->ngroups] = g->nmaps;
+   g->nf[g->ngroups] = f->pos;
+   g->nr[g->ngroups] = r->pos;
+   g->ngroups++;
+   memcpy(g->map + g->nmaps, f->map, f->pos * sizeof(map_t));
+   g->nmaps += f->pos;
+   memcpy(g->map + g->nmaps, r->map, r->pos * sizeof(map_t));
+   g->nmaps += r->pos;
+}
+
+// Copies group i of g to the stacks.
+void
+groups_load
+(
+ groups_t    * g,
+ long          i,
+ mapstack_t ** f,
+ mapstack_t ** r
+)
+{
+   mapstack_reserve(f, g->nf[i]);
+   mapstack_reserve(r, g->nr[i]);
+   memcpy((*f)->map, g->map + g->first[i], g->nf[i] * sizeof(map_t));
+   memcpy((*r)->map, g->map + g->first[i] + g->nf[i], g->nr[i] * sizeof(map_t));
+   (*f)->pos = g->nf[i];
+   (*r)->pos = g->nr[i];
+}
+
+void
+report
+(
+ const char * name,
+ long         n,
+ double       t,
+ uint64_t     sum,
+ FILE       * ck
+)
+{
+   fprintf(stdout, "%-24s %10.2f Mcalls/s  %ld calls\n", name, n/t/1e6, n);
+   fprintf(ck, "%-24s %ld %016llx\n", name, n, (unsigned long long) sum);
+}
+
+int main(int argc, char *argv[])
+{
+   int    rounds = DEFAULT_ROUNDS;
+   char * ckfile = NULL;
+   int    opt;
+   while ((opt = getopt(argc, argv, "c:r:")) != -1) {
+      switch (opt) {
+      case 'c': ckfile = optarg; break;
+      case 'r': rounds = atoi(optarg); break;
+      default: argc = 0;
+      }
+   }
+   if (argc - optind != 3 || rounds < 1) {
+      fprintf(stderr, "usage: %s [-r rounds] [-c checksums.txt] <organism> <RE> <reads.sam>\n", argv[0]);
+      fprintf(stderr, "  run in the directory of db/<organism>, the best of -r rounds (default: %d) is reported\n", DEFAULT_ROUNDS);
+      exit(1);
+   }
+   FILE * ck = ckfile ? fopen(ckfile, "w") : stdout;
+   if (ck == NULL) {
+      fprintf(stderr, "error opening %s.\n", ckfile);
+      exit(1);
+   }
+
+   // Digestion, header and records.
+   isd_t  * isd = read_enzyme_db(argv[optind], argv[optind+1], 0);
+   bgzf_t * in = bgzf_open(argv[optind+2], 1);
+   if (in == NULL) {
+      fprintf(stderr, "error opening %s.\n", argv[optind+2]);
+      exit(1);
+   }
+   char   * text = malloc(READ_BLOCK);
+   size_t   len = 0, size = READ_BLOCK;
+   int      nref, coord;
+   long   * reflen;
+   char  ** ref = sam_header(in, &text, &len, &nref, &reflen, &coord);
+   chrtab_t * chr = chrtab_build(isd, ref, nref);
+   size = len + READ_BLOCK;
+   text = realloc(text, size);
+   for (ssize_t bytes = 1; bytes > 0; len += bytes) {
+      if (len + READ_BLOCK > size) {
+         size *= 2;
+         text = realloc(text, size);
+      }
+      bytes = bgzf_read(in, text + len, READ_BLOCK);
+      if (bytes < 0) bytes = 0;
+   }
+   if (len == 0 || text[len-1] != '\n') {
+      fprintf(stderr, "error: %s must end with a newline.\n", argv[optind+2]);
+      exit(1);
+   }
+   // Lines, and the first line of each read group.
+   long nlines = 0, max = 1024;
+   long * line = malloc((max + 1) * sizeof(long));
+   char * first = malloc(max + 1);
+   size_t namelen = 0;
+   for (char * p = text; p < text + len; p = memchr(p, '\n', text + len - p) + 1) {
+      if (nlines >= max) {
+         max *= 2;
+         line = realloc(line, (max + 1) * sizeof(long));
+         first = realloc(first, max + 1);
+      }
+      char * eol = memchr(p, '\n', text + len - p);
+      char * tab = memchr(p, '\t', eol - p);
+      size_t n = tab ? (size_t) (tab - p) : (size_t) (eol - p);
+      first[nlines] = nlines == 0 || n != namelen || memcmp(p, text + line[nlines-1], n) != 0;
+      namelen = n;
+      line[nlines++] = p - text;
+   }
+   line[nlines] = len;
+   first[nlines] = 1;
+   // parse_sam terminates the fields in place, every round parses a copy.
+   char * copy = malloc(len);
+   fprintf(stdout, "records: %ld (%.1f MB), best of %d rounds\n", nlines, len / 1048576.0, rounds);
+
+   stats_t stats = {0};
+   sam_t * sam = new_sam();
+   double  best;
+   uint64_t sum = 0;
+
+   // parse_sam.
+   best = 1e30;
+   for (int k = 0; k < rounds; k++) {
+      memcpy(copy, text, len);
+      sum = 0xcbf29ce484222325ULL;
+      double t = now();
+      for (long i = 0; i < nlines; i++) {
+         parse_sam(sam, copy + line[i], copy + line[i+1] - 1, chr, &stats);
+         sum = mix(sum, sam->flag);
+         sum = mix(sum, sam->chr);
+         sum = mix(sum, sam->locus);
+         sum = mix(sum, sam->mapq);
+         sum = mix(sum, sam->score);
+         sum = mix(sum, sam->cigar.matches + 256*sam->cigar.beg_clip + 65536*sam->cigar.end_clip);
+      }
+      t = now() - t;
+      if (t < best) best = t;
+   }
+   report("parse_sam", nlines, best, sum, ck);
+
+   // Mapped fragments of each read group, as parse_contact places them.
+   memcpy(copy, text, len);
+   scratch_t * scratch = new_scratch();
+   samstack_t * stack = scratch->sams;
+   groups_t g = {0};
+   for (long i = 0; i < nlines; ) {
+      stack->pos = 0;
+      long j = i;
+      do {
+         parse_sam(sam, copy + line[j], copy + line[j+1] - 1, chr, &stats);
+         sam_push(sam, stack);
+         j++;
+      } while (!first[j]);
+      i = j;
+      qsort(stack->buf, stack->pos, sizeof(sam_t *), sam_by_score_desc);
+      mapstack_t * mapf = scratch->mapf;
+      mapstack_t * mapr = scratch->mapr;
+      mapf->pos = mapr->pos = 0;
+      for (int s = 0; s < stack->pos; s++) {
+         sam_t * r = stack->buf[s];
+         if ((r->flag & FLAG_UNMAPPED) || !(r->flag & FLAG_MULTISEGMENT))
+            continue;
+         cigar_t cigar = r->cigar;
+         int     rc = r->flag & FLAG_REVCOMP;
+         map_t   map = {
+            .chr      = r->chr,
+            .beg_ref  = r->locus,
+            .end_ref  = r->locus + cigar.matches + cigar.deletions,
+            .beg_frag = -1,
+            .end_frag = -1,
+            .beg_read = (rc ? cigar.end_clip : cigar.beg_clip),
+            .end_read = (rc ? cigar.end_clip : cigar.beg_clip) + cigar.matches + cigar.insertions,
+            .frag_id  = -1,
+            .rc       = rc,
+            .mapq     = r->mapq
+         };
+         if (r->flag & FLAG_FORWARD_READ)
+            map_push(map, &scratch->mapf);
+         else
+            map_push(map, &scratch->mapr);
+         mapf = scratch->mapf;
+         mapr = scratch->mapr;
+      }
+      if (mapf->pos + mapr->pos < 2) continue;
+      mapstack_reserve(&scratch->mf, mapf->pos);
+      mapstack_reserve(&scratch->mr, mapr->pos);
+      scratch->mf->pos = scratch->mr->pos = 0;
+      place_in_read(mapf, scratch->mf);
+      place_in_read(mapr, scratch->mr);
+      mapf->pos = mapr->pos = 0;
+      for (int m = 0; m < scratch->mf->pos; m++)
+         if (scratch->mf->map[m].mapq >= MIN_MAPQ) mapf->map[mapf->pos++] = scratch->mf->map[m];
+      for (int m = 0; m < scratch->mr->pos; m++)
+         if (scratch->mr->map[m].mapq >= MIN_MAPQ) mapr->map[mapr->pos++] = scratch->mr->map[m];
+      groups_push(&g, mapf, mapr);
+   }
+
+   // fill_re_fragment_info (the fragments are kept for find_pe_contacts).
+   best = 1e30;
+   for (int k = 0; k < rounds; k++) {
+      sum = 0xcbf29ce484222325ULL;
+      double t = now();
+      for (long i = 0; i < g.ngroups; i++) {
+         groups_load(&g, i, &scratch->mapf, &scratch->mapr);
+         fill_re_fragment_info(scratch->mapf, scratch->mapr, chr);
+         for (int m = 0; m < scratch->mapf->pos; m++)
+            sum = mix(sum, scratch->mapf->map[m].frag_id);
+         for (int m = 0; m < scratch->mapr->pos; m++)
+            sum = mix(sum, scratch->mapr->map[m].frag_id);
+         if (k == rounds - 1) {
+            memcpy(g.map + g.first[i], scratch->mapf->map, g.nf[i] * sizeof(map_t));
+            memcpy(g.map + g.first[i] + g.nf[i], scratch->mapr->map, g.nr[i] * sizeof(map_t));
+         }
+      }
+      t = now() - t;
+      if (t < best) best = t;
+   }
+   report("fill_re_fragment_info", g.ngroups, best, sum, ck);
+
+   // find_pe_contacts (groups with two mapped fragments).
+   best = 1e30;
+   long ncalls = 0;
+   for (int k = 0; k < rounds; k++) {
+      sum = 0xcbf29ce484222325ULL;
+      ncalls = 0;
+      double t = now();
+      for (long i = 0; i < g.ngroups; i++) {
+         if (g.nf[i] + g.nr[i] < 2) continue;
+         groups_load(&g, i, &scratch->mapf, &scratch->mapr);
+         int insert = find_pe_contacts(scratch->mapf, scratch->mapr, &scratch->mf, &scratch->tmp, &stats);
+         sum = mix(sum, insert);
+         for (int m = 0; m < scratch->mf->pos; m++)
+            sum = mix(sum, scratch->mf->map[m].frag_id);
+         ncalls++;
+      }
+      t = now() - t;
+      if (t < best) best = t;
+   }
+   report("find_pe_contacts", ncalls, best, sum, ck);
+
+   if (ck != stdout && fclose(ck)) {
+      fprintf(stderr, "error writing %s.\n", ckfile);
+      exit(1);
+   }
+   free(g.map);
+   free(g.first);
+   free(g.nf);
+   free(g.nr);
+   scratch_destroy(scratch);
+   sam_destroy(sam);
+   chrtab_destroy(chr);
+   for (int i = 0; i < nref; i++)
+      free(ref[i]);
+   free(ref);
+   free(reflen);
+   free(line);
+   free(first);
+   free(copy);
+   free(text);
+   bgzf_close(in);
+   isd_close(isd);
+   return 0;
+}
@@ -0,0 +1,332 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+// End-to-end benchmark of the pipeline on synthetic data. gen_hic writes a
+// genome and its Hi-C SAM file to the work directory, which go through
+// re_digest, parse_contacts (text and binary), sort_contacts,
+// merge_contacts and bench_parse. Each step reports its wall time, records
+// per second and peak RSS, and its output is compared byte by byte to the
+// same file of a reference run (saved on the first run), so that an
+// optimization is shown to be faster and to give identical output.
+
+#define DEFAULT_PAIRS  200000
+#define DEFAULT_MB     16
+#define WORK_DIR       "bench/work"
+#define REF_DIR        "bench/ref"
+#define ORGANISM       "bench"
+#define MAX_ARGS       16
+
+typedef struct {
+   const char * name;
+   const char * argv[MAX_ARGS];
+   const char * out;       // Standard output (NULL: terminal).
+   const char * check;     // File compared to the reference.
+   const char * unit;
+} step_t;
+
+typedef struct {
+   double time;
+   long   rss;
+} run_t;
+
+
+// Function headers.
+double         now          (void);
+int            run          (const char * dir, const char * path, const char ** argv, const char * out, const char * log, run_t * r);
+int            same_file    (const char * a, const char * b);
+int            copy_file    (const char * src, const char * dst);
+long           count_lines  (const char * path, int skip_header);
+char         * path_join    (const char * dir, const char * file);
+
+// Source.
+
+double
+now
+(
+ void
+)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+char *
+path_join
+(
+ const char * dir,
+ const char * file
+)
+{
+   char * path = malloc(strlen(dir) + strlen(file) + 2);
+   sprintf(path, "%s/%s", dir, file);
+   return path;
+}
+
+// Runs path with argv in dir, with the standard output to out (in dir) and
+// the standard error appended to log. Returns the exit status.
+int
+run
+(
+ const char  * dir,
+ const char  * path,
+ const char ** argv,
+ const char  * out,
+ const char  * log,
+ run_t       * r
+)
+{
+   double t = now();
+   pid_t pid = fork();
+   if (pid < 0) {
+      fprintf(stderr, "error: fork failed.\n");
+      exit(1);
+   }
+   if (pid == 0) {
+      if (chdir(dir)) _exit(127);
+      if (out != NULL) {
+         int fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+         if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) _exit(127);
+         close(fd);
+      }
+      int fd = open(log, O_WRONLY | O_CREAT | O_APPEND, 0644);
+      if (fd < 0 || dup2(fd, STDERR_FILENO) < 0) _exit(127);
+      close(fd);
+      execv(path, (char * const *) argv);
+      fprintf(stderr, "error executing %s: %s\n", path, strerror(errno));
+      _exit(127);
+   }
+   int status;
+   struct rusage ru;
+   if (wait4(pid, &status, 0, &ru) < 0) {
+      fprintf(stderr, "error: wait failed.\n");
+      exit(1);
+   }
+   r->time = now() - t;
+   r->rss  = ru.ru_maxrss;
+   return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+int
+same_file
+(
+ const char * a,
+ const char * b
+)
+{
+   FILE * fa = fopen(a, "r");
+   FILE * fb = fopen(b, "r");
+   int    same = fa != NULL && fb != NULL;
+   char   ba[65536], bb[65536];
+   while (same) {
+      size_t na = fread(ba, 1, sizeof(ba), fa);
+      size_t nb = fread(bb, 1, sizeof(bb), fb);
+      same = na == nb && memcmp(ba, bb, na) == 0;
+      if (na == 0) break;
+   }
+   if (fa) fclose(fa);
+   if (fb) fclose(fb);
+   return same;
+}
+
+int
+copy_file
+(
+ const char * src,
+ const char * dst
+)
+{
+   FILE * in  = fopen(src, "r");
+   FILE * out = fopen(dst, "w");
+   int    err = in == NULL || out == NULL;
+   char   buf[65536];
+   size_t n;
+   while (!err && (n = fread(buf, 1, sizeof(buf), in)) > 0)
+      err = fwrite(buf, 1, n, out) != n;
+   if (in) fclose(in);
+   if (out && fclose(out)) err = 1;
+   return err;
+}
+
+long
+count_lines
+(
+ const char * path,
+ int          skip_header
+)
+{
+   FILE * f = fopen(path, "r");
+   if (f == NULL) return 0;
+   char   buf[65536];
+   size_t n;
+   long   lines = 0, header = 0;
+   int    bol = 1;
+   while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+      for (size_t i = 0; i < n; i++) {
+         if (bol && skip_header && buf[i] == '@') header++;
+         bol = buf[i] == '\n';
+         lines += bol;
+      }
+   }
+   fclose(f);
+   return lines - header;
+}
+
+int main(int argc, char *argv[])
+{
+   long   pairs = DEFAULT_PAIRS;
+   long   mb = DEFAULT_MB;
+   int    threads = sysconf(_SC_NPROCESSORS_ONLN);
+   char * work = WORK_DIR;
+   char * refdir = REF_DIR;
+   char * root = ".";
+   int    opt;
+   while ((opt = getopt(argc, argv, "b:g:n:r:t:w:")) != -1) {
+      switch (opt) {
+      case 'b': root = optarg; break;
+      case 'g': mb = atol(optarg); break;
+      case 'n': pairs = atol(optarg); break;
+      case 'r': refdir = optarg; break;
+      case 't': threads = atoi(optarg); break;
+      case 'w': work = optarg; break;
+      default: argc = 0;
+      }
+   }
+   if (argc != optind || pairs <= 0 || mb <= 0 || threads <= 0) {
+      fprintf(stderr, "usage: %s [-n read pairs] [-g genome MB] [-t threads] [-w work dir] [-r reference dir] [-b build dir]\n", argv[0]);
+      fprintf(stderr, "  defaults: -n %d -g %d -w %s -r %s -b . (the outputs of the first run are the reference)\n",
+              DEFAULT_PAIRS, DEFAULT_MB, WORK_DIR, REF_DIR);
+      exit(1);
+   }
+
+   // Directories (the binaries are run from the work directory).
+   char * db = path_join(work, "db/" ORGANISM);
+   mkdir(work, 0755);
+   mkdir(refdir, 0755);
+   char * dbdir = path_join(work, "db");
+   mkdir(dbdir, 0755);
+   mkdir(db, 0755);
+   char * bin = realpath(root, NULL);
+   if (bin == NULL) {
+      fprintf(stderr, "error: no directory %s.\n", root);
+      exit(1);
+   }
+   char * log = path_join(work, "bench.log");
+   char * abslog = realpath(work, NULL);
+   abslog = realloc(abslog, strlen(abslog) + 16);
+   strcat(abslog, "/bench.log");
+   unlink(log);
+   // The genome cache and the digestion are rebuilt at every run.
+   const char * stale[] = {"genome.2bp", "genome.fasta.fai", "mboi.isd"};
+   for (int i = 0; i < 3; i++) {
+      char * path = path_join(db, stale[i]);
+      unlink(path);
+      free(path);
+   }
+
+   char npairs[32], nmb[32], nthreads[32];
+   sprintf(npairs, "%ld", pairs);
+   sprintf(nmb, "%ld", mb);
+   sprintf(nthreads, "%d", threads);
+   char * gen    = path_join(bin, "bench/gen_hic");
+   char * digest = path_join(bin, "re_digest");
+   char * parse  = path_join(bin, "parse_contacts");
+   char * sort   = path_join(bin, "sort_contacts");
+   char * merge  = path_join(bin, "merge_contacts");
+   char * micro  = path_join(bin, "bench/bench_parse");
+   step_t steps[] = {
+      {"gen_hic", {gen, "-n", npairs, "-g", nmb, "db/" ORGANISM "/genome.fasta", "reads.sam"},
+       NULL, "reads.sam", "pairs"},
+      {"re_digest", {digest, "-t", nthreads, ORGANISM, "MboI", "GATC", "0", "4"},
+       NULL, "db/" ORGANISM "/mboi.isd", "bases"},
+      {"parse_contacts", {parse, "-t", nthreads, ORGANISM, "MboI", "reads.sam"},
+       "contacts.txt", "contacts.txt", "records"},
+      {"parse_contacts -b", {parse, "-t", nthreads, "-b", ORGANISM, "MboI", "reads.sam"},
+       "contacts.bin", "contacts.bin", "records"},
+      {"sort_contacts", {sort, "-t", nthreads, "-T", ".", "contacts.bin"},
+       "sorted.bin", "sorted.bin", "contacts"},
+      {"merge_contacts", {merge, "sorted.bin"},
+       "merged.txt", "merged.txt", "contacts"},
+      {"bench_parse", {micro, "-c", "micro.txt", ORGANISM, "MboI", "reads.sam"},
+       NULL, "micro.txt", "records"},
+   };
+   int nsteps = sizeof(steps) / sizeof(step_t);
+
+   fprintf(stdout, "pipeline: %ld read pairs, %ld MB genome, %d threads (work: %s, reference: %s)\n",
+           pairs, mb, threads, work, refdir);
+   int  fail = 0;
+   long records = 0, contacts = 0;
+   for (int s = 0; s < nsteps; s++) {
+      step_t * st = steps + s;
+      run_t    r;
+      if (strcmp(st->name, "bench_parse") == 0) fflush(stdout);
+      int status = run(work, st->argv[0], st->argv, st->out, abslog, &r);
+      if (status != 0) {
+         fprintf(stdout, "%-18s FAILED (exit status %d, see %s)\n", st->name, status, log);
+         fail = 1;
+         break;
+      }
+
+      // Records per second.
+      char * out = path_join(work, st->check);
+      long   items = 0;
+      if (strcmp(st->unit, "pairs") == 0) {
+         items = pairs;
+         records = count_lines(out, 1);
+      } else if (strcmp(st->unit, "bases") == 0) {
+         items = mb << 20;
+      } else if (strcmp(st->unit, "records") == 0) {
+         items = records;
+      } else {
+         if (contacts == 0) {
+            char * txt = path_join(work, "contacts.txt");
+            contacts = count_lines(txt, 0);
+            free(txt);
+         }
+         items = contacts;
+      }
+
+      // Comparison with the reference run.
+      char * name = strrchr(st->check, '/') ? strrchr(st->check, '/') + 1 : (char *) st->check;
+      char * ref  = path_join(refdir, name);
+      const char * result;
+      if (access(ref, F_OK) != 0) {
+         if (copy_file(out, ref)) {
+            fprintf(stderr, "error saving the reference %s.\n", ref);
+            exit(1);
+         }
+         result = "reference saved";
+      } else if (same_file(out, ref)) {
+         result = "identical";
+      } else {
+         result = "MISMATCH";
+         fail = 1;
+      }
+      fprintf(stdout, "%-18s %8.2f s %10.3f M%s/s %8.1f MB RSS  %s: %s\n",
+              st->name, r.time, items / r.time / 1e6, st->unit, r.rss / 1024.0, name, result);
+      free(out);
+      free(ref);
+   }
+
+   free(db);
+   free(dbdir);
+   free(bin);
+   free(log);
+   free(abslog);
+   free(gen);
+   free(digest);
+   free(parse);
+   free(sort);
+   free(merge);
+   free(micro);
+   return fail;
+}
@@ -0,0 +1,524 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+// Deterministic generator of a synthetic genome and of the Hi-C SAM file of
+// its read pairs, grouped by read name as written by bwa. The genome is
+// random (with N runs), the restriction fragments are those of MboI (GATC).
+// Read pairs are drawn from these events, at the rates of the options:
+//
+//   valid        R1 and R2 read towards the ligation junction of two
+//                fragments, in cis (with distance decay) or in trans.
+//   chimeric     R1 crosses the junction: primary and supplementary
+//                records (SA tags), as bwa mem -P.
+//   multi        one read maps with MAPQ 0 and has a secondary record.
+//   dangling     both reads inside one uncut fragment, facing inwards.
+//   self-ligated both reads inside one circularized fragment, facing
+//                outwards.
+//   duplicate    a copy of the previous pair (PCR duplicate).
+//   unmapped     one of the reads does not map.
+//
+// The same options and seed always give the same files.
+
+#define DEFAULT_MB       16
+#define DEFAULT_CHR      4
+#define DEFAULT_PAIRS    200000
+#define DEFAULT_READLEN  75
+#define FASTA_LINE       60
+#define SITE             "GATC"
+#define MAX_DIST         400
+#define TRANS_RATE       0.2
+
+// Rates of the events (the rest of the pairs are valid).
+enum {EV_CHIMERIC, EV_MULTI, EV_DANGLING, EV_SELF, EV_DUP, EV_UNMAPPED, EV_VALID, NEVENTS};
+
+typedef struct {
+   char   name[16];
+   long   len;
+   char * seq;
+   long   nsites;
+   long * site;
+} gchr_t;
+
+// Alignment of a part of a read: read interval [qb,qe) at reference
+// interval [pos,pos+qe-qb) of chromosome chr.
+typedef struct {
+   int    chr;
+   long   pos;
+   int    rc;
+   int    qb;
+   int    qe;
+} aln_t;
+
+// Side of a ligation junction: the fragment extends to the right (dir 1)
+// or to the left (dir -1) of the site.
+typedef struct {
+   int    chr;
+   long   site;
+   int    dir;
+} side_t;
+
+typedef struct {
+   unsigned long   x;
+   int             nchr;
+   gchr_t        * chr;
+   int             len;
+   double          rate[NEVENTS];
+   FILE          * out;
+   long            nrec;
+} gen_t;
+
+
+// Function headers.
+unsigned long  rnd          (gen_t * g);
+double         rnd_unit     (gen_t * g);
+long           rnd_range    (gen_t * g, long n);
+void           make_genome  (gen_t * g, long len);
+void           write_fasta  (gen_t * g, const char * path);
+side_t         random_side  (gen_t * g);
+side_t         partner_side (gen_t * g, side_t a);
+aln_t          read_to_site (gen_t * g, side_t s, int d, int qb, int qe);
+aln_t          read_from_site (gen_t * g, side_t s, int qb, int qe);
+void           write_record (gen_t * g, const char * name, int flag, aln_t * a, int mapq, aln_t * sa, int nsa, int as, int xs, int hard);
+void           write_pair   (gen_t * g, long id, aln_t * r, int nr, int * mapq, int unmapped);
+int            pair_event   (gen_t * g);
+
+// Source.
+
+unsigned long
+rnd
+(
+ gen_t * g
+)
+{
+   g->x ^= g->x << 13; g->x ^= g->x >> 7; g->x ^= g->x << 17;
+   return g->x;
+}
+
+double
+rnd_unit
+(
+ gen_t * g
+)
+{
+   return (rnd(g) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+long
+rnd_range
+(
+ gen_t * g,
+ long    n
+)
+{
+   return n > 0 ? (long) (rnd(g) % (unsigned long) n) : 0;
+}
+
+void
+make_genome
+(
+ gen_t * g,
+ long    len
+)
+{
+   const char * nt = "ACGT";
+   g->chr = calloc(g->nchr, sizeof(gchr_t));
+   // Chromosome lengths decrease as 1, 1/2, 1/3...
+   double w = 0;
+   for (int c = 0; c < g->nchr; c++)
+      w += 1.0 / (c + 1);
+   for (int c = 0; c < g->nchr; c++) {
+      gchr_t * chr = g->chr + c;
+      sprintf(chr->name, "chr%d", c + 1);
+      chr->len = (long) (len / w / (c + 1));
+      chr->seq = malloc(chr->len + 1);
+      for (long i = 0; i < chr->len; i++)
+         chr->seq[i] = nt[rnd(g) & 3];
+      // Telomere and one N run of 10 kb inside.
+      for (long i = 0; i < chr->len && i < 10000; i++)
+         chr->seq[i] = 'N';
+      for (long i = chr->len/3; i < chr->len && i < chr->len/3 + 10000; i++)
+         chr->seq[i] = 'N';
+      chr->seq[chr->len] = 0;
+
+      // Restriction sites.
+      long max = 1024;
+      chr->site = malloc(max * sizeof(long));
+      for (char * p = strstr(chr->seq, SITE); p != NULL; p = strstr(p + 1, SITE)) {
+         if (chr->nsites >= max) {
+            max *= 2;
+            chr->site = realloc(chr->site, max * sizeof(long));
+         }
+         chr->site[chr->nsites++] = p - chr->seq;
+      }
+   }
+}
+
+void
+write_fasta
+(
+ gen_t      * g,
+ const char * path
+)
+{
+   FILE * f = fopen(path, "w");
+   if (f == NULL) {
+      fprintf(stderr, "error opening %s.\n", path);
+      exit(1);
+   }
+   for (int c = 0; c < g->nchr; c++) {
+      gchr_t * chr = g->chr + c;
+      fprintf(f, ">%s\n", chr->name);
+      for (long i = 0; i < chr->len; i += FASTA_LINE)
+         fprintf(f, "%.*s\n", (int) (chr->len - i < FASTA_LINE ? chr->len - i : FASTA_LINE), chr->seq + i);
+   }
+   if (fclose(f)) {
+      fprintf(stderr, "error writing %s.\n", path);
+      exit(1);
+   }
+}
+
+// Random site of the genome (weighted by chromosome length) and side.
+side_t
+random_side
+(
+ gen_t * g
+)
+{
+   long total = 0;
+   for (int c = 0; c < g->nchr; c++)
+      total += g->chr[c].nsites;
+   long i = rnd_range(g, total);
+   int  c = 0;
+   while (i >= g->chr[c].nsites)
+      i -= g->chr[c++].nsites;
+   return (side_t) {c, g->chr[c].site[i], rnd(g) & 1 ? 1 : -1};
+}
+
+// Ligation partner: another chromosome (TRANS_RATE), otherwise a site of
+// the same chromosome at a log-uniform distance (in sites).
+side_t
+partner_side
+(
+ gen_t * g,
+ side_t  a
+)
+{
+   if (g->nchr > 1 && rnd_unit(g) < TRANS_RATE) {
+      side_t b;
+      do b = random_side(g); while (b.chr == a.chr);
+      return b;
+   }
+   gchr_t * chr = g->chr + a.chr;
+   long lo = 0, hi = chr->nsites;
+   while (hi - lo > 1) {
+      long mid = (lo + hi)/2;
+      if (chr->site[mid] <= a.site) lo = mid;
+      else hi = mid;
+   }
+   long off = 1 + (long) exp(rnd_unit(g) * log((double) chr->nsites));
+   long j = rnd(g) & 1 ? lo + off : lo - off;
+   if (j < 0 || j >= chr->nsites) j = lo + 1 < chr->nsites ? lo + 1 : lo - 1;
+   return (side_t) {a.chr, chr->site[j], rnd(g) & 1 ? 1 : -1};
+}
+
+// Read part [qb,qe) whose 3' end is d nucleotides from the site (inside the
+// fragment of side s), i.e. reading towards the junction.
+aln_t
+read_to_site
+(
+ gen_t  * g,
+ side_t   s,
+ int      d,
+ int      qb,
+ int      qe
+)
+{
+   int  n = qe - qb;
+   long pos = s.dir > 0 ? s.site + d - n : s.site - d;
+   long max = g->chr[s.chr].len - n;
+   if (pos < 0) pos = 0;
+   if (pos > max) pos = max;
+   return (aln_t) {s.chr, pos, s.dir > 0, qb, qe};
+}
+
+// Read part [qb,qe) that starts at the site and reads into the fragment of
+// side s, i.e. after crossing the junction.
+aln_t
+read_from_site
+(
+ gen_t  * g,
+ side_t   s,
+ int      qb,
+ int      qe
+)
+{
+   int  n = qe - qb;
+   long pos = s.dir > 0 ? s.site : s.site - n;
+   long max = g->chr[s.chr].len - n;
+   if (pos < 0) pos = 0;
+   if (pos > max) pos = max;
+   return (aln_t) {s.chr, pos, s.dir < 0, qb, qe};
+}
+
+void
+write_record
+(
+ gen_t       * g,
+ const char  * name,
+ int           flag,
+ aln_t       * a,
+ int           mapq,
+ aln_t       * sa,
+ int           nsa,
+ int           as,
+ int           xs,
+ int           hard
+)
+{
+   FILE * f = g->out;
+   if (a == NULL) {
+      // Unmapped.
+      fprintf(f, "%s\t%d\t*\t0\t0\t*\t*\t0\t0\t", name, flag | 0x4);
+      for (int i = 0; i < g->len; i++)
+         fputc("ACGT"[rnd(g) & 3], f);
+      fputc('\t', f);
+      for (int i = 0; i < g->len; i++)
+         fputc('F', f);
+      fprintf(f, "\tAS:i:0\tXS:i:0\n");
+      g->nrec++;
+      return;
+   }
+
+   // Clips in reference orientation.
+   int n  = a->qe - a->qb;
+   int c5 = a->rc ? g->len - a->qe : a->qb;
+   int c3 = a->rc ? a->qb : g->len - a->qe;
+   char clip = hard ? 'H' : 'S';
+   fprintf(f, "%s\t%d\t%s\t%ld\t%d\t", name, flag | (a->rc ? 0x10 : 0), g->chr[a->chr].name, a->pos + 1, mapq);
+   if (c5) fprintf(f, "%d%c", c5, clip);
+   fprintf(f, "%dM", n);
+   if (c3) fprintf(f, "%d%c", c3, clip);
+   fprintf(f, "\t*\t0\t0\t");
+
+   // Sequence of the alignment (and of the soft clips, random).
+   int slen = hard ? n : g->len;
+   const char * ref = g->chr[a->chr].seq + a->pos;
+   for (int i = 0; i < slen; i++) {
+      int j = hard ? i : i - c5;
+      fputc(j >= 0 && j < n ? ref[j] : "ACGT"[rnd(g) & 3], f);
+   }
+   fputc('\t', f);
+   for (int i = 0; i < slen; i++)
+      fputc('F', f);
+   fprintf(f, "\tNM:i:0\tAS:i:%d\tXS:i:%d", as, xs);
+   if (nsa > 0) {
+      fprintf(f, "\tSA:Z:");
+      for (int i = 0; i < nsa; i++) {
+         int sn = sa[i].qe - sa[i].qb;
+         int s5 = sa[i].rc ? g->len - sa[i].qe : sa[i].qb;
+         int s3 = sa[i].rc ? sa[i].qb : g->len - sa[i].qe;
+         fprintf(f, "%s,%ld,%c,", g->chr[sa[i].chr].name, sa[i].pos + 1, sa[i].rc ? '-' : '+');
+         if (s5) fprintf(f, "%dS", s5);
+         fprintf(f, "%dM", sn);
+         if (s3) fprintf(f, "%dS", s3);
+         fprintf(f, ",60,0;");
+      }
+   }
+   fputc('\n', f);
+   g->nrec++;
+}
+
+// Writes the records of a pair: r[0] is the primary of R1, r[1] that of R2,
+// r[2] (if nr > 2) the supplementary of R1 and r[3] (if nr > 3) a secondary
+// of R2. Read `unmapped` (1 or 2) does not map.
+void
+write_pair
+(
+ gen_t * g,
+ long    id,
+ aln_t * r,
+ int     nr,
+ int   * mapq,
+ int     unmapped
+)
+{
+   char name[32];
+   sprintf(name, "read%09ld", id);
+   int n0 = r[0].qe - r[0].qb;
+   int n1 = r[1].qe - r[1].qb;
+   int s2 = nr > 2 ? r[2].qe - r[2].qb : 0;
+   write_record(g, name, 0x41, unmapped == 1 ? NULL : r, mapq[0], r + 2, nr > 2, n0, mapq[0] ? 0 : n0, 0);
+   if (nr > 2)
+      write_record(g, name, 0x841, r + 2, 60, r, 1, s2, 0, 1);
+   write_record(g, name, 0x81, unmapped == 2 ? NULL : r + 1, mapq[1], NULL, 0, n1, mapq[1] ? 0 : n1, 0);
+   if (nr > 3)
+      write_record(g, name, 0x181, r + 3, 0, NULL, 0, n1, n1, 0);
+}
+
+int
+pair_event
+(
+ gen_t * g
+)
+{
+   double u = rnd_unit(g);
+   for (int e = 0; e < EV_VALID; e++) {
+      if (u < g->rate[e]) return e;
+      u -= g->rate[e];
+   }
+   return EV_VALID;
+}
+
+int main(int argc, char *argv[])
+{
+   long   mb    = DEFAULT_MB;
+   long   pairs = DEFAULT_PAIRS;
+   gen_t  g     = {
+      .x    = 0x9e3779b97f4a7c15UL,
+      .nchr = DEFAULT_CHR,
+      .len  = DEFAULT_READLEN,
+      .rate = {0.05, 0.05, 0.03, 0.01, 0.02, 0.02, 0}
+   };
+   int opt;
+   while ((opt = getopt(argc, argv, "c:C:D:g:l:M:n:P:s:S:U:")) != -1) {
+      switch (opt) {
+      case 'c': g.nchr = atoi(optarg); break;
+      case 'g': mb = atol(optarg); break;
+      case 'l': g.len = atoi(optarg); break;
+      case 'n': pairs = atol(optarg); break;
+      case 's': g.x ^= strtoul(optarg, NULL, 10) * 0xbf58476d1ce4e5b9UL; break;
+      case 'C': g.rate[EV_CHIMERIC] = atof(optarg); break;
+      case 'M': g.rate[EV_MULTI] = atof(optarg); break;
+      case 'D': g.rate[EV_DANGLING] = atof(optarg); break;
+      case 'S': g.rate[EV_SELF] = atof(optarg); break;
+      case 'P': g.rate[EV_DUP] = atof(optarg); break;
+      case 'U': g.rate[EV_UNMAPPED] = atof(optarg); break;
+      default: argc = 0;
+      }
+   }
+   double total = 0;
+   for (int e = 0; e < EV_VALID; e++)
+      total += g.rate[e];
+   if (argc - optind != 2 || mb <= 0 || pairs <= 0 || g.nchr <= 0 || g.len < 40 || total > 1) {
+      fprintf(stderr, "usage: %s [-s seed] [-g genome MB] [-c chromosomes] [-n read pairs] [-l read length]\n"
+              "          [-C chimeric] [-M multi-mapped] [-D dangling-end] [-S self-ligation] [-P duplicate]\n"
+              "          [-U unmapped] <genome.fasta> <reads.sam>\n", argv[0]);
+      fprintf(stderr, "  defaults: -g %d -c %d -n %d -l %d -C 0.05 -M 0.05 -D 0.03 -S 0.01 -P 0.02 -U 0.02\n",
+              DEFAULT_MB, DEFAULT_CHR, DEFAULT_PAIRS, DEFAULT_READLEN);
+      fprintf(stderr, "  rates are fractions of the read pairs (the rest are valid pairs)\n");
+      exit(1);
+   }
+
+   make_genome(&g, mb << 20);
+   write_fasta(&g, argv[optind]);
+
+   g.out = fopen(argv[optind+1], "w");
+   if (g.out == NULL) {
+      fprintf(stderr, "error opening %s.\n", argv[optind+1]);
+      exit(1);
+   }
+   fprintf(g.out, "@HD\tVN:1.6\tSO:unsorted\n");
+   for (int c = 0; c < g.nchr; c++)
+      fprintf(g.out, "@SQ\tSN:%s\tLN:%ld\n", g.chr[c].name, g.chr[c].len);
+   fprintf(g.out, "@PG\tID:gen_hic\tPN:gen_hic\n");
+
+   long count[NEVENTS] = {0};
+   aln_t r[4];
+   int   nr = 2, mapq[2] = {60, 60}, unmapped = 0;
+   for (long id = 0; id < pairs; id++) {
+      int e = pair_event(&g);
+      if (e == EV_DUP && id == 0) e = EV_VALID;
+      count[e]++;
+      if (e != EV_DUP) {
+         nr = 2;
+         mapq[0] = mapq[1] = 60;
+         unmapped = 0;
+      }
+      switch (e) {
+      case EV_DANGLING:
+      case EV_SELF: {
+         // One fragment, longer than the insert.
+         side_t s;
+         long   next;
+         gchr_t * chr;
+         int    tries = 0;
+         do {
+            s = random_side(&g);
+            s.dir = 1;
+            chr = g.chr + s.chr;
+            long lo = 0, hi = chr->nsites;
+            while (hi - lo > 1) {
+               long mid = (lo + hi)/2;
+               if (chr->site[mid] <= s.site) lo = mid;
+               else hi = mid;
+            }
+            next = lo + 1 < chr->nsites ? chr->site[lo + 1] : chr->len;
+         } while (next - s.site < 3*g.len && ++tries < 100);
+         long flen = next - s.site;
+         long a = s.site + rnd_range(&g, flen/3);
+         long b = next - rnd_range(&g, flen/3) - g.len;
+         if (b < a) b = a;
+         if (b > chr->len - g.len) b = chr->len - g.len;
+         if (a > b) a = b;
+         // Dangling: R1 forward at a, R2 reverse at b. Self-ligation:
+         // R1 reverse at a, R2 forward at b (outwards).
+         int self = e == EV_SELF;
+         r[0] = (aln_t) {s.chr, a, self, 0, g.len};
+         r[1] = (aln_t) {s.chr, b, !self, 0, g.len};
+         break;
+      }
+      case EV_DUP:
+         // Same alignments as the previous pair.
+         break;
+      default: {
+         side_t sa = random_side(&g);
+         side_t sb = partner_side(&g, sa);
+         int    d2 = g.len + rnd_range(&g, MAX_DIST - g.len);
+         r[1] = read_to_site(&g, sb, d2, 0, g.len);
+         if (e == EV_CHIMERIC) {
+            // R1 crosses the junction after d1 nucleotides.
+            int d1 = 20 + rnd_range(&g, g.len - 40);
+            r[0] = read_to_site(&g, sa, d1, 0, d1);
+            r[2] = read_from_site(&g, sb, d1, g.len);
+            nr = 3;
+         } else {
+            int d1 = g.len + rnd_range(&g, MAX_DIST - g.len);
+            r[0] = read_to_site(&g, sa, d1, 0, g.len);
+         }
+         if (e == EV_MULTI) {
+            // R2 maps equally well elsewhere.
+            mapq[1] = 0;
+            r[3] = read_to_site(&g, random_side(&g), d2, 0, g.len);
+            nr = 4;
+         }
+         if (e == EV_UNMAPPED)
+            unmapped = 1 + (rnd(&g) & 1);
+      }
+      }
+      write_pair(&g, id, r, nr, mapq, unmapped);
+   }
+   if (fclose(g.out)) {
+      fprintf(stderr, "error writing %s.\n", argv[optind+1]);
+      exit(1);
+   }
+
+   const char * names[] = {"chimeric", "multi-mapped", "dangling-end", "self-ligation", "duplicate", "unmapped", "valid"};
+   long glen = 0;
+   for (int c = 0; c < g.nchr; c++)
+      glen += g.chr[c].len;
+   fprintf(stderr, "genome: %ld bp (%d chromosomes)\n", glen, g.nchr);
+   fprintf(stderr, "read pairs: %ld (%ld records)\n", pairs, g.nrec);
+   for (int e = 0; e < NEVENTS; e++)
+      fprintf(stderr, " - %-14s %ld\n", names[e], count[e]);
+
+   for (int c = 0; c < g.nchr; c++) {
+      free(g.chr[c].seq);
+      free(g.chr[c].site);
+   }
+   free(g.chr);
+   return 0;
+}
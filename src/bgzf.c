@@ -0,0 +1,320 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "bgzf.h"
+
+#define min(a,b) ((a) < (b) ? (a) : (b))
+
+#define SLOT_FREE 0
+#define SLOT_BUSY 1
+#define SLOT_DONE 2
+
+#define GZIP_BUFSIZE (1 << 16)
+
+// Empty block that ends a BGZF file (a file cut at a block boundary would
+// otherwise look complete).
+static const unsigned char bgzf_eof[28] = {
+   0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00,
+   0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+   0x00, 0x00, 0x00, 0x00
+};
+
+// Function headers.
+ssize_t        bgzf_fill    (bgzf_t * z, void * buf, size_t len);
+void         * bgzf_worker  (void * arg);
+ssize_t        gzip_read    (bgzf_t * z, unsigned char * buf, size_t len);
+ssize_t        blocks_read  (bgzf_t * z, unsigned char * buf, size_t len);
+
+// Source.
+
+bgzf_t *
+bgzf_open
+(
+ const char * path,
+ int          threads
+)
+{
+   int fd = open(path, O_RDONLY);
+   if (fd < 0) return NULL;
+   bgzf_t * z = bgzf_fdopen(fd, threads);
+   if (z == NULL) close(fd);
+   return z;
+}
+
+bgzf_t *
+bgzf_fdopen
+(
+ int fd,
+ int threads
+)
+{
+   bgzf_t * z = calloc(1, sizeof(bgzf_t));
+   if (z == NULL) return NULL;
+   z->fd = fd;
+
+   // Detect format from the first bytes.
+   ssize_t b;
+   while (z->npeek < BGZF_HEADER && (b = read(fd, z->peek + z->npeek, BGZF_HEADER - z->npeek)) > 0)
+      z->npeek += b;
+
+   unsigned char * h = z->peek;
+   if (z->npeek < 2 || h[0] != 0x1f || h[1] != 0x8b) {
+      z->mode = BGZF_PLAIN;
+   } else if (z->npeek == BGZF_HEADER && (h[3] & 4) && h[10] == 6 &&
+              h[12] == 'B' && h[13] == 'C' && h[14] == 2 && h[15] == 0) {
+      // BGZF: gzip members with a 'BC' extra field holding the block size.
+      z->mode = BGZF_BLOCKS;
+      z->nthreads = threads < 1 ? 1 : threads;
+      z->nslots = 4*z->nthreads;
+      z->slot = calloc(z->nslots, sizeof(bgzf_block_t));
+      z->tid = malloc(z->nthreads*sizeof(pthread_t));
+      if (z->slot == NULL || z->tid == NULL) {
+         free(z->slot);
+         free(z->tid);
+         free(z);
+         return NULL;
+      }
+      pthread_mutex_init(&z->lock, NULL);
+      pthread_cond_init(&z->cond, NULL);
+      for (int i = 0; i < z->nthreads; i++)
+         pthread_create(z->tid+i, NULL, bgzf_worker, z);
+   } else {
+      z->mode = BGZF_GZIP;
+      z->zbuf = malloc(GZIP_BUFSIZE);
+      if (z->zbuf == NULL || inflateInit2(&z->zs, 15+16) != Z_OK) {
+         free(z->zbuf);
+         free(z);
+         return NULL;
+      }
+   }
+
+   return z;
+}
+
+ssize_t
+bgzf_fill
+(
+ bgzf_t * z,
+ void   * buf,
+ size_t   len
+)
+{
+   // Read len bytes from the file (peeked bytes first).
+   if (z->ranged) len = min(len, (size_t) z->left);
+   size_t n = min(len, (size_t)(z->npeek - z->ppeek));
+   memcpy(buf, z->peek + z->ppeek, n);
+   z->ppeek += n;
+   ssize_t b;
+   while (n < len && (b = read(z->fd, (char *)buf + n, len - n)) > 0)
+      n += b;
+   if (z->ranged) z->left -= n;
+   return n;
+}
+
+// Restricts the reads of a plain file to the bytes [beg,end). Returns -1 if
+// the file is compressed or not seekable.
+int
+bgzf_range
+(
+ bgzf_t * z,
+ long     beg,
+ long     end
+)
+{
+   if (z->mode != BGZF_PLAIN || lseek(z->fd, beg, SEEK_SET) < 0)
+      return -1;
+   z->npeek = z->ppeek = 0;
+   z->ranged = 1;
+   z->left = end > beg ? end - beg : 0;
+   return 0;
+}
+
+ssize_t
+bgzf_read
+(
+ bgzf_t * z,
+ void   * buf,
+ size_t   len
+)
+{
+   switch (z->mode) {
+   case BGZF_BLOCKS:
+      return blocks_read(z, buf, len);
+   case BGZF_GZIP:
+      return gzip_read(z, buf, len);
+   default:
+      return bgzf_fill(z, buf, len);
+   }
+}
+
+ssize_t
+gzip_read
+(
+ bgzf_t        * z,
+ unsigned char * buf,
+ size_t          len
+)
+{
+   z->zs.next_out = buf;
+   z->zs.avail_out = len;
+   while (z->zs.avail_out > 0) {
+      if (z->zs.avail_in == 0) {
+         z->zs.next_in = z->zbuf;
+         z->zs.avail_in = bgzf_fill(z, z->zbuf, GZIP_BUFSIZE);
+         if (z->zs.avail_in == 0) {
+            if (!z->zend) {
+               fprintf(stderr, "error: truncated gzip file.\n");
+               exit(1);
+            }
+            break;
+         }
+      }
+      if (z->zend) {
+         // Concatenated gzip members.
+         inflateReset(&z->zs);
+         z->zend = 0;
+      }
+      int ret = inflate(&z->zs, Z_NO_FLUSH);
+      if (ret == Z_STREAM_END) {
+         z->zend = 1;
+      } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+         fprintf(stderr, "error: corrupted gzip file (%s).\n", z->zs.msg ? z->zs.msg : "inflate");
+         exit(1);
+      }
+   }
+   return len - z->zs.avail_out;
+}
+
+ssize_t
+blocks_read
+(
+ bgzf_t        * z,
+ unsigned char * buf,
+ size_t          len
+)
+{
+   size_t n = 0;
+   while (n < len) {
+      bgzf_block_t * block = z->slot + (z->nconsumed % z->nslots);
+      // Wait for the next block in file order.
+      pthread_mutex_lock(&z->lock);
+      while (!(z->nconsumed < z->nread && block->state == SLOT_DONE) &&
+             !(z->eof && z->nconsumed == z->nread))
+         pthread_cond_wait(&z->cond, &z->lock);
+      int end = z->nconsumed == z->nread;
+      pthread_mutex_unlock(&z->lock);
+      if (end) break;
+
+      size_t cnt = min(block->ulen - z->upos, len - n);
+      memcpy(buf + n, block->udata + z->upos, cnt);
+      n += cnt;
+      z->upos += cnt;
+      if (z->upos == block->ulen) {
+         // Release slot.
+         pthread_mutex_lock(&z->lock);
+         block->state = SLOT_FREE;
+         z->nconsumed++;
+         z->upos = 0;
+         pthread_cond_broadcast(&z->cond);
+         pthread_mutex_unlock(&z->lock);
+      }
+   }
+   return n;
+}
+
+void *
+bgzf_worker
+(
+ void * arg
+)
+{
+   bgzf_t * z = (bgzf_t *) arg;
+   z_stream zs = {0};
+   inflateInit2(&zs, -15);
+
+   pthread_mutex_lock(&z->lock);
+   while (1) {
+      while (!z->eof && !z->stop && z->nread - z->nconsumed >= z->nslots)
+         pthread_cond_wait(&z->cond, &z->lock);
+      if (z->eof || z->stop) break;
+
+      // Read next block (the file is read in order, under the lock).
+      bgzf_block_t * block = z->slot + (z->nread % z->nslots);
+      unsigned char * h = block->cdata;
+      size_t hlen = bgzf_fill(z, h, BGZF_HEADER);
+      if (hlen == 0) {
+         if (!z->marker) {
+            fprintf(stderr, "error: truncated BGZF file (no end-of-file marker).\n");
+            exit(1);
+         }
+         z->eof = 1;
+         pthread_cond_broadcast(&z->cond);
+         break;
+      }
+      if (hlen < BGZF_HEADER || h[0] != 0x1f || h[1] != 0x8b || h[12] != 'B' || h[13] != 'C') {
+         fprintf(stderr, "error: corrupted BGZF file (invalid block header).\n");
+         exit(1);
+      }
+      block->clen = (h[16] | (h[17] << 8)) + 1;
+      if (block->clen < BGZF_HEADER + 8 ||
+          bgzf_fill(z, h + BGZF_HEADER, block->clen - BGZF_HEADER) != block->clen - BGZF_HEADER) {
+         fprintf(stderr, "error: corrupted BGZF file (truncated block).\n");
+         exit(1);
+      }
+      z->marker = block->clen == sizeof(bgzf_eof) && memcmp(h, bgzf_eof, sizeof(bgzf_eof)) == 0;
+      block->state = SLOT_BUSY;
+      z->nread++;
+      pthread_mutex_unlock(&z->lock);
+
+      // Inflate block.
+      unsigned char * t = h + block->clen - 8;
+      uLong crc  = t[0] | (t[1] << 8) | (t[2] << 16) | ((uLong) t[3] << 24);
+      size_t isize = t[4] | (t[5] << 8) | (t[6] << 16) | ((size_t) t[7] << 24);
+      inflateReset(&zs);
+      zs.next_in = h + BGZF_HEADER;
+      zs.avail_in = block->clen - BGZF_HEADER - 8;
+      zs.next_out = block->udata;
+      zs.avail_out = BGZF_MAX_BLOCK;
+      if (isize > BGZF_MAX_BLOCK || inflate(&zs, Z_FINISH) != Z_STREAM_END ||
+          zs.total_out != isize || crc32(0, block->udata, isize) != crc) {
+         fprintf(stderr, "error: corrupted BGZF file (bad block data).\n");
+         exit(1);
+      }
+      block->ulen = isize;
+
+      pthread_mutex_lock(&z->lock);
+      block->state = SLOT_DONE;
+      pthread_cond_broadcast(&z->cond);
+   }
+   pthread_mutex_unlock(&z->lock);
+
+   inflateEnd(&zs);
+   return NULL;
+}
+
+void
+bgzf_close
+(
+ bgzf_t * z
+)
+{
+   if (z == NULL) return;
+   if (z->mode == BGZF_BLOCKS) {
+      pthread_mutex_lock(&z->lock);
+      z->stop = 1;
+      pthread_cond_broadcast(&z->cond);
+      pthread_mutex_unlock(&z->lock);
+      for (int i = 0; i < z->nthreads; i++)
+         pthread_join(z->tid[i], NULL);
+      free(z->tid);
+      free(z->slot);
+   } else if (z->mode == BGZF_GZIP) {
+      inflateEnd(&z->zs);
+      free(z->zbuf);
+   }
+   close(z->fd);
+   free(z);
+}
@@ -0,0 +1,63 @@
+#ifndef _BGZF_H
+#define _BGZF_H
+
+#include <pthread.h>
+#include <zlib.h>
+
+#define BGZF_PLAIN  0
+#define BGZF_GZIP   1
+#define BGZF_BLOCKS 2
+
+#define BGZF_MAX_BLOCK 65536
+#define BGZF_HEADER    18
+
+// Struct definitions.
+
+typedef struct {
+   int             state;
+   size_t          clen;
+   size_t          ulen;
+   unsigned char   cdata[BGZF_MAX_BLOCK];
+   unsigned char   udata[BGZF_MAX_BLOCK];
+} bgzf_block_t;
+
+// Sequential reader of plain, gzip or BGZF files. BGZF blocks are read in
+// order and inflated by a pool of threads; bgzf_read returns the data in
+// the original order.
+typedef struct {
+   int              fd;
+   int              mode;
+   // Bytes read to detect the format.
+   unsigned char    peek[BGZF_HEADER];
+   int              npeek;
+   int              ppeek;
+   // Byte range of a plain file (see bgzf_range).
+   int              ranged;
+   long             left;
+   // gzip stream.
+   z_stream         zs;
+   unsigned char  * zbuf;
+   int              zend;
+   // BGZF blocks.
+   int              nthreads;
+   pthread_t      * tid;
+   int              nslots;
+   bgzf_block_t   * slot;
+   long             nread;
+   long             nconsumed;
+   int              marker;
+   int              eof;
+   int              stop;
+   size_t           upos;
+   pthread_mutex_t  lock;
+   pthread_cond_t   cond;
+} bgzf_t;
+
+// Function headers.
+bgzf_t       * bgzf_open    (const char * path, int threads);
+bgzf_t       * bgzf_fdopen  (int fd, int threads);
+ssize_t        bgzf_read    (bgzf_t * z, void * buf, size_t len);
+int            bgzf_range   (bgzf_t * z, long beg, long end);
+void           bgzf_close   (bgzf_t * z);
+
+#endif
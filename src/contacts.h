@@ -0,0 +1,50 @@
+#ifndef _CONTACTS_H
+#define _CONTACTS_H
+
+#include <stdint.h>
+
+// Binary contact records (parse_contacts -b), read by merge_contacts.
+//
+// All integers are little-endian.
+//   offset 0            cbhdr_t.
+//   24                  chromosome dictionary: the names of the chromosome
+//                       IDs (NUL-terminated, names_size bytes). IDs are
+//                       sorted like the names.
+//   24 + names_size     cbrec_t records, each followed by its read ID
+//                       (uint64_t, the index of the read group in the
+//                       input) if flags has CB_READID.
+// Contacts are written as in the text formats: the first end is the one
+// with the lowest chromosome (then position). Loci are 64-bit (version 2),
+// for chromosomes longer than 4 Gbp.
+
+#define CB_MAGIC      "HCB1"
+#define CB_VERSION    2
+#define CB_READID     0x1
+
+#define CB_RC1        0x1
+#define CB_RC2        0x2
+
+// Struct definitions.
+
+typedef struct {
+   char     magic[4];
+   uint32_t version;
+   uint32_t nchrom;
+   uint32_t flags;
+   uint64_t names_size;
+} cbhdr_t;
+
+typedef struct {
+   int32_t  chr1;
+   int32_t  chr2;
+   uint64_t pos1;
+   uint64_t pos2;
+   int32_t  frag1;
+   int32_t  frag2;
+   uint8_t  strand;
+   uint8_t  mapq1;
+   uint8_t  mapq2;
+   uint8_t  pad[5];
+} cbrec_t;
+
+#endif
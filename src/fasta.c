@@ -0,0 +1,204 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "fasta.h"
+
+#define min(a,b) ((a) < (b) ? (a) : (b))
+
+// Source.
+
+fai_t *
+fai_new
+(
+ void
+)
+{
+   fai_t * fai = malloc(sizeof(fai_t));
+   if (fai == NULL) return NULL;
+   fai->n = 0;
+   fai->size = 64;
+   fai->chr = malloc(fai->size*sizeof(faichr_t));
+   if (fai->chr == NULL) {
+      free(fai);
+      return NULL;
+   }
+   return fai;
+}
+
+faichr_t *
+fai_push
+(
+ fai_t * fai
+)
+{
+   if (fai->n >= fai->size) {
+      int newsize = 2*fai->size;
+      faichr_t * chr = realloc(fai->chr, newsize*sizeof(faichr_t));
+      if (chr == NULL) return NULL;
+      fai->chr = chr;
+      fai->size = newsize;
+   }
+   faichr_t * chr = fai->chr + fai->n++;
+   memset(chr, 0, sizeof(faichr_t));
+   return chr;
+}
+
+// Indexes the FASTA file mapped in 'map'. As with samtools faidx, all the
+// lines of a sequence except the last must have the same length. Returns
+// NULL if the file does not satisfy that.
+fai_t *
+fai_build
+(
+ const char * map,
+ size_t       size
+)
+{
+   fai_t    * fai = fai_new();
+   faichr_t * chr = NULL;
+   int        last = 0;   // The last (shorter) line of chr was seen.
+   size_t     p = 0;
+
+   while (p < size) {
+      const char * eol = memchr(map + p, '\n', size - p);
+      size_t next = eol ? (size_t)(eol - map) + 1 : size;
+      size_t len = (eol ? (size_t)(eol - map) : size) - p;
+      int cr = len > 0 && map[p+len-1] == '\r';
+
+      if (map[p] == '>') {
+         // New chromosome.
+         size_t n = 1;
+         while (n < len && !isspace(map[p+n])) n++;
+         chr = fai_push(fai);
+         chr->name = strndup(map + p + 1, n - 1);
+         chr->offset = next;
+         last = 0;
+      } else if (len - cr > 0) {
+         if (chr == NULL || last) goto bad_format;
+         if (chr->linebases == 0) {
+            chr->linebases = len - cr;
+            chr->linewidth = next - p;
+         } else if (len - cr != chr->linebases || next - p != chr->linewidth) {
+            // Only the last line may be different (and shorter).
+            if (len - cr > chr->linebases) goto bad_format;
+            last = 1;
+         }
+         chr->len += len - cr;
+      } else if (chr != NULL && chr->len > 0) {
+         // Empty line, only allowed at the end of a sequence.
+         last = 1;
+      }
+      p = next;
+   }
+
+   return fai;
+
+ bad_format:
+   fprintf(stderr, "warning: different line length in sequence '%s' (not indexable).\n", chr ? chr->name : "");
+   fai_destroy(fai);
+   return NULL;
+}
+
+// Reads the index 'path'.fai, or builds it from the mapped FASTA file
+// and saves it next to the FASTA (if the directory is writable).
+fai_t *
+fai_load
+(
+ const char * path,
+ const char * map,
+ size_t       size
+)
+{
+   char * fai_path = malloc(strlen(path)+5);
+   sprintf(fai_path, "%s.fai", path);
+
+   FILE * f = fopen(fai_path, "r");
+   if (f == NULL) {
+      fai_t * fai = fai_build(map, size);
+      if (fai != NULL && fai_write(fai, fai_path))
+         fprintf(stderr, "warning: could not write index %s.\n", fai_path);
+      free(fai_path);
+      return fai;
+   }
+
+   fai_t * fai = fai_new();
+   size_t bufsize = 200;
+   char * line = malloc(bufsize);
+   while (getline(&line, &bufsize, f) > 0) {
+      char name[4096];
+      faichr_t rec;
+      if (sscanf(line, "%4095s\t%ld\t%ld\t%d\t%d", name, &rec.len, &rec.offset, &rec.linebases, &rec.linewidth) != 5 ||
+          (rec.len > 0 && (rec.linebases < 1 || rec.linewidth < rec.linebases ||
+                           rec.offset + (rec.len/rec.linebases)*rec.linewidth > size))) {
+         fprintf(stderr, "error: invalid index (%s), remove it to rebuild.\n", fai_path);
+         fai_destroy(fai);
+         fai = NULL;
+         break;
+      }
+      faichr_t * chr = fai_push(fai);
+      *chr = rec;
+      chr->name = strdup(name);
+   }
+
+   free(line);
+   free(fai_path);
+   fclose(f);
+   return fai;
+}
+
+int
+fai_write
+(
+ const fai_t * fai,
+ const char  * path
+)
+{
+   FILE * f = fopen(path, "w");
+   if (f == NULL) return 1;
+   for (int i = 0; i < fai->n; i++) {
+      faichr_t * chr = fai->chr + i;
+      fprintf(f, "%s\t%ld\t%ld\t%d\t%d\n", chr->name, chr->len, chr->offset, chr->linebases, chr->linewidth);
+   }
+   return fclose(f) != 0;
+}
+
+// Copies the nucleotides [beg,end) of chromosome i to buf, skipping the
+// newlines. Returns the number of nucleotides copied.
+long
+fai_fetch
+(
+ const fai_t * fai,
+ const char  * map,
+ int           i,
+ long          beg,
+ long          end,
+ char        * buf
+)
+{
+   faichr_t * chr = fai->chr + i;
+   end = min(end, chr->len);
+   long n = 0;
+   while (beg < end) {
+      long line = beg / chr->linebases;
+      long col  = beg % chr->linebases;
+      long cnt  = min(chr->linebases - col, end - beg);
+      memcpy(buf + n, map + chr->offset + line*chr->linewidth + col, cnt);
+      n   += cnt;
+      beg += cnt;
+   }
+   return n;
+}
+
+void
+fai_destroy
+(
+ fai_t * fai
+)
+{
+   if (fai == NULL) return;
+   for (int i = 0; i < fai->n; i++)
+      free(fai->chr[i].name);
+   free(fai->chr);
+   free(fai);
+}
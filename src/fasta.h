@@ -0,0 +1,28 @@
+#ifndef _FASTA_H
+#define _FASTA_H
+
+// Struct definitions.
+
+// One record of a samtools-style .fai index.
+typedef struct {
+   char * name;
+   long   len;
+   long   offset;
+   int    linebases;
+   int    linewidth;
+} faichr_t;
+
+typedef struct {
+   int        n;
+   int        size;
+   faichr_t * chr;
+} fai_t;
+
+// Function headers.
+fai_t        * fai_load     (const char * path, const char * map, size_t size);
+fai_t        * fai_build    (const char * map, size_t size);
+int            fai_write    (const fai_t * fai, const char * path);
+long           fai_fetch    (const fai_t * fai, const char * map, int chr, long beg, long end, char * buf);
+void           fai_destroy  (fai_t * fai);
+
+#endif
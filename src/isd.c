@@ -0,0 +1,653 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include "isd.h"
+
+#define page_align(x) (((x) + ISD_PAGE_SIZE - 1) / ISD_PAGE_SIZE * ISD_PAGE_SIZE)
+#define nblocks(cnt) (((cnt) + ISD_BLOCK - 1) / ISD_BLOCK)
+
+// Function headers.
+int            isd_parse_v1  (isd_t * isd);
+int            isd_parse_v2  (isd_t * isd, int verify);
+int            pwrite_all    (int fd, const void * buf, size_t len, off_t offset);
+long           bisection     (const int64_t * data, long beg, long end, long target);
+void           isd_index     (isdchr_t * chr);
+long           bucket        (const isdchr_t * chr, long pos);
+uint64_t     * pack_sites    (const int64_t * site, long cnt, size_t * size);
+
+// Source.
+
+isd_t *
+isd_open
+(
+ const char * path,
+ int          verify
+)
+{
+   int fd = open(path, O_RDONLY);
+   if (fd < 0) {
+      fprintf(stderr, "error while opening RE database: %s.\n", path);
+      return NULL;
+   }
+
+   struct stat sb;
+   if (fstat(fd, &sb) == -1 || sb.st_size == 0) {
+      fprintf(stderr, "error reading digestion file (fstat).\n");
+      close(fd);
+      return NULL;
+   }
+
+   isd_t * isd = calloc(1, sizeof(isd_t));
+   isd->size = sb.st_size;
+   isd->map = mmap(0, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (isd->map == MAP_FAILED) {
+      fprintf(stderr, "error reading digestion file (mmap).\n");
+      free(isd);
+      return NULL;
+   }
+
+   int err;
+   if (isd->size >= sizeof(isdhdr_t) && memcmp(isd->map, ISD_MAGIC, 4) == 0)
+      err = isd_parse_v2(isd, verify);
+   else
+      err = isd_parse_v1(isd);
+
+   if (err) {
+      fprintf(stderr, "error reading digestion file: %s (corrupted or truncated).\n", path);
+      isd_close(isd);
+      return NULL;
+   }
+
+   for (int i = 0; i < isd->nchrom; i++)
+      isd_index(isd->chrom + i);
+
+   return isd;
+}
+
+int
+isd_parse_v2
+(
+ isd_t * isd,
+ int     verify
+)
+{
+   // Only the header and the TOC are read, site arrays are used in place.
+   isdhdr_t * hdr = (isdhdr_t *) isd->map;
+   if (hdr->version != ISD_VERSION || hdr->page_size != ISD_PAGE_SIZE)
+      return 1;
+
+   size_t enz_end = sizeof(isdhdr_t) + hdr->nenz*sizeof(isdenz_t);
+   size_t toc_end = hdr->toc_offset + hdr->nchrom*sizeof(isdtoc_t);
+   if (enz_end > isd->size || toc_end + hdr->names_size > isd->size ||
+       hdr->toc_offset < enz_end)
+      return 1;
+
+   isd->version = ISD_VERSION;
+   isd->nenz = hdr->nenz;
+   isd->enz = (isdenz_t *) (isd->map + sizeof(isdhdr_t));
+   isd->nchrom = hdr->nchrom;
+
+   isdtoc_t * toc = (isdtoc_t *) (isd->map + hdr->toc_offset);
+   char * names = isd->map + toc_end;
+
+   // Header checksum.
+   uLong crc = crc32(0, (unsigned char *) isd->enz, hdr->nenz*sizeof(isdenz_t));
+   crc = crc32(crc, (unsigned char *) toc, hdr->nchrom*sizeof(isdtoc_t));
+   crc = crc32(crc, (unsigned char *) names, hdr->names_size);
+   if (crc != hdr->crc)
+      return 1;
+
+   isd->chrom = calloc(isd->nchrom, sizeof(isdchr_t));
+   for (int i = 0; i < isd->nchrom; i++) {
+      if (toc[i].name >= hdr->names_size || toc[i].offset + toc[i].size > isd->size)
+         return 1;
+      if (verify && crc32(0, (unsigned char *) isd->map + toc[i].offset, toc[i].size) != toc[i].crc)
+         return 1;
+      isdchr_t * chr = isd->chrom + i;
+      *chr = (isdchr_t) {
+         .chr     = names + toc[i].name,
+         .len     = toc[i].length,
+         .cnt     = toc[i].nsites,
+         .toc     = toc + i
+      };
+      if (toc[i].encoding == ISD_RAW64) {
+         if (toc[i].size != toc[i].nsites*sizeof(int64_t))
+            return 1;
+         chr->re_site = (int64_t *) (isd->map + toc[i].offset);
+      } else if (toc[i].encoding == ISD_PACKED) {
+         // Block index, then the packed deltas (one padding word).
+         chr->nblk = nblocks(chr->cnt);
+         chr->blk  = (isdblk_t *) (isd->map + toc[i].offset);
+         chr->bits = (uint64_t *) (chr->blk + chr->nblk + 1);
+         size_t index = (chr->nblk+1)*sizeof(isdblk_t);
+         if (chr->cnt < 1 || index > toc[i].size ||
+             (chr->blk[chr->nblk].offset + 63)/64*8 + 8 != toc[i].size - index)
+            return 1;
+         for (long b = 0; b < chr->nblk; b++)
+            if (chr->blk[b+1].offset < chr->blk[b].offset ||
+                chr->blk[b+1].offset - chr->blk[b].offset > 64*ISD_BLOCK)
+               return 1;
+      } else {
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+int
+isd_parse_v1
+(
+ isd_t * isd
+)
+{
+   // Legacy files are walked once and their 32-bit sites widened to
+   // 64-bit arrays, so that they are used as v2 files.
+   char * p = isd->map;
+   char * end = isd->map + isd->size;
+   int32_t val;
+
+   // Read RE information (comma-separated sequences, then the cut
+   // sites of each enzyme).
+   char * seqs = p;
+   if (memchr(p, 0, isd->size) == NULL) return 1;
+   isd->nenz = 1;
+   for (char * c = p; *c; c++)
+      isd->nenz += (*c == ',');
+   p += strlen(p)+1;
+   if (p + (2*isd->nenz + 1)*sizeof(int32_t) > end) return 1;
+
+   isd->enz = calloc(isd->nenz, sizeof(isdenz_t));
+   char * seq = seqs;
+   for (int i = 0; i < isd->nenz; i++) {
+      size_t len = strcspn(seq, ",");
+      memcpy(isd->enz[i].seq, seq, len < ISD_MAX_SEQ ? len : ISD_MAX_SEQ-1);
+      seq += len + 1;
+      memcpy(&isd->enz[i].cut_fw, p, sizeof(int32_t));
+      memcpy(&isd->enz[i].cut_rv, p + sizeof(int32_t), sizeof(int32_t));
+      p += 2*sizeof(int32_t);
+   }
+
+   // Get number of chromosomes.
+   memcpy(&val, p, sizeof(int32_t));
+   p += sizeof(int32_t);
+   isd->version = 1;
+   isd->nchrom = val;
+   isd->chrom = calloc(isd->nchrom, sizeof(isdchr_t));
+
+   // Parse each chromosome.
+   for (int i = 0; i < isd->nchrom; i++) {
+      isdchr_t * isdchr = isd->chrom + i;
+      // Chromosome name.
+      if (memchr(p, 0, end - p) == NULL) return 1;
+      isdchr->chr = p;
+      p += strlen(isdchr->chr)+1;
+      // Number of RE sites.
+      if (p + sizeof(int32_t) > end) return 1;
+      memcpy(&val, p, sizeof(int32_t));
+      p += sizeof(int32_t);
+      isdchr->cnt = val;
+      // RE site list.
+      if (val < 0 || p + isdchr->cnt*sizeof(int32_t) > end) return 1;
+      isdchr->re_site = malloc(isdchr->cnt*sizeof(int64_t));
+      for (long j = 0; j < isdchr->cnt; j++) {
+         memcpy(&val, p, sizeof(int32_t));
+         p += sizeof(int32_t);
+         isdchr->re_site[j] = val;
+      }
+      // The last site is the last nucleotide of the chromosome.
+      isdchr->len = isdchr->cnt ? isdchr->re_site[isdchr->cnt-1] + 1 : 0;
+   }
+
+   return 0;
+}
+
+void
+isd_close
+(
+ isd_t * isd
+)
+{
+   if (isd == NULL) return;
+   if (isd->version == 1) {
+      for (int i = 0; i < isd->nchrom; i++)
+         free(isd->chrom[i].re_site);
+      free(isd->enz);
+   }
+   for (int i = 0; i < isd->nchrom && isd->chrom; i++)
+      free(isd->chrom[i].bkt);
+   free(isd->chrom);
+   munmap(isd->map, isd->size);
+   free(isd);
+}
+
+// Finds the fragment of 'chr' containing 'pos', i.e. the sites beg <= pos
+// < end that flank it. Returns the index of the fragment.
+long
+isd_find
+(
+ const isdchr_t * chr,
+ long             pos,
+ long           * beg,
+ long           * end
+)
+{
+   // The bucket of pos and the next one bound the fragment (or block).
+   long lo = 0, hi = chr->re_site ? chr->cnt-2 : (chr->cnt-2) / ISD_BLOCK;
+   if (chr->bkt != NULL) {
+      long b = bucket(chr, pos);
+      lo = chr->bkt[b];
+      if (b+1 < chr->nbkt) hi = chr->bkt[b+1];
+   }
+
+   if (chr->re_site != NULL) {
+      long idx = lo;
+      if (pos < chr->re_site[lo])
+         // Before the first site (only if sites are repeated).
+         idx = bisection(chr->re_site, 0, chr->cnt-1, pos);
+      else if (hi - lo > 8)
+         idx = bisection(chr->re_site, lo, hi+1, pos);
+      else
+         while (idx < hi && chr->re_site[idx+1] <= pos) idx++;
+      *beg = chr->re_site[idx];
+      *end = chr->re_site[idx+1];
+      return idx;
+   }
+
+   // Last block whose first site is <= pos (the last site, which is the
+   // end of the chromosome, never starts a fragment).
+   while (lo < hi) {
+      long mid = (lo+hi+1)/2;
+      if (chr->blk[mid].first <= pos) lo = mid;
+      else hi = mid-1;
+   }
+   long b = lo;
+
+   // Decode the block until a site is beyond pos.
+   long     first = b*ISD_BLOCK;
+   long     n     = (b+1)*ISD_BLOCK < chr->cnt ? ISD_BLOCK : chr->cnt - first;
+   uint64_t off   = chr->blk[b].offset;
+   int      width = n > 1 ? (chr->blk[b+1].offset - off) / (n-1) : 0;
+   uint64_t mask  = width < 64 ? ((uint64_t)1 << width) - 1 : ~(uint64_t)0;
+   int64_t  site  = chr->blk[b].first;
+   long     idx   = first;
+   for (long j = 1; j < n; j++, off += width) {
+      uint64_t d = chr->bits[off/64] >> (off%64);
+      if (off%64 + width > 64) d |= chr->bits[off/64+1] << (64 - off%64);
+      int64_t next = site + (int64_t)(d & mask);
+      if (idx == chr->cnt-2 || next > pos) {
+         *beg = site;
+         *end = next;
+         return idx;
+      }
+      site = next;
+      idx++;
+   }
+   // Fragment ends at the first site of the next block.
+   *beg = site;
+   *end = chr->blk[b+1].first;
+   return idx;
+}
+
+// Finds the fragments of n queries. The lookups are interleaved: the
+// buckets of all the queries are prefetched, then their sites (or blocks),
+// so that the cache misses of different queries overlap.
+void
+isd_find_batch
+(
+ isdq_t * q,
+ long     n
+)
+{
+   for (long i = 0; i < n; i++) {
+      const isdchr_t * chr = q[i].chr;
+      if (chr->bkt != NULL)
+         __builtin_prefetch(chr->bkt + bucket(chr, q[i].pos));
+   }
+   for (long i = 0; i < n; i++) {
+      const isdchr_t * chr = q[i].chr;
+      if (chr->bkt == NULL) continue;
+      long lo = chr->bkt[bucket(chr, q[i].pos)];
+      if (chr->re_site != NULL)
+         __builtin_prefetch(chr->re_site + lo);
+      else
+         __builtin_prefetch(chr->blk + lo);
+   }
+   for (long i = 0; i < n; i++)
+      q[i].idx = isd_find(q[i].chr, q[i].pos, &q[i].beg, &q[i].end);
+}
+
+// Builds the bucket table of 'chr', with about one fragment (or block)
+// per bucket.
+void
+isd_index
+(
+ isdchr_t * chr
+)
+{
+   long n = chr->re_site ? chr->cnt-1 : chr->nblk;
+   if (chr->cnt < 2 || chr->len <= 0 || n < 1)
+      return;
+
+   chr->shift = 0;
+   while ((chr->len >> (chr->shift+1)) >= n)
+      chr->shift++;
+   chr->nbkt = (chr->len >> chr->shift) + 1;
+   chr->bkt = malloc(chr->nbkt * sizeof(uint32_t));
+   if (chr->bkt == NULL)
+      return;
+
+   // Last fragment (or block) that starts at or before each bucket (the
+   // last site is the end of the chromosome).
+   long last = chr->re_site ? chr->cnt-2 : (chr->cnt-2) / ISD_BLOCK;
+   long i = 0;
+   for (long b = 0; b < chr->nbkt; b++) {
+      int64_t pos = (int64_t) b << chr->shift;
+      if (chr->re_site != NULL)
+         while (i < last && chr->re_site[i+1] <= pos) i++;
+      else
+         while (i < last && chr->blk[i+1].first <= pos) i++;
+      chr->bkt[b] = i;
+   }
+}
+
+long
+bucket
+(
+ const isdchr_t * chr,
+ long             pos
+)
+{
+   if (pos <= 0) return 0;
+   long b = pos >> chr->shift;
+   return b < chr->nbkt ? b : chr->nbkt - 1;
+}
+
+long
+bisection
+(
+ const int64_t * data,
+ long            beg,
+ long            end,
+ long            target
+)
+{
+   while (end - beg >= 2) {
+      long mid = (beg+end)/2;
+      if (target < data[mid]) end = mid;
+      else if (target > data[mid]) beg = mid;
+      else return mid;
+   }
+   return beg;
+}
+
+int
+pwrite_all
+(
+ int          fd,
+ const void * buf,
+ size_t       len,
+ off_t        offset
+)
+{
+   size_t n = 0;
+   ssize_t b;
+   while (n < len && (b = pwrite(fd, (char *) buf + n, len - n, offset + n)) > 0)
+      n += b;
+   return n != len;
+}
+
+isdw_t *
+isd_create
+(
+ const char  * path,
+ const char  * name,
+ int           nenz,
+ char       ** seq,
+ int         * cut_fw,
+ int         * cut_rv,
+ int           encoding
+)
+{
+   isdw_t * w = calloc(1, sizeof(isdw_t));
+   if (w == NULL) return NULL;
+
+   w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (w->fd < 0) {
+      free(w);
+      return NULL;
+   }
+   w->encoding = encoding;
+
+   memcpy(w->hdr.magic, ISD_MAGIC, 4);
+   w->hdr.version = ISD_VERSION;
+   w->hdr.page_size = ISD_PAGE_SIZE;
+   w->hdr.nenz = nenz;
+   strncpy(w->hdr.name, name, sizeof(w->hdr.name)-1);
+
+   w->enz = calloc(nenz, sizeof(isdenz_t));
+   for (int i = 0; i < nenz; i++) {
+      strncpy(w->enz[i].seq, seq[i], ISD_MAX_SEQ-1);
+      w->enz[i].cut_fw = cut_fw[i];
+      w->enz[i].cut_rv = cut_rv[i];
+   }
+
+   w->size = 64;
+   w->toc = malloc(w->size*sizeof(isdtoc_t));
+   w->names_max = 1024;
+   w->names = malloc(w->names_max);
+   // Site arrays start at the first page after the enzyme table.
+   w->offset = page_align(sizeof(isdhdr_t) + nenz*sizeof(isdenz_t));
+
+   return w;
+}
+
+int
+isd_write_chr
+(
+ isdw_t        * w,
+ const char    * name,
+ long            len,
+ const int64_t * site,
+ long            cnt
+)
+{
+   if (w->hdr.nchrom >= w->size) {
+      w->size *= 2;
+      w->toc = realloc(w->toc, w->size*sizeof(isdtoc_t));
+   }
+   size_t namelen = strlen(name)+1;
+   while (w->hdr.names_size + namelen > w->names_max) {
+      w->names_max *= 2;
+      w->names = realloc(w->names, w->names_max);
+   }
+
+   // Sites are packed unless they are not sorted (empty chromosome).
+   size_t size = cnt*sizeof(int64_t);
+   const void * data = site;
+   uint64_t * packed = NULL;
+   if (w->encoding == ISD_PACKED && (packed = pack_sites(site, cnt, &size)) != NULL)
+      data = packed;
+
+   isdtoc_t * toc = w->toc + w->hdr.nchrom++;
+   *toc = (isdtoc_t) {
+      .name     = w->hdr.names_size,
+      .length   = len,
+      .nsites   = cnt,
+      .offset   = w->offset,
+      .size     = size,
+      .encoding = packed ? ISD_PACKED : ISD_RAW64,
+      .crc      = crc32(0, (unsigned char *) data, size)
+   };
+   memcpy(w->names + w->hdr.names_size, name, namelen);
+   w->hdr.names_size += namelen;
+
+   int err = pwrite_all(w->fd, data, size, w->offset);
+   free(packed);
+   if (err) return 1;
+   w->offset = page_align(w->offset + size);
+
+   return 0;
+}
+
+// Builds the packed representation of a sorted site array (block index
+// followed by the bit-packed deltas). Returns NULL if the sites are not
+// sorted.
+uint64_t *
+pack_sites
+(
+ const int64_t * site,
+ long            cnt,
+ size_t        * size
+)
+{
+   if (cnt < 1) return NULL;
+   for (long i = 1; i < cnt; i++)
+      if (site[i] < site[i-1]) return NULL;
+
+   // Bit width of each block.
+   long nblk = nblocks(cnt);
+   int * width = calloc(nblk, sizeof(int));
+   uint64_t nbits = 0;
+   for (long b = 0; b < nblk; b++) {
+      long end = (b+1)*ISD_BLOCK < cnt ? (b+1)*ISD_BLOCK : cnt;
+      uint64_t max = 0;
+      for (long i = b*ISD_BLOCK+1; i < end; i++)
+         if ((uint64_t)(site[i] - site[i-1]) > max) max = site[i] - site[i-1];
+      while (width[b] < 64 && (max >> width[b]) != 0) width[b]++;
+      nbits += (uint64_t) width[b] * (end - b*ISD_BLOCK - 1);
+   }
+
+   size_t index = (nblk+1)*sizeof(isdblk_t);
+   *size = index + (nbits + 63)/64*8 + 8;
+   uint64_t * buf = calloc(*size/8, sizeof(uint64_t));
+   isdblk_t * blk = (isdblk_t *) buf;
+   uint64_t * bits = buf + index/8;
+
+   uint64_t off = 0;
+   for (long b = 0; b < nblk; b++) {
+      long end = (b+1)*ISD_BLOCK < cnt ? (b+1)*ISD_BLOCK : cnt;
+      blk[b] = (isdblk_t) {.first = site[b*ISD_BLOCK], .offset = off};
+      for (long i = b*ISD_BLOCK+1; i < end; i++, off += width[b]) {
+         uint64_t d = site[i] - site[i-1];
+         bits[off/64] |= d << (off%64);
+         if (off%64 + width[b] > 64) bits[off/64+1] |= d >> (64 - off%64);
+      }
+   }
+   blk[nblk] = (isdblk_t) {.first = site[cnt-1], .offset = off};
+
+   free(width);
+   return buf;
+}
+
+int
+isd_finish
+(
+ isdw_t * w
+)
+{
+   // TOC and names go after the last site array, the header (written
+   // last) points to them.
+   int err = 0;
+   size_t tocsize = w->hdr.nchrom*sizeof(isdtoc_t);
+   w->hdr.toc_offset = w->offset;
+   uLong crc = crc32(0, (unsigned char *) w->enz, w->hdr.nenz*sizeof(isdenz_t));
+   crc = crc32(crc, (unsigned char *) w->toc, tocsize);
+   crc = crc32(crc, (unsigned char *) w->names, w->hdr.names_size);
+   w->hdr.crc = crc;
+
+   err |= pwrite_all(w->fd, w->toc, tocsize, w->offset);
+   err |= pwrite_all(w->fd, w->names, w->hdr.names_size, w->offset + tocsize);
+   err |= pwrite_all(w->fd, w->enz, w->hdr.nenz*sizeof(isdenz_t), sizeof(isdhdr_t));
+   err |= pwrite_all(w->fd, &w->hdr, sizeof(isdhdr_t), 0);
+   err |= close(w->fd) != 0;
+
+   free(w->enz);
+   free(w->toc);
+   free(w->names);
+   free(w);
+
+   return err;
+}
+
+isaw_t *
+isa_create
+(
+ const char * path,
+ int          window
+)
+{
+   isaw_t * w = calloc(1, sizeof(isaw_t));
+   if (w == NULL) return NULL;
+
+   w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (w->fd < 0) {
+      free(w);
+      return NULL;
+   }
+
+   memcpy(w->hdr.magic, ISA_MAGIC, 4);
+   w->hdr.version = ISA_VERSION;
+   w->hdr.ncols = ISA_NCOLS;
+   w->hdr.window = window;
+   w->size = 64;
+   w->toc = malloc(w->size*sizeof(isatoc_t));
+   w->offset = sizeof(isahdr_t);
+
+   return w;
+}
+
+int
+isa_write_chr
+(
+ isaw_t   * w,
+ long       nfrag,
+ int32_t ** col
+)
+{
+   if (w->hdr.nchrom >= w->size) {
+      w->size *= 2;
+      w->toc = realloc(w->toc, w->size*sizeof(isatoc_t));
+   }
+
+   // Columns are padded to 8 bytes.
+   isatoc_t * toc = w->toc + w->hdr.nchrom++;
+   size_t size = nfrag*sizeof(int32_t);
+   toc->nfrag = nfrag;
+   for (int i = 0; i < ISA_NCOLS; i++) {
+      toc->offset[i] = w->offset;
+      if (pwrite_all(w->fd, col[i], size, w->offset))
+         return 1;
+      w->offset += (size + 7) / 8 * 8;
+   }
+
+   return 0;
+}
+
+int
+isa_finish
+(
+ isaw_t * w
+)
+{
+   int err = 0;
+   size_t tocsize = w->hdr.nchrom*sizeof(isatoc_t);
+   w->hdr.toc_offset = w->offset;
+   w->hdr.crc = crc32(0, (unsigned char *) w->toc, tocsize);
+
+   err |= pwrite_all(w->fd, w->toc, tocsize, w->offset);
+   err |= pwrite_all(w->fd, &w->hdr, sizeof(isahdr_t), 0);
+   err |= close(w->fd) != 0;
+
+   free(w->toc);
+   free(w);
+
+   return err;
+}
@@ -0,0 +1,178 @@
+#ifndef _ISD_H
+#define _ISD_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// In-silico digestion (.isd) files.
+//
+// v1 (legacy): RE sequences (comma-separated, NUL-terminated), cut_fw and
+// cut_rv of each enzyme (int), number of chromosomes (int) and, for each
+// chromosome, its name (NUL-terminated), site count (int) and sites (int).
+//
+// v2: all integers are little-endian.
+//   offset 0            isdhdr_t, followed by nenz isdenz_t.
+//   page-aligned        site array of each chromosome (int64_t).
+//   toc_offset          isdtoc_t[nchrom], followed by the chromosome
+//                       names (NUL-terminated, names_size bytes).
+// The header crc covers the enzyme table, the TOC and the names. Each TOC
+// entry holds the crc of its site array.
+//
+// Site arrays are stored either raw (ISD_RAW64) or packed (ISD_PACKED). A
+// packed array is split in blocks of ISD_BLOCK sites; it starts with an
+// index of nblocks+1 isdblk_t (first site of each block and bit offset of
+// its deltas) followed by the deltas between consecutive sites of each
+// block, bit-packed with a fixed width per block (the width is the size of
+// the block divided by its number of deltas). A site is found by decoding
+// a single block.
+
+#define ISD_MAGIC     "ISD2"
+#define ISD_VERSION   2
+#define ISD_PAGE_SIZE 4096
+#define ISD_MAX_SEQ   40
+
+#define ISD_RAW64     0
+#define ISD_PACKED    1
+#define ISD_BLOCK     64
+
+// Fragment annotations (.isa), a columnar side table of the .isd with one
+// row per fragment [site[i],site[i+1]) of every chromosome.
+//   offset 0            isahdr_t.
+//   8-byte aligned      for each chromosome (in .isd order), the ISA_NCOLS
+//                       columns (int32_t[nfrag] each).
+//   toc_offset          isatoc_t[nchrom].
+// Columns are the fragment length, its G+C and N counts, and the G+C counts
+// of the first and last 'window' nucleotides (the whole fragment if it is
+// shorter). The header crc covers the TOC.
+
+#define ISA_MAGIC     "ISA1"
+#define ISA_VERSION   1
+
+#define ISA_LENGTH    0
+#define ISA_GC        1
+#define ISA_N         2
+#define ISA_GC5       3
+#define ISA_GC3       4
+#define ISA_NCOLS     5
+
+// Struct definitions.
+
+typedef struct {
+   char     magic[4];
+   uint32_t version;
+   uint32_t nenz;
+   uint32_t nchrom;
+   uint64_t toc_offset;
+   uint64_t names_size;
+   uint32_t crc;
+   uint32_t page_size;
+   char     name[64];
+} isdhdr_t;
+
+typedef struct {
+   char     seq[ISD_MAX_SEQ];
+   int32_t  cut_fw;
+   int32_t  cut_rv;
+} isdenz_t;
+
+typedef struct {
+   uint64_t name;
+   uint64_t length;
+   uint64_t nsites;
+   uint64_t offset;
+   uint64_t size;
+   uint32_t encoding;
+   uint32_t crc;
+} isdtoc_t;
+
+typedef struct {
+   int64_t  first;
+   uint64_t offset;
+} isdblk_t;
+
+// Chromosome of an open digestion (re_site is NULL if packed). The bucket
+// table, built when the digestion is opened, holds for every position
+// pos >> shift the fragment (or the block, if packed) that contains it.
+typedef struct {
+   char     * chr;
+   long       len;
+   long       cnt;
+   int64_t  * re_site;
+   long       nblk;
+   isdblk_t * blk;
+   uint64_t * bits;
+   isdtoc_t * toc;
+   int        shift;
+   long       nbkt;
+   uint32_t * bkt;
+} isdchr_t;
+
+// Fragment lookup of isd_find_batch.
+typedef struct {
+   const isdchr_t * chr;
+   long             pos;
+   long             idx;
+   long             beg;
+   long             end;
+} isdq_t;
+
+typedef struct {
+   int        version;
+   int        nenz;
+   isdenz_t * enz;
+   int        nchrom;
+   isdchr_t * chrom;
+   char     * map;
+   size_t     size;
+} isd_t;
+
+// Digestion being written.
+typedef struct {
+   int        fd;
+   int        encoding;
+   isdhdr_t   hdr;
+   isdenz_t * enz;
+   isdtoc_t * toc;
+   int        size;
+   char     * names;
+   size_t     names_max;
+   off_t      offset;
+} isdw_t;
+
+typedef struct {
+   char     magic[4];
+   uint32_t version;
+   uint32_t nchrom;
+   uint32_t ncols;
+   uint32_t window;
+   uint32_t crc;
+   uint64_t toc_offset;
+} isahdr_t;
+
+typedef struct {
+   uint64_t nfrag;
+   uint64_t offset[ISA_NCOLS];
+} isatoc_t;
+
+// Annotations being written.
+typedef struct {
+   int        fd;
+   isahdr_t   hdr;
+   isatoc_t * toc;
+   int        size;
+   off_t      offset;
+} isaw_t;
+
+// Function headers.
+isd_t        * isd_open      (const char * path, int verify);
+void           isd_close     (isd_t * isd);
+long           isd_find      (const isdchr_t * chr, long pos, long * beg, long * end);
+void           isd_find_batch (isdq_t * q, long n);
+isdw_t       * isd_create    (const char * path, const char * name, int nenz, char ** seq, int * cut_fw, int * cut_rv, int encoding);
+int            isd_write_chr (isdw_t * w, const char * name, long len, const int64_t * site, long cnt);
+int            isd_finish    (isdw_t * w);
+isaw_t       * isa_create    (const char * path, int window);
+int            isa_write_chr (isaw_t * w, long nfrag, int32_t ** col);
+int            isa_finish    (isaw_t * w);
+
+#endif
@@ -0,0 +1,411 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "mates.h"
+
+// Header of a (partial) group in a spilled partition, followed by the
+// name and the records.
+typedef struct {
+   uint32_t namelen;
+   uint32_t nrec;
+   uint64_t len;
+   int32_t  nseg;
+   int32_t  need[2];
+   int32_t  seen[2];
+   int32_t  npass;
+} spill_t;
+
+// Function headers.
+uint64_t       mate_hash    (const char * name, int namelen);
+mate_t       * mate_merge   (mates_t * mt, uint64_t hash, const char * name, spill_t * s, const char * rec);
+int            mate_done    (const mate_t * m);
+int            mate_part    (const mates_t * mt, uint64_t hash);
+void           mate_unlink  (mates_t * mt, mate_t * m);
+void           mates_grow   (mates_t * mt);
+int            mates_spill  (mates_t * mt);
+void           mates_group  (mates_t * mt, FILE * f, int level, mate_fn emit, void * ctx);
+void           mates_drain  (mates_t * mt, mate_fn emit, void * ctx);
+void           spill_write  (FILE * f, spill_t * s, const char * name, const char * rec);
+
+// Source.
+
+mates_t *
+mates_new
+(
+ size_t       budget,
+ const char * tmpdir
+)
+{
+   mates_t * mt = calloc(1, sizeof(mates_t));
+   mt->nbkt   = MATES_BUCKETS;
+   mt->bkt    = calloc(mt->nbkt, sizeof(mate_t *));
+   mt->budget = budget;
+   mt->tmpdir = tmpdir;
+   return mt;
+}
+
+void
+mates_destroy
+(
+ mates_t * mt
+)
+{
+   for (long i = 0; i < mt->nbkt; i++) {
+      while (mt->bkt[i] != NULL) {
+         mate_t * m = mt->bkt[i];
+         mt->bkt[i] = m->next;
+         free(m->rec);
+         free(m);
+      }
+   }
+   for (int p = 0; p < MATES_PARTS; p++)
+      if (mt->part[p] != NULL) fclose(mt->part[p]);
+   free(mt->bkt);
+   free(mt);
+}
+
+// FNV-1a. The partitions are in the high bits, the bucket in the low bits.
+uint64_t
+mate_hash
+(
+ const char * name,
+ int          namelen
+)
+{
+   uint64_t h = 0xcbf29ce484222325ULL;
+   for (int i = 0; i < namelen; i++)
+      h = (h ^ (unsigned char) name[i]) * 0x100000001b3ULL;
+   return h;
+}
+
+// Partition of a hash at the current level (the next MATES_BITS bits).
+int
+mate_part
+(
+ const mates_t * mt,
+ uint64_t        hash
+)
+{
+   return (hash >> (64 - MATES_BITS*(mt->level + 1))) & (MATES_PARTS - 1);
+}
+
+// Adds a record of segment seg (0 or 1 of nseg) to the group of its name.
+// Primary records expect 1 + nsa records of their segment (nsa is the
+// number of SA tag entries). pass is set if the record passes the mapping
+// quality threshold. Returns the group if it is complete (the caller frees
+// it and its records), NULL otherwise.
+mate_t *
+mates_add
+(
+ mates_t    * mt,
+ const char * name,
+ int          namelen,
+ const char * rec,
+ size_t       reclen,
+ int          nseg,
+ int          seg,
+ int          kind,
+ int          nsa,
+ int          pass
+)
+{
+   spill_t s = {.namelen = namelen, .nrec = 1, .len = reclen, .nseg = nseg, .npass = pass != 0};
+   if (kind != MATE_SECOND) s.seen[seg] = 1;
+   if (kind == MATE_PRIMARY) s.need[seg] = 1 + nsa;
+
+   uint64_t h = mate_hash(name, namelen);
+   int      p = mate_part(mt, h);
+   if (mt->part[p] != NULL) {
+      // Spilled partition.
+      spill_write(mt->part[p], &s, name, rec);
+      mt->spilled++;
+      return NULL;
+   }
+
+   mate_t * m = mate_merge(mt, h, name, &s, rec);
+   if (mate_done(m)) {
+      mate_unlink(mt, m);
+      return m;
+   }
+   while (mt->bytes > mt->budget && mates_spill(mt));
+   return NULL;
+}
+
+// Merges a partial group in the table and returns its entry.
+mate_t *
+mate_merge
+(
+ mates_t    * mt,
+ uint64_t     hash,
+ const char * name,
+ spill_t    * s,
+ const char * rec
+)
+{
+   if (mt->n >= mt->nbkt)
+      mates_grow(mt);
+
+   mate_t ** b = mt->bkt + (hash & (mt->nbkt - 1));
+   mate_t  * m = *b;
+   while (m != NULL && !(m->hash == hash && m->namelen == (int) s->namelen &&
+                         memcmp(m->name, name, s->namelen) == 0))
+      m = m->next;
+   if (m == NULL) {
+      m = calloc(1, sizeof(mate_t) + s->namelen + 1);
+      if (m == NULL) {
+         fprintf(stderr, "error allocating mate table.\n");
+         exit(1);
+      }
+      m->hash    = hash;
+      m->namelen = s->namelen;
+      memcpy(m->name, name, s->namelen);
+      m->next = *b;
+      *b = m;
+      mt->n++;
+      mt->bytes += sizeof(mate_t) + s->namelen + 1;
+      mt->part_bytes[mate_part(mt, hash)] += sizeof(mate_t) + s->namelen + 1;
+   }
+
+   if (m->len + s->len > m->size) {
+      while (m->len + s->len > m->size)
+         m->size = m->size ? 2*m->size : 2*s->len;
+      m->rec = realloc(m->rec, m->size);
+   }
+   memcpy(m->rec + m->len, rec, s->len);
+   m->len   += s->len;
+   m->nrec  += s->nrec;
+   m->npass += s->npass;
+   if (s->nseg > m->nseg) m->nseg = s->nseg;
+   for (int i = 0; i < 2; i++) {
+      if (s->need[i]) m->need[i] = s->need[i];
+      m->seen[i] += s->seen[i];
+   }
+   mt->bytes += s->len;
+   mt->part_bytes[mate_part(mt, hash)] += s->len;
+   return m;
+}
+
+int
+mate_done
+(
+ const mate_t * m
+)
+{
+   for (int i = 0; i < m->nseg; i++)
+      if (m->need[i] == 0 || m->seen[i] < m->need[i]) return 0;
+   return 1;
+}
+
+// Removes a group from the table (it is not freed).
+void
+mate_unlink
+(
+ mates_t * mt,
+ mate_t  * m
+)
+{
+   mate_t ** b = mt->bkt + (m->hash & (mt->nbkt - 1));
+   while (*b != m)
+      b = &(*b)->next;
+   *b = m->next;
+   mt->n--;
+   mt->bytes -= sizeof(mate_t) + m->namelen + 1 + m->len;
+   mt->part_bytes[mate_part(mt, m->hash)] -= sizeof(mate_t) + m->namelen + 1 + m->len;
+}
+
+void
+mates_grow
+(
+ mates_t * mt
+)
+{
+   long      nbkt = 2*mt->nbkt;
+   mate_t ** bkt  = calloc(nbkt, sizeof(mate_t *));
+   for (long i = 0; i < mt->nbkt; i++) {
+      while (mt->bkt[i] != NULL) {
+         mate_t * m = mt->bkt[i];
+         mt->bkt[i] = m->next;
+         m->next = bkt[m->hash & (nbkt - 1)];
+         bkt[m->hash & (nbkt - 1)] = m;
+      }
+   }
+   free(mt->bkt);
+   mt->bkt  = bkt;
+   mt->nbkt = nbkt;
+}
+
+// Moves the largest partition to a temporary file. Returns 0 if there is
+// nothing left to spill (or no hash bits left to split by).
+int
+mates_spill
+(
+ mates_t * mt
+)
+{
+   int p = -1;
+   for (int i = 0; i < MATES_PARTS; i++)
+      if (mt->part[i] == NULL && (p < 0 || mt->part_bytes[i] > mt->part_bytes[p])) p = i;
+   if (p < 0 || mt->part_bytes[p] == 0 || mt->level + 1 >= MATES_LEVELS)
+      return 0;
+
+   char * path = malloc(strlen(mt->tmpdir) + 32);
+   sprintf(path, "%s/parse_contacts_XXXXXX", mt->tmpdir);
+   int fd = mkstemp(path);
+   mt->part[p] = fd < 0 ? NULL : fdopen(fd, "w+");
+   if (mt->part[p] == NULL) {
+      fprintf(stderr, "error creating temporary file in %s.\n", mt->tmpdir);
+      exit(1);
+   }
+   unlink(path);
+   free(path);
+
+   for (long i = 0; i < mt->nbkt; i++) {
+      mate_t ** b = mt->bkt + i;
+      while (*b != NULL) {
+         mate_t * m = *b;
+         if (mate_part(mt, m->hash) != p) {
+            b = &m->next;
+            continue;
+         }
+         spill_t s = {
+            .namelen = m->namelen,
+            .nrec    = m->nrec,
+            .len     = m->len,
+            .nseg    = m->nseg,
+            .need    = {m->need[0], m->need[1]},
+            .seen    = {m->seen[0], m->seen[1]},
+            .npass   = m->npass
+         };
+         spill_write(mt->part[p], &s, m->name, m->rec);
+         mt->spilled += m->nrec;
+         *b = m->next;
+         mt->n--;
+         mt->bytes -= sizeof(mate_t) + m->namelen + 1 + m->len;
+         free(m->rec);
+         free(m);
+      }
+   }
+   mt->part_bytes[p] = 0;
+   mt->nspills++;
+   return 1;
+}
+
+void
+spill_write
+(
+ FILE       * f,
+ spill_t    * s,
+ const char * name,
+ const char * rec
+)
+{
+   if (fwrite(s, sizeof(spill_t), 1, f) != 1 ||
+       fwrite(name, 1, s->namelen, f) != s->namelen ||
+       fwrite(rec, 1, s->len, f) != s->len) {
+      fprintf(stderr, "error writing temporary file.\n");
+      exit(1);
+   }
+}
+
+// Emits the groups that are still pending at the end of the input (they
+// are incomplete), then groups the spilled partitions one by one.
+void
+mates_flush
+(
+ mates_t * mt,
+ mate_fn   emit,
+ void    * ctx
+)
+{
+   mates_drain(mt, emit, ctx);
+   FILE * part[MATES_PARTS];
+   memcpy(part, mt->part, sizeof(part));
+   memset(mt->part, 0, sizeof(part));
+   for (int p = 0; p < MATES_PARTS; p++)
+      if (part[p] != NULL) mates_group(mt, part[p], mt->level + 1, emit, ctx);
+}
+
+// Groups the names of a spilled partition (all their records are in f).
+// The partition is split by the hash bits of the given level if it
+// exceeds the budget, and the spilled parts are grouped recursively.
+void
+mates_group
+(
+ mates_t * mt,
+ FILE    * f,
+ int       level,
+ mate_fn   emit,
+ void    * ctx
+)
+{
+   if (fflush(f) || fseek(f, 0, SEEK_SET)) {
+      fprintf(stderr, "error reading temporary file.\n");
+      exit(1);
+   }
+   int outer = mt->level;
+   mt->level = level;
+   memset(mt->part_bytes, 0, sizeof(mt->part_bytes));
+
+   spill_t s;
+   char  * buf = NULL;
+   size_t  size = 0;
+   while (fread(&s, sizeof(spill_t), 1, f) == 1) {
+      if (s.namelen + s.len > size) {
+         size = s.namelen + s.len;
+         buf = realloc(buf, size);
+      }
+      if (fread(buf, 1, s.namelen + s.len, f) != s.namelen + s.len) {
+         fprintf(stderr, "error reading temporary file.\n");
+         exit(1);
+      }
+      uint64_t h = mate_hash(buf, s.namelen);
+      int      p = mate_part(mt, h);
+      if (mt->part[p] != NULL) {
+         spill_write(mt->part[p], &s, buf, buf + s.namelen);
+         mt->spilled += s.nrec;
+         continue;
+      }
+      mate_t * m = mate_merge(mt, h, buf, &s, buf + s.namelen);
+      if (mate_done(m)) {
+         mate_unlink(mt, m);
+         emit(ctx, m);
+         free(m->rec);
+         free(m);
+      }
+      while (mt->bytes > mt->budget && mates_spill(mt));
+   }
+   free(buf);
+   fclose(f);
+
+   mates_flush(mt, emit, ctx);
+   mt->level = outer;
+}
+
+// Emits the groups of the table and empties it. Groups of secondary
+// records only came after their group was emitted: they are dropped and
+// their records are counted in mt->late.
+void
+mates_drain
+(
+ mates_t * mt,
+ mate_fn   emit,
+ void    * ctx
+)
+{
+   for (long i = 0; i < mt->nbkt; i++) {
+      while (mt->bkt[i] != NULL) {
+         mate_t * m = mt->bkt[i];
+         mate_unlink(mt, m);
+         if (m->seen[0] + m->seen[1] > 0) {
+            emit(ctx, m);
+         } else {
+            mt->late      += m->nrec;
+            mt->late_pass += m->npass;
+         }
+         free(m->rec);
+         free(m);
+      }
+   }
+}
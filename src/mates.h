@@ -0,0 +1,78 @@
+#ifndef _MATES_H
+#define _MATES_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Pending mates of coordinate-sorted input. The records of each read name
+// are collected in a hash table until the group is complete: the primary
+// record of every segment has been seen, and so have the supplementary
+// records listed in their SA tags. Secondary records are kept but not
+// expected: those sorted after the completion of their group start a group
+// of their own, which never gets a primary record. Such groups are dropped
+// (and counted) by mates_flush at the end of the input. The records that
+// pass the mapping quality threshold are counted apart: they could have
+// changed the contacts of their read.
+//
+// The names are split in MATES_PARTS partitions by the high bits of their
+// hash. When the pending records exceed the memory budget, the largest
+// partition is spilled to a temporary file, and the later records of its
+// names go straight to the file. Spilled partitions are grouped (one at a
+// time, in memory) by mates_flush at the end of the input. A partition
+// that exceeds the budget again is split by the next bits of the hash
+// (down to MATES_LEVELS levels) and spilled the same way.
+
+#define MATES_PARTS   64
+#define MATES_BITS    6
+#define MATES_LEVELS  10
+#define MATES_BUCKETS 4096
+
+#define MATE_PRIMARY  0
+#define MATE_SUPPL    1
+#define MATE_SECOND   2
+
+// Struct definitions.
+
+typedef struct mate_s {
+   struct mate_s * next;
+   uint64_t        hash;
+   char          * rec;
+   size_t          len;
+   size_t          size;
+   int             nrec;
+   int             npass;
+   int             nseg;
+   int             need[2];
+   int             seen[2];
+   int             namelen;
+   char            name[];
+} mate_t;
+
+typedef struct {
+   mate_t      ** bkt;
+   long           nbkt;
+   long           n;
+   size_t         bytes;
+   size_t         budget;
+   size_t         part_bytes[MATES_PARTS];
+   FILE         * part[MATES_PARTS];
+   const char   * tmpdir;
+   long           spilled;
+   long           late;
+   long           late_pass;
+   int            nspills;
+   int            level;
+} mates_t;
+
+// Emits a group of records (which is freed after the call).
+typedef void (*mate_fn)(void * ctx, mate_t * m);
+
+// Function headers.
+mates_t      * mates_new    (size_t budget, const char * tmpdir);
+mate_t       * mates_add    (mates_t * mt, const char * name, int namelen, const char * rec, size_t reclen,
+                             int nseg, int seg, int kind, int nsa, int pass);
+void           mates_flush  (mates_t * mt, mate_fn emit, void * ctx);
+void           mates_destroy (mates_t * mt);
+
+#endif
@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "matrix.h"
+
+#define MATRIX_SLOTS 4096
+
+// Function headers.
+void           matrix_inc   (matrix_t * mx, int32_t chr1, uint32_t bin1, int32_t chr2, uint32_t bin2, uint64_t count);
+void           matrix_grow  (matrix_t * mx);
+int            cell_cmp     (const void * a, const void * b);
+
+// Source.
+
+matrix_t *
+matrix_new
+(
+ long res
+)
+{
+   matrix_t * mx = calloc(1, sizeof(matrix_t));
+   mx->res  = res;
+   mx->size = MATRIX_SLOTS;
+   mx->cell = calloc(mx->size, sizeof(mxcell_t));
+   if (mx->cell == NULL) {
+      fprintf(stderr, "error allocating matrix.\n");
+      exit(1);
+   }
+   return mx;
+}
+
+void
+matrix_destroy
+(
+ matrix_t * mx
+)
+{
+   free(mx->cell);
+   free(mx);
+}
+
+// Counts a contact between the (1-based) loci pos1 and pos2.
+void
+matrix_add
+(
+ matrix_t * mx,
+ int        chr1,
+ long       pos1,
+ int        chr2,
+ long       pos2
+)
+{
+   matrix_inc(mx, chr1, (pos1 - 1) / mx->res, chr2, (pos2 - 1) / mx->res, 1);
+}
+
+void
+matrix_inc
+(
+ matrix_t * mx,
+ int32_t    chr1,
+ uint32_t   bin1,
+ int32_t    chr2,
+ uint32_t   bin2,
+ uint64_t   count
+)
+{
+   if (2 * (mx->n + 1) > mx->size)
+      matrix_grow(mx);
+
+   // Linear probing (size is a power of 2).
+   uint64_t h = ((uint64_t) chr1 << 32 | bin1) * 0x9e3779b97f4a7c15ULL;
+   h = (h ^ ((uint64_t) chr2 << 32 | bin2)) * 0xff51afd7ed558ccdULL;
+   size_t   mask = mx->size - 1;
+   size_t   i = (h >> 32) & mask;
+   while (1) {
+      mxcell_t * c = mx->cell + i;
+      if (c->count == 0) {
+         *c = (mxcell_t) {chr1, chr2, bin1, bin2, count};
+         mx->n++;
+         return;
+      }
+      if (c->bin1 == bin1 && c->bin2 == bin2 && c->chr1 == chr1 && c->chr2 == chr2) {
+         c->count += count;
+         return;
+      }
+      i = (i + 1) & mask;
+   }
+}
+
+void
+matrix_grow
+(
+ matrix_t * mx
+)
+{
+   mxcell_t * old  = mx->cell;
+   long       size = mx->size;
+   mx->size = 2*size;
+   mx->n    = 0;
+   mx->cell = calloc(mx->size, sizeof(mxcell_t));
+   if (mx->cell == NULL) {
+      fprintf(stderr, "error allocating matrix.\n");
+      exit(1);
+   }
+   for (long i = 0; i < size; i++)
+      if (old[i].count)
+         matrix_inc(mx, old[i].chr1, old[i].bin1, old[i].chr2, old[i].bin2, old[i].count);
+   free(old);
+}
+
+// Adds the cells of src to dst (matrices of the same resolution).
+void
+matrix_merge
+(
+ matrix_t       * dst,
+ const matrix_t * src
+)
+{
+   for (long i = 0; i < src->size; i++) {
+      const mxcell_t * c = src->cell + i;
+      if (c->count)
+         matrix_inc(dst, c->chr1, c->bin1, c->chr2, c->bin2, c->count);
+   }
+}
+
+// Moves the cells to the first n slots, sorted by chromosome IDs and bins.
+// The hash table can not be used afterwards.
+void
+matrix_sort
+(
+ matrix_t * mx
+)
+{
+   long n = 0;
+   for (long i = 0; i < mx->size; i++)
+      if (mx->cell[i].count)
+         mx->cell[n++] = mx->cell[i];
+   qsort(mx->cell, n, sizeof(mxcell_t), cell_cmp);
+}
+
+int
+cell_cmp
+(
+ const void * a,
+ const void * b
+)
+{
+   const mxcell_t * x = (const mxcell_t *) a;
+   const mxcell_t * y = (const mxcell_t *) b;
+   if (x->chr1 != y->chr1) return x->chr1 < y->chr1 ? -1 : 1;
+   if (x->bin1 != y->bin1) return x->bin1 < y->bin1 ? -1 : 1;
+   if (x->chr2 != y->chr2) return x->chr2 < y->chr2 ? -1 : 1;
+   if (x->bin2 != y->bin2) return x->bin2 < y->bin2 ? -1 : 1;
+   return 0;
+}
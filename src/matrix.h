@@ -0,0 +1,36 @@
+#ifndef _MATRIX_H
+#define _MATRIX_H
+
+#include <stdint.h>
+
+// Sparse binned contact matrices. The cells (pixels) are counted in an
+// open-addressing hash table keyed by the chromosome IDs and the bins of
+// both ends, which grows by doubling (load factor below 1/2). Each thread
+// fills its own matrices, which are merged at the end.
+
+// Struct definitions.
+
+// Bins are pos/res (0-based). Empty slots have count 0.
+typedef struct {
+   int32_t  chr1;
+   int32_t  chr2;
+   uint32_t bin1;
+   uint32_t bin2;
+   uint64_t count;
+} mxcell_t;
+
+typedef struct {
+   long       res;
+   long       n;
+   long       size;
+   mxcell_t * cell;
+} matrix_t;
+
+// Function headers.
+matrix_t     * matrix_new   (long res);
+void           matrix_add   (matrix_t * mx, int chr1, long pos1, int chr2, long pos2);
+void           matrix_merge (matrix_t * dst, const matrix_t * src);
+void           matrix_sort  (matrix_t * mx);
+void           matrix_destroy (matrix_t * mx);
+
+#endif
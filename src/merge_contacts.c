@@ -2,6 +2,18 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include "contacts.h"
+#include "runstats.h"
+
+#define READ_RECORDS 65536
+
+// Stages (one record in STAGE_SAMPLE is timed, binary blocks are read
+// in READ_RECORDS).
+#define STAGE_READ   0
+#define STAGE_PARSE  1
+#define STAGE_OUTPUT 2
+#define NSTAGES      3
 
 typedef struct {
    char seqname[512];
@@ -15,6 +27,14 @@ typedef struct {
    int  map_b;
 } contact_t;
 
+typedef struct {
+   long       records;
+   long       contacts;
+   long       bytes;
+   stage_t    stage[NSTAGES];
+   progress_t progress;
+} mstats_t;
+
 
 void
 parse_contact
@@ -41,21 +61,201 @@ parse_contact
 }
 
 
+// Merges the duplicates of a stream of binary records (the header was
+// already read). Positions and chromosome IDs are compared as integers.
+void
+merge_binary
+(
+ FILE     * fin,
+ char     * magic,
+ mstats_t * ms
+)
+{
+   cbhdr_t hdr;
+   memcpy(hdr.magic, magic, 4);
+   if (fread((char *) &hdr + 4, sizeof(cbhdr_t) - 4, 1, fin) != 1 || hdr.version != CB_VERSION) {
+      fprintf(stderr, "error: unsupported binary contact file.\n");
+      exit(1);
+   }
+
+   // Chromosome dictionary.
+   char  * names = malloc(hdr.names_size + 1);
+   char ** chr   = malloc((hdr.nchrom + 1) * sizeof(char *));
+   if (fread(names, 1, hdr.names_size, fin) != hdr.names_size) {
+      fprintf(stderr, "error: truncated binary contact file.\n");
+      exit(1);
+   }
+   names[hdr.names_size] = 0;
+   char * p = names;
+   for (uint32_t i = 0; i < hdr.nchrom; i++) {
+      if (p >= names + hdr.names_size) {
+         fprintf(stderr, "error: truncated binary contact file.\n");
+         exit(1);
+      }
+      chr[i] = p;
+      p += strlen(p) + 1;
+   }
+
+   // Records (and read IDs, which are skipped).
+   size_t  recsize = sizeof(cbrec_t) + (hdr.flags & CB_READID ? sizeof(uint64_t) : 0);
+   char  * buf = malloc(READ_RECORDS * recsize);
+   cbrec_t last = {0}, cont;
+   long    n = 0;
+   int     count = 0;
+   size_t  nrec;
+   while (1) {
+      double t0 = wall_clock();
+      nrec = fread(buf, recsize, READ_RECORDS, fin);
+      stage_count(ms->stage + STAGE_READ, 1, 1, wall_clock() - t0);
+      if (nrec == 0) break;
+      ms->bytes += nrec * recsize;
+      for (size_t i = 0; i < nrec; i++) {
+         int timed = n % STAGE_SAMPLE == 0;
+         t0 = timed ? wall_clock() : 0;
+         memcpy(&cont, buf + i*recsize, sizeof(cbrec_t));
+         if (cont.chr1 < 0 || cont.chr2 < 0 || (uint32_t) cont.chr1 >= hdr.nchrom || (uint32_t) cont.chr2 >= hdr.nchrom) {
+            fprintf(stderr, "error: chromosome ID out of range in record %ld.\n", n);
+            exit(1);
+         }
+         int dup = count > 0 &&
+                   cont.pos1 == last.pos1 &&
+                   cont.pos2 == last.pos2 &&
+                   cont.chr2 == last.chr2 &&
+                   cont.chr1 == last.chr1;
+         double t1 = timed ? wall_clock() : 0;
+         stage_count(ms->stage + STAGE_PARSE, 1, timed, t1 - t0);
+         if (dup) {
+            count++; // Duplicate.
+         } else {
+            if (count > 0) {
+               fprintf(stdout, "%s\t%lu\t%s\t%lu\t%d\n",
+                       chr[last.chr1], (unsigned long) last.pos1, chr[last.chr2], (unsigned long) last.pos2, count);
+               ms->contacts++;
+               stage_count(ms->stage + STAGE_OUTPUT, 1, timed, timed ? wall_clock() - t1 : 0);
+            }
+            last  = cont;
+            count = 1;
+         }
+         n++;
+      }
+      ms->records = n;
+      progress_update(&ms->progress, n, ms->bytes, "records");
+   }
+
+   if (n == 0) {
+      fprintf(stderr,"error: input file is empty.\n");
+      exit(1);
+   }
+   // Last contact.
+   fprintf(stdout, "%s\t%lu\t%s\t%lu\t%d\n",
+           chr[last.chr1], (unsigned long) last.pos1, chr[last.chr2], (unsigned long) last.pos2, count);
+   ms->contacts++;
+
+   free(buf);
+   free(chr);
+   free(names);
+}
+
+// Prints the run statistics (and writes them to a JSON file if not NULL).
+void
+merge_stats
+(
+ mstats_t   * ms,
+ const char * input,
+ const char * format,
+ double       elapsed,
+ const char * jsonfile
+)
+{
+   const char * stage_name[NSTAGES] = {"read", "parse", "output"};
+   if (fflush(stdout)) {
+      fprintf(stderr, "error writing contacts.\n");
+      exit(1);
+   }
+   fprintf(stderr, "Records:                \t%ld\n", ms->records);
+   fprintf(stderr, "Merged contacts:        \t%ld\n", ms->contacts);
+   fprintf(stderr, "Run time:               \t%.2f s (%.0f records/s, %.1f MB/s)\n",
+           elapsed, ms->records / elapsed, ms->bytes / 1e6 / elapsed);
+   for (int k = 0; k < NSTAGES; k++) {
+      char label[64];
+      snprintf(label, sizeof(label), " - %s:", stage_name[k]);
+      fprintf(stderr, "%-24s\t%.2f s (%ld calls)\n", label, stage_time(ms->stage + k), ms->stage[k].calls);
+   }
+
+   if (jsonfile == NULL) return;
+   json_t * js = json_open(jsonfile);
+   if (js == NULL) {
+      fprintf(stderr, "error opening file: %s\n", jsonfile);
+      exit(1);
+   }
+   json_str(js, "program", "merge_contacts");
+   json_str(js, "input", input);
+   json_str(js, "format", format);
+   json_double(js, "seconds", elapsed);
+   json_long(js, "records", ms->records);
+   json_long(js, "bytes", ms->bytes);
+   json_long(js, "contacts", ms->contacts);
+   json_long(js, "duplicates", ms->records - ms->contacts);
+   json_long(js, "stage_sample", STAGE_SAMPLE);
+   json_begin(js, "stages");
+   for (int k = 0; k < NSTAGES; k++)
+      json_stage(js, stage_name[k], ms->stage + k);
+   json_end(js);
+   if (json_close(js)) {
+      fprintf(stderr, "error writing file: %s\n", jsonfile);
+      exit(1);
+   }
+}
+
 int main(int argc, char *argv[])
 {
-   if (argc != 2) {
-      fprintf(stderr, "usage: %s file.hcf\n", argv[0]);
+   double start = wall_clock();
+
+   // Parse options.
+   char   * jsonfile = NULL;
+   double   interval = PROGRESS_INTERVAL;
+   int      opt;
+   while ((opt = getopt(argc, argv, "j:p:")) != -1) {
+      switch (opt) {
+      case 'j':
+         jsonfile = optarg;
+         break;
+      case 'p':
+         interval = atof(optarg);
+         break;
+      default:
+         exit(1);
+      }
+   }
+
+   if (argc - optind != 1) {
+      fprintf(stderr, "usage: %s [-j stats.json] [-p seconds] file.hcf\n", argv[0]);
+      fprintf(stderr, "  -j  write the run statistics (counters and stage times) to a JSON file\n");
+      fprintf(stderr, "  -p  seconds between progress lines (default: %d, 0: none)\n", PROGRESS_INTERVAL);
       exit(1);
    }
    
-   FILE * fin = fopen(argv[1], "r");
+   FILE * fin = fopen(argv[optind], "r");
    if (!fin) {
-      fprintf(stderr, "error opening file: %s\n", argv[1]);
+      fprintf(stderr, "error opening file: %s\n", argv[optind]);
       exit(1);
    }
-   
+
+   mstats_t ms = {0};
+   progress_init(&ms.progress, interval);
+
+   // Binary records (parse_contacts -b). The input may be a pipe, so the
+   // bytes read to detect the format are kept.
+   char   magic[4];
+   size_t nmagic = fread(magic, 1, 4, fin);
+   if (nmagic == 4 && memcmp(magic, CB_MAGIC, 4) == 0) {
+      merge_binary(fin, magic, &ms);
+      fclose(fin);
+      merge_stats(&ms, argv[optind], "binary", wall_clock() - start, jsonfile);
+      return 0;
+   }
+
    // Read lines.
-   size_t lines = 0;
    size_t bufsize = 200;
    char * line = malloc(bufsize);
    ssize_t bytes = 0;
@@ -66,36 +266,67 @@ int main(int argc, char *argv[])
 
    int count = 1;
 
-   bytes = getline(&line, &bufsize, fin);
-
-   // First line.
+   // First line (starts with the bytes of the format detection).
+   bytes = memchr(magic, '\n', nmagic) ? 0 : getline(&line, &bufsize, fin);
+   if (bytes < 0) bytes = 0;
+   if ((size_t) bytes + nmagic + 1 > bufsize) {
+      bufsize = bytes + nmagic + 1;
+      line = realloc(line, bufsize);
+   }
+   memmove(line + nmagic, line, bytes);
+   memcpy(line, magic, nmagic);
+   bytes += nmagic;
+   line[bytes] = 0;
    if (bytes < 1) {
       fprintf(stderr,"error: input file is empty.\n");
       exit(1);
    }
    parse_contact(line, last);
+   ms.records = 1;
+   ms.bytes = bytes;
 
    // Other lines.
-   while ((bytes = getline(&line, &bufsize, fin)) > 0) {
+   while (1) {
+      int    timed = ms.records % STAGE_SAMPLE == 0;
+      double t0 = timed ? wall_clock() : 0;
+      bytes = getline(&line, &bufsize, fin);
+      double t1 = timed ? wall_clock() : 0;
+      stage_count(ms.stage + STAGE_READ, 1, timed, t1 - t0);
+      if (bytes <= 0) break;
+      ms.bytes += bytes;
       // Parse contact.
       parse_contact(line, cont);
-      if (   cont->loc_a == last->loc_a &&
-             cont->loc_b == last->loc_b &&
-             strcmp(cont->chr_b, last->chr_b) == 0 &&
-             strcmp(cont->chr_a, last->chr_a) == 0   ) {
+      int dup =  cont->loc_a == last->loc_a &&
+                 cont->loc_b == last->loc_b &&
+                 strcmp(cont->chr_b, last->chr_b) == 0 &&
+                 strcmp(cont->chr_a, last->chr_a) == 0;
+      double t2 = timed ? wall_clock() : 0;
+      stage_count(ms.stage + STAGE_PARSE, 1, timed, t2 - t1);
+      if (dup) {
          count++; // Duplicate.
       } else {
          fprintf(stdout, "%s\t%ld\t%s\t%ld\t%d\n",
            last->chr_a, last->loc_a, last->chr_b, last->loc_b, count);
          count = 1;
+         ms.contacts++;
+         stage_count(ms.stage + STAGE_OUTPUT, 1, timed, timed ? wall_clock() - t2 : 0);
       }
       tmp  = cont;
       cont = last;
       last = tmp;
+      if (++ms.records % READ_RECORDS == 0)
+         progress_update(&ms.progress, ms.records, ms.bytes, "records");
    }
+   // Last contact.
+   fprintf(stdout, "%s\t%ld\t%s\t%ld\t%d\n",
+           last->chr_a, last->loc_a, last->chr_b, last->loc_b, count);
+   ms.contacts++;
 
    free(cont);
    free(last);
+   free(line);
+   fclose(fin);
+   merge_stats(&ms, argv[optind], "text", wall_clock() - start, jsonfile);
    return 0;
 
 }
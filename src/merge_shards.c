@@ -0,0 +1,604 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "contacts.h"
+#include "runstats.h"
+
+// Combines the outputs of parse_contacts --shard i/N into those of a single
+// run over the whole file. The files of shard i are <prefix>.<i>.out (the
+// contacts), <prefix>.<i>.json (-j) and the matrices listed in the JSON.
+// Contacts are concatenated in shard order (one header, read IDs shifted
+// by the read groups of the previous shards), matrices are summed cell by
+// cell and the counters of the stats are added.
+
+#define COPY_BLOCK (1 << 20)
+#define NAME_SIZE  512
+
+#define JSON_OBJECT 0
+#define JSON_STRING 1
+#define JSON_LONG   2
+#define JSON_DOUBLE 3
+
+// Parsed JSON stats file (objects keep the order of their keys).
+typedef struct node_s {
+   char           * key;
+   int              type;
+   long             l;
+   double           d;
+   char           * s;
+   int              n;
+   struct node_s ** kid;
+} node_t;
+
+// Current cell of a shard matrix.
+typedef struct {
+   FILE * f;
+   char * path;
+   char * line;
+   size_t cap;
+   int    eof;
+   char   chr1[NAME_SIZE];
+   char   chr2[NAME_SIZE];
+   long   beg1, end1, beg2, end2, count;
+} cell_t;
+
+
+// Function headers.
+node_t       * json_parse   (const char * path);
+node_t       * parse_value  (char ** p, char * key);
+char         * parse_string (char ** p);
+node_t       * node_get     (node_t * node, const char * key);
+long           node_long    (node_t * node, const char * key);
+const char   * node_str     (node_t * node, const char * key);
+void           node_merge   (node_t * dst, node_t * src, int depth);
+void           node_write   (json_t * js, node_t * node, int depth, int nshards, node_t * matrices);
+void           node_free    (node_t * node);
+void           copy_contacts (const char * path, int shard, const char * format, long offset, cbhdr_t * hdr0, char ** names0);
+void           merge_matrix (node_t ** stats, int nshards, const char * res, const char * path);
+int            cell_next    (cell_t * c);
+int            cell_cmp     (const cell_t * a, const cell_t * b);
+
+// Source.
+
+int main(int argc, char *argv[])
+{
+   double start = wall_clock();
+
+   // Parse options.
+   char * jsonfile = NULL;
+   char * prefix = "matrix";
+   int    opt;
+   while ((opt = getopt(argc, argv, "j:o:")) != -1) {
+      switch (opt) {
+      case 'j':
+         jsonfile = optarg;
+         break;
+      case 'o':
+         prefix = optarg;
+         break;
+      default:
+         exit(1);
+      }
+   }
+
+   int nshards = argc - optind == 2 ? atoi(argv[optind+1]) : 0;
+   if (nshards < 1) {
+      fprintf(stderr, "usage: %s [-j stats.json] [-o prefix] <shard prefix> <N> > contacts\n", argv[0]);
+      fprintf(stderr, "  reads <shard prefix>.<i>.out and <shard prefix>.<i>.json (i = 0..N-1), written by\n");
+      fprintf(stderr, "  parse_contacts --shard i/N -j <shard prefix>.<i>.json ... > <shard prefix>.<i>.out\n");
+      fprintf(stderr, "  -j  write the combined statistics to a JSON file\n");
+      fprintf(stderr, "  -o  prefix of the combined matrix files (default: matrix, written to <prefix>.<res>.txt)\n");
+      exit(1);
+   }
+   const char * shards = argv[optind];
+   char * path = malloc(strlen(shards) + 32);
+
+   // Stats of the shards, which must tile the input file.
+   node_t ** stats = malloc(nshards * sizeof(node_t *));
+   for (int i = 0; i < nshards; i++) {
+      sprintf(path, "%s.%d.json", shards, i);
+      stats[i] = json_parse(path);
+      node_t * sh = node_get(stats[i], "shard");
+      const char * program = node_str(stats[i], "program");
+      if (program == NULL || strcmp(program, "parse_contacts") != 0 || sh == NULL) {
+         fprintf(stderr, "error: %s is not the stats file of a parse_contacts shard.\n", path);
+         exit(1);
+      }
+      if (node_long(sh, "index") != i || node_long(sh, "count") != nshards) {
+         fprintf(stderr, "error: %s is shard %ld/%ld, expected %d/%d.\n", path,
+                 node_long(sh, "index"), node_long(sh, "count"), i, nshards);
+         exit(1);
+      }
+      node_t * prev = i > 0 ? node_get(stats[i-1], "shard") : NULL;
+      if ((prev != NULL && node_long(prev, "end") != node_long(sh, "begin")) ||
+          (i == nshards - 1 && node_long(sh, "end") != node_long(sh, "file_bytes"))) {
+         fprintf(stderr, "error: the byte ranges of the shards do not cover the input (%s).\n", path);
+         exit(1);
+      }
+      if (strcmp(node_str(stats[i], "format"), node_str(stats[0], "format")) != 0 ||
+          strcmp(node_str(stats[i], "input"), node_str(stats[0], "input")) != 0 ||
+          node_long(sh, "file_bytes") != node_long(node_get(stats[0], "shard"), "file_bytes")) {
+         fprintf(stderr, "error: the shards have different inputs or formats (%s).\n", path);
+         exit(1);
+      }
+   }
+
+   // Contacts, in shard order.
+   const char * format = node_str(stats[0], "format");
+   cbhdr_t      hdr0 = {{0}};
+   char       * names0 = NULL;
+   long         offset = 0;
+   for (int i = 0; i < nshards; i++) {
+      sprintf(path, "%s.%d.out", shards, i);
+      copy_contacts(path, i, format, offset, &hdr0, &names0);
+      offset += node_long(stats[i], "read_groups");
+   }
+   if (fflush(stdout)) {
+      fprintf(stderr, "error writing contacts.\n");
+      exit(1);
+   }
+   free(names0);
+
+   // Matrices (the same resolutions in every shard).
+   node_t * mx = node_get(stats[0], "matrices");
+   node_t * matrices = NULL;
+   if (mx != NULL) {
+      matrices = calloc(1, sizeof(node_t));
+      matrices->kid = malloc(mx->n * sizeof(node_t *));
+      for (int r = 0; r < mx->n; r++) {
+         node_t * m = calloc(1, sizeof(node_t));
+         m->key  = strdup(mx->kid[r]->key);
+         m->type = JSON_STRING;
+         m->s    = malloc(strlen(prefix) + strlen(m->key) + 8);
+         sprintf(m->s, "%s.%s.txt", prefix, m->key);
+         matrices->kid[matrices->n++] = m;
+         merge_matrix(stats, nshards, m->key, m->s);
+      }
+   }
+
+   // Counters are added (see node_merge).
+   node_t * total = stats[0];
+   for (int i = 1; i < nshards; i++)
+      node_merge(total, stats[i], 0);
+
+   fprintf(stderr, "Shards:                 \t%d\n", nshards);
+   fprintf(stderr, "Reads:                  \t%ld\n", node_long(total, "reads"));
+   fprintf(stderr, "Read groups:            \t%ld\n", node_long(total, "read_groups"));
+   fprintf(stderr, "Valid pairs:            \t%ld\n", node_long(node_get(total, "pairs"), "valid"));
+   fprintf(stderr, "Invalid pairs:          \t%ld\n", node_long(node_get(total, "pairs"), "invalid"));
+   fprintf(stderr, "\nRun time:               \t%.2f s\n", wall_clock() - start);
+
+   if (jsonfile != NULL) {
+      json_t * js = json_open(jsonfile);
+      if (js == NULL) {
+         fprintf(stderr, "error opening file: %s\n", jsonfile);
+         exit(1);
+      }
+      node_write(js, total, 0, nshards, matrices);
+      if (json_close(js)) {
+         fprintf(stderr, "error writing file: %s\n", jsonfile);
+         exit(1);
+      }
+   }
+
+   for (int i = 0; i < nshards; i++)
+      node_free(stats[i]);
+   if (matrices != NULL) node_free(matrices);
+   free(stats);
+   free(path);
+   return 0;
+}
+
+// Appends the contacts of a shard to stdout. The header of the first shard
+// is written (and must be the same in all of them): the binary header and
+// dictionary, or the comment lines of the pairs format.
+void
+copy_contacts
+(
+ const char * path,
+ int          shard,
+ const char * format,
+ long         offset,
+ cbhdr_t    * hdr0,
+ char      ** names0
+)
+{
+   FILE * f = fopen(path, "r");
+   if (f == NULL) {
+      fprintf(stderr, "error opening file: %s\n", path);
+      exit(1);
+   }
+   char * buf = malloc(COPY_BLOCK);
+   size_t n;
+
+   if (strcmp(format, "binary") == 0) {
+      cbhdr_t hdr;
+      if (fread(&hdr, sizeof(cbhdr_t), 1, f) != 1 || memcmp(hdr.magic, CB_MAGIC, 4) != 0 || hdr.version != CB_VERSION) {
+         fprintf(stderr, "error: %s is not a binary contact file.\n", path);
+         exit(1);
+      }
+      char * names = malloc(hdr.names_size + 1);
+      if (fread(names, 1, hdr.names_size, f) != hdr.names_size) {
+         fprintf(stderr, "error: truncated binary contact file (%s).\n", path);
+         exit(1);
+      }
+      if (shard == 0) {
+         *hdr0 = hdr;
+         *names0 = names;
+         if (fwrite(&hdr, sizeof(cbhdr_t), 1, stdout) != 1 || fwrite(names, 1, hdr.names_size, stdout) != hdr.names_size) {
+            fprintf(stderr, "error writing contacts.\n");
+            exit(1);
+         }
+      } else {
+         if (memcmp(&hdr, hdr0, sizeof(cbhdr_t)) != 0 || memcmp(names, *names0, hdr.names_size) != 0) {
+            fprintf(stderr, "error: the chromosomes of %s differ from those of the first shard.\n", path);
+            exit(1);
+         }
+         free(names);
+      }
+
+      // Records, with the read IDs shifted to the whole input.
+      size_t recsize = sizeof(cbrec_t) + (hdr.flags & CB_READID ? sizeof(uint64_t) : 0);
+      size_t nrec = COPY_BLOCK / recsize;
+      while ((n = fread(buf, recsize, nrec, f)) > 0) {
+         if (hdr.flags & CB_READID) {
+            for (size_t i = 0; i < n; i++) {
+               uint64_t id;
+               memcpy(&id, buf + i*recsize + sizeof(cbrec_t), sizeof(uint64_t));
+               id += offset;
+               memcpy(buf + i*recsize + sizeof(cbrec_t), &id, sizeof(uint64_t));
+            }
+         }
+         if (fwrite(buf, recsize, n, stdout) != n) {
+            fprintf(stderr, "error writing contacts.\n");
+            exit(1);
+         }
+      }
+      if ((ftell(f) - (long) (sizeof(cbhdr_t) + hdr.names_size)) % recsize) {
+         fprintf(stderr, "error: truncated binary contact file (%s).\n", path);
+         exit(1);
+      }
+   } else {
+      // Text (the header lines of the pairs format start with #).
+      if (shard > 0 && strcmp(format, "pairs") == 0) {
+         int c;
+         while ((c = fgetc(f)) == '#') {
+            while ((c = fgetc(f)) != EOF && c != '\n');
+         }
+         if (c != EOF) ungetc(c, f);
+      }
+      while ((n = fread(buf, 1, COPY_BLOCK, f)) > 0) {
+         if (fwrite(buf, 1, n, stdout) != n) {
+            fprintf(stderr, "error writing contacts.\n");
+            exit(1);
+         }
+      }
+   }
+   if (ferror(f)) {
+      fprintf(stderr, "error reading file: %s\n", path);
+      exit(1);
+   }
+   free(buf);
+   fclose(f);
+}
+
+// Sums the matrices of resolution res of the shards. The cells of each file
+// are sorted by chromosome (IDs sort like the names), bin, chromosome and
+// bin, so they are merged in one pass.
+void
+merge_matrix
+(
+ node_t    ** stats,
+ int          nshards,
+ const char * res,
+ const char * path
+)
+{
+   cell_t * cell = calloc(nshards, sizeof(cell_t));
+   for (int i = 0; i < nshards; i++) {
+      const char * file = node_str(node_get(stats[i], "matrices"), res);
+      if (file == NULL || (cell[i].f = fopen(file, "r")) == NULL) {
+         fprintf(stderr, "error opening the matrix at %s bp of shard %d.\n", res, i);
+         exit(1);
+      }
+      cell[i].path = strdup(file);
+      cell_next(cell + i);
+   }
+   FILE * out = fopen(path, "w");
+   if (out == NULL) {
+      fprintf(stderr, "error opening file: %s\n", path);
+      exit(1);
+   }
+
+   while (1) {
+      cell_t * min = NULL;
+      for (int i = 0; i < nshards; i++)
+         if (!cell[i].eof && (min == NULL || cell_cmp(cell + i, min) < 0)) min = cell + i;
+      if (min == NULL) break;
+      cell_t c = *min;
+      long   count = 0;
+      for (int i = 0; i < nshards; i++) {
+         if (!cell[i].eof && cell_cmp(cell + i, &c) == 0) {
+            count += cell[i].count;
+            cell_next(cell + i);
+         }
+      }
+      fprintf(out, "%s\t%ld\t%ld\t%s\t%ld\t%ld\t%ld\n", c.chr1, c.beg1, c.end1, c.chr2, c.beg2, c.end2, count);
+   }
+
+   if (fclose(out)) {
+      fprintf(stderr, "error writing file: %s\n", path);
+      exit(1);
+   }
+   for (int i = 0; i < nshards; i++) {
+      fclose(cell[i].f);
+      free(cell[i].line);
+      free(cell[i].path);
+   }
+   free(cell);
+}
+
+// Reads the next cell of a shard matrix. Returns 0 at the end.
+int
+cell_next
+(
+ cell_t * c
+)
+{
+   cell_t prev = *c;
+   if (getline(&c->line, &c->cap, c->f) <= 0) {
+      c->eof = 1;
+      return 0;
+   }
+   if (strlen(c->line) >= NAME_SIZE ||
+       sscanf(c->line, "%s\t%ld\t%ld\t%s\t%ld\t%ld\t%ld", c->chr1, &c->beg1, &c->end1,
+              c->chr2, &c->beg2, &c->end2, &c->count) != 7) {
+      fprintf(stderr, "error: invalid matrix line in %s.\n", c->path);
+      exit(1);
+   }
+   if (prev.line != NULL && cell_cmp(&prev, c) >= 0) {
+      fprintf(stderr, "error: the cells of %s are not sorted by chromosome name.\n", c->path);
+      exit(1);
+   }
+   return 1;
+}
+
+int
+cell_cmp
+(
+ const cell_t * a,
+ const cell_t * b
+)
+{
+   int cmp = strcmp(a->chr1, b->chr1);
+   if (cmp) return cmp;
+   if (a->beg1 != b->beg1) return a->beg1 < b->beg1 ? -1 : 1;
+   cmp = strcmp(a->chr2, b->chr2);
+   if (cmp) return cmp;
+   if (a->beg2 != b->beg2) return a->beg2 < b->beg2 ? -1 : 1;
+   return 0;
+}
+
+// Adds the counters of src to dst. The settings (threads, stage_sample,
+// coordinate_sorted) and the strings are those of the first shard, the
+// run time and the scratch memory are those of the largest shard.
+void
+node_merge
+(
+ node_t * dst,
+ node_t * src,
+ int      depth
+)
+{
+   for (int i = 0; i < src->n; i++) {
+      node_t * s = src->kid[i];
+      node_t * d = node_get(dst, s->key);
+      if (d == NULL || d->type != s->type) continue;
+      switch (s->type) {
+      case JSON_OBJECT:
+         node_merge(d, s, depth + 1);
+         break;
+      case JSON_LONG:
+         if (depth == 0 && strcmp(s->key, "scratch_bytes") == 0)
+            d->l = d->l > s->l ? d->l : s->l;
+         else if (depth > 0 || (strcmp(s->key, "threads") && strcmp(s->key, "stage_sample") &&
+                                strcmp(s->key, "coordinate_sorted")))
+            d->l += s->l;
+         break;
+      case JSON_DOUBLE:
+         if (depth == 0 && strcmp(s->key, "seconds") == 0)
+            d->d = d->d > s->d ? d->d : s->d;
+         else
+            d->d += s->d;
+         break;
+      }
+   }
+}
+
+// Writes the combined stats: the shard object is replaced by the number of
+// shards, and the matrices by the combined files.
+void
+node_write
+(
+ json_t * js,
+ node_t * node,
+ int      depth,
+ int      nshards,
+ node_t * matrices
+)
+{
+   for (int i = 0; i < node->n; i++) {
+      node_t * k = node->kid[i];
+      if (depth == 0 && strcmp(k->key, "shard") == 0) {
+         json_long(js, "shards", nshards);
+         continue;
+      }
+      if (depth == 0 && strcmp(k->key, "matrices") == 0 && matrices != NULL)
+         k = matrices;
+      switch (k->type) {
+      case JSON_OBJECT:
+         json_begin(js, node->kid[i]->key);
+         node_write(js, k, depth + 1, nshards, NULL);
+         json_end(js);
+         break;
+      case JSON_STRING:
+         json_str(js, k->key, k->s);
+         break;
+      case JSON_LONG:
+         json_long(js, k->key, k->l);
+         break;
+      case JSON_DOUBLE:
+         json_double(js, k->key, k->d);
+         break;
+      }
+   }
+}
+
+// Parses the JSON files written by runstats (objects, strings and numbers).
+node_t *
+json_parse
+(
+ const char * path
+)
+{
+   FILE * f = fopen(path, "r");
+   if (f == NULL) {
+      fprintf(stderr, "error opening file: %s\n", path);
+      exit(1);
+   }
+   char * text = NULL;
+   size_t size = 0;
+   if (getdelim(&text, &size, 0, f) < 0) {
+      fprintf(stderr, "error reading file: %s\n", path);
+      exit(1);
+   }
+   fclose(f);
+   char   * p = text;
+   node_t * node = parse_value(&p, NULL);
+   while (*p == ' ' || *p == '\n' || *p == '\t' || *p == '\r') p++;
+   if (node == NULL || node->type != JSON_OBJECT || *p) {
+      fprintf(stderr, "error: invalid JSON in %s.\n", path);
+      exit(1);
+   }
+   free(text);
+   return node;
+}
+
+node_t *
+parse_value
+(
+ char ** p,
+ char  * key
+)
+{
+   while (**p == ' ' || **p == '\n' || **p == '\t' || **p == '\r') (*p)++;
+   node_t * node = calloc(1, sizeof(node_t));
+   node->key = key;
+   if (**p == '{') {
+      node->type = JSON_OBJECT;
+      int max = 0;
+      (*p)++;
+      while (1) {
+         while (**p == ' ' || **p == '\n' || **p == '\t' || **p == '\r' || **p == ',') (*p)++;
+         if (**p == '}') {
+            (*p)++;
+            break;
+         }
+         char * k = parse_string(p);
+         while (**p == ' ') (*p)++;
+         if (k == NULL || *(*p)++ != ':') return NULL;
+         node_t * kid = parse_value(p, k);
+         if (kid == NULL) return NULL;
+         if (node->n >= max) {
+            max = max ? 2*max : 16;
+            node->kid = realloc(node->kid, max * sizeof(node_t *));
+         }
+         node->kid[node->n++] = kid;
+      }
+   } else if (**p == '"') {
+      node->type = JSON_STRING;
+      if ((node->s = parse_string(p)) == NULL) return NULL;
+   } else {
+      char * end;
+      node->d = strtod(*p, &end);
+      if (end == *p) return NULL;
+      node->type = memchr(*p, '.', end - *p) || memchr(*p, 'e', end - *p) ? JSON_DOUBLE : JSON_LONG;
+      node->l = strtol(*p, NULL, 10);
+      *p = end;
+   }
+   return node;
+}
+
+char *
+parse_string
+(
+ char ** p
+)
+{
+   if (**p != '"') return NULL;
+   char * s = ++(*p);
+   char * o = s;
+   while (**p && **p != '"') {
+      if (**p == '\\' && (*p)[1] == 'u') {
+         *o++ = (char) strtol((char []) {(*p)[2], (*p)[3], (*p)[4], (*p)[5], 0}, NULL, 16);
+         *p += 6;
+      } else {
+         if (**p == '\\') (*p)++;
+         *o++ = *(*p)++;
+      }
+   }
+   if (**p != '"') return NULL;
+   (*p)++;
+   *o = 0;
+   return strdup(s);
+}
+
+node_t *
+node_get
+(
+ node_t     * node,
+ const char * key
+)
+{
+   for (int i = 0; node != NULL && i < node->n; i++)
+      if (strcmp(node->kid[i]->key, key) == 0) return node->kid[i];
+   return NULL;
+}
+
+long
+node_long
+(
+ node_t     * node,
+ const char * key
+)
+{
+   node_t * k = node_get(node, key);
+   return k != NULL && k->type == JSON_LONG ? k->l : -1;
+}
+
+const char *
+node_str
+(
+ node_t     * node,
+ const char * key
+)
+{
+   node_t * k = node_get(node, key);
+   return k != NULL && k->type == JSON_STRING ? k->s : NULL;
+}
+
+void
+node_free
+(
+ node_t * node
+)
+{
+   for (int i = 0; i < node->n; i++)
+      node_free(node->kid[i]);
+   free(node->kid);
+   free(node->key);
+   free(node->s);
+   free(node);
+}
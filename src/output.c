@@ -0,0 +1,128 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "output.h"
+
+// Decimal digits of 0 to 99.
+static const char digits[201] =
+   "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+   "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+   "8081828384858687888990919293949596979899";
+
+// Source.
+
+// Makes room for len more bytes (the buffer grows by doubling).
+void
+out_reserve
+(
+ outbuf_t * out,
+ size_t     len
+)
+{
+   if (out->len + len <= out->size) return;
+   while (out->len + len > out->size)
+      out->size = out->size ? 2*out->size : OUT_BLOCK;
+   out->buf = realloc(out->buf, out->size);
+}
+
+void
+out_char
+(
+ outbuf_t * out,
+ char       c
+)
+{
+   out_reserve(out, 1);
+   out->buf[out->len++] = c;
+}
+
+void
+out_str
+(
+ outbuf_t   * out,
+ const char * str
+)
+{
+   size_t len = strlen(str);
+   out_reserve(out, len);
+   memcpy(out->buf + out->len, str, len);
+   out->len += len;
+}
+
+// Formats val in decimal, two digits at a time.
+void
+out_long
+(
+ outbuf_t * out,
+ long       val
+)
+{
+   char   tmp[24];
+   char * p = tmp + sizeof(tmp);
+   unsigned long u = val < 0 ? -(unsigned long) val : (unsigned long) val;
+   while (u >= 100) {
+      p -= 2;
+      memcpy(p, digits + 2*(u % 100), 2);
+      u /= 100;
+   }
+   if (u >= 10) {
+      p -= 2;
+      memcpy(p, digits + 2*u, 2);
+   } else {
+      *--p = '0' + u;
+   }
+   if (val < 0) *--p = '-';
+
+   size_t len = tmp + sizeof(tmp) - p;
+   out_reserve(out, len);
+   memcpy(out->buf + out->len, p, len);
+   out->len += len;
+}
+
+// Writes the n buffers (in order) and empties them. Returns 0 on success
+// and -1 on error (errno is set).
+int
+out_write
+(
+ int         fd,
+ outbuf_t ** out,
+ int         n
+)
+{
+   struct iovec iov[64];
+   int i = 0;
+   size_t done = 0;
+   while (i < n) {
+      // Next group of buffers (skipping what was already written).
+      int cnt = 0;
+      for (int j = i; j < n && cnt < 64; j++) {
+         size_t skip = j == i ? done : 0;
+         iov[cnt++] = (struct iovec) {out[j]->buf + skip, out[j]->len - skip};
+      }
+      ssize_t bytes = writev(fd, iov, cnt);
+      if (bytes < 0) {
+         if (errno == EINTR) continue;
+         return -1;
+      }
+      // Advance over the buffers written.
+      done += bytes;
+      while (i < n && done >= out[i]->len) {
+         done -= out[i]->len;
+         out[i++]->len = 0;
+      }
+   }
+   return 0;
+}
+
+void
+out_free
+(
+ outbuf_t * out
+)
+{
+   free(out->buf);
+   *out = (outbuf_t) {0};
+}
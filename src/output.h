@@ -0,0 +1,28 @@
+#ifndef _OUTPUT_H
+#define _OUTPUT_H
+
+#include <stddef.h>
+
+// Output buffers. Records are formatted in large buffers (one per batch or
+// thread, with no locking), which are written to a file descriptor with a
+// single writev.
+
+#define OUT_BLOCK (1 << 20)
+
+// Struct definitions.
+
+typedef struct {
+   char   * buf;
+   size_t   len;
+   size_t   size;
+} outbuf_t;
+
+// Function headers.
+void           out_reserve  (outbuf_t * out, size_t len);
+void           out_char     (outbuf_t * out, char c);
+void           out_str      (outbuf_t * out, const char * str);
+void           out_long     (outbuf_t * out, long val);
+int            out_write    (int fd, outbuf_t ** out, int n);
+void           out_free     (outbuf_t * out);
+
+#endif
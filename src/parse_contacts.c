@@ -8,19 +8,54 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <libgen.h>
 #include <ctype.h>
-
-#define    HIC_FORMAT 1
-#define COOLER_FORMAT 2
-
-#define FORMAT HIC_FORMAT
+#include <pthread.h>
+#include <stdint.h>
+#include "isd.h"
+#include "bgzf.h"
+#include "output.h"
+#include "contacts.h"
+#include "matrix.h"
+#include "runstats.h"
+#include "mates.h"
+
+#define    HIC_FORMAT 0
+#define COOLER_FORMAT 1
+#define TADBIT_FORMAT 2
+#define  PAIRS_FORMAT 3
+#define BINARY_FORMAT 4
+#define   NONE_FORMAT 5
+#define      NFORMATS 6
+
+#define PAIRS_VERSION "1.0"
 
 #define MIN_SCORE 10
 #define HASH_SIZE 2048
 #define MAX_INSERT_SIZE 2000
 #define MIN_MAPQ 20
 #define MAX_OVERLAP 4
+#define BATCH_LINES 65536
+#define READ_BLOCK (4 << 20)
+#define LOOKUP_BATCH 32
+#define BAM_MAGIC "BAM\1"
+#define MATRIX_PREFIX "matrix"
+#define MATES_MEMORY 1024
+#define CHRTAB_CHUNK 1024
+#define CHRTAB_CHUNKS 1024
+#define CHRTAB_SLOTS (2*CHRTAB_CHUNK*CHRTAB_CHUNKS)
+
+// Stages of the contact pipeline (the workers time one read group in
+// STAGE_SAMPLE, see runstats.h).
+#define STAGE_READ    0
+#define STAGE_PARSE   1
+#define STAGE_CIGAR   2
+#define STAGE_LOOKUP  3
+#define STAGE_PAIRS   4
+#define STAGE_OUTPUT  5
+#define STAGE_WRITE   6
+#define NSTAGES       7
 
 #define FLAG_MULTISEGMENT   0x001
 #define FLAG_PROPALIGN      0x002
@@ -43,17 +78,27 @@
 // Struct definitions.
 
 typedef struct {
-   char * seqname;
-   char * chr;
-   char * cigar;
-   short  flag;
-   short  mapq;
-   int    score;
-   long   locus;
+   int beg_clip;
+   int end_clip;
+   int matches;
+   int insertions;
+   int deletions;
+} cigar_t;
+
+// SAM record. The read name points to the batch text (NUL-terminated in
+// place), the chromosome is an ID of the chromosome table.
+typedef struct {
+   char    * seqname;
+   int       chr;
+   cigar_t   cigar;
+   short     flag;
+   short     mapq;
+   int       score;
+   long      locus;
 } sam_t;
 
 typedef struct {
-   char * chr;
+   int    chr;
    long   beg_ref;
    long   end_ref;
    long   beg_frag;
@@ -78,166 +123,1180 @@ typedef struct {
 } mapstack_t;
 
 typedef struct {
-   int beg_clip;
-   int end_clip;
-   int matches;
-   int insertions;
-   int deletions;
-} cigar_t;
-
+   long valid;
+   long single_read;
+   long unmapped;
+   long repeats;
+   long self_filter;
+   long dangling;
+   long unknown;
+   long insert_filter;
+   long groups;
+   long scratch_bytes;
+   int  timing;
+   stage_t stage[NSTAGES];
+} stats_t;
+
+// Chromosome names interned to dense IDs. The names of the digestion and of
+// the SAM/BAM header are sorted, so that their IDs compare like the names,
+// and their table is read-only while the workers run. Names found only in
+// the reads get the next IDs and compare by name. They are added under lock
+// to chunks that never move and to a hash table of fixed size (slots hold
+// ID+1), which are published with atomic stores and read without lock.
+typedef struct {
+   int                   n;
+   int                   nsorted;
+   char               ** name;
+   char               ** extra[CHRTAB_CHUNKS];
+   int                 * slot;
+   isdchr_t           ** ref;
+   struct hsearch_data   htable;
+   pthread_mutex_t       lock;
+} chrtab_t;
+
+// Contact writer of an output format (chosen once with -f, so that the
+// contact loop does not test the format).
+typedef void (*writer_t)(outbuf_t * out, const char * seqname, long readid, map_t * m1, map_t * m2, chrtab_t * chr);
+
+// Per-thread workspace of parse_contact. The stacks are reused by all the
+// read groups and only grow, so the contact path allocates nothing once
+// they fit the largest group (scratch_size counts the bytes allocated).
+typedef struct {
+   samstack_t * sams;
+   mapstack_t * mapf;
+   mapstack_t * mapr;
+   mapstack_t * mf;
+   mapstack_t * mr;
+   mapstack_t * tmp;
+} scratch_t;
+
+// SAM lines (or BAM records) of whole read-name groups, read in blocks.
+// Lines are offsets in text (line[nlines] is the end of the last line),
+// groups are indices in line.
+typedef struct {
+   char   * text;
+   size_t   len;
+   size_t   size;
+   long   * line;
+   int      nlines;
+   int      maxlines;
+   int    * group;
+   int      ngroups;
+   int      maxgroups;
+   long     first_group;
+   outbuf_t out;
+   int      done;
+} batch_t;
+
+// Contact pipeline: a reader splits the SAM/BAM stream in batches of read
+// groups, the workers find their contacts and the main thread writes them
+// in input order (or the workers write them as they finish, if unordered).
 typedef struct {
-   char * chr;
-   int    cnt;
-   int  * re_site;
-} isdchr_t;
+   bgzf_t              * in;
+   char                * head;
+   size_t                headlen;
+   int                   bam;
+   int                   nref;
+   int                 * ref_id;
+   chrtab_t            * chr;
+   int                   min_mapq;
+   int                   max_insz;
+   int                   unordered;
+   writer_t              write;
+   int                   readid;
+   int                   nres;
+   long                * res;
+   long                  bytes;
+   stage_t               read;
+   progress_t            progress;
+   size_t                budget;
+   const char          * tmpdir;
+   long                  spilled;
+   long                  late;
+   long                  late_pass;
+   int                   nspills;
+   int                   nshards;
+   long                  ngroups;
+   batch_t             * batch;
+   int                   nslots;
+   long                  nbatches;
+   long                  next;
+   long                  nwritten;
+   int                   eof;
+   pthread_mutex_t       lock;
+   pthread_cond_t        cond;
+   pthread_mutex_t       out_lock;
+} pool_t;
 
+typedef struct {
+   pool_t    * pool;
+   scratch_t * scratch;
+   matrix_t ** mx;
+   stats_t     stats;
+} worker_t;
+
+// Batch being filled by mates_reader, and the records of a group in
+// aligner order (key, offset).
+typedef struct {
+   pool_t    * pool;
+   batch_t   * batch;
+   long      * order;
+   int         size;
+} reader_t;
 
 
 // Function headers.
-void           parse_sam    (sam_t * sam, char * samline);
-cigar_t        parse_cigar  (char *);
-int            parse_contact(samstack_t *, struct hsearch_data *, int, int);
+void           parse_sam    (sam_t * sam, char * samline, char * end, chrtab_t * tab, stats_t * stats);
+void           parse_bam    (sam_t * sam, char * rec, const int * ref_id, int nref);
+cigar_t        parse_cigar  (const char * str, const char * end);
+void           cigar_op     (cigar_t * cigar, char op, int num);
+int32_t        bam_i32      (const char * p);
+void           bam_read     (bgzf_t * in, void * buf, size_t len);
+char         * bam_tag      (char * p, char * end, const char * tag);
+char        ** bam_header   (bgzf_t * in, int * nref, long ** reflen, int * coord);
+char        ** sam_header   (bgzf_t * in, char ** text, size_t * len, int * nref, long ** reflen, int * coord);
+chrtab_t     * chrtab_build (isd_t * isd, char ** names, int n);
+void           chrtab_destroy (chrtab_t * tab);
+int            chrtab_id    (chrtab_t * tab, const char * name);
+const char   * chrtab_name  (chrtab_t * tab, int id);
+int          * chrtab_slot  (chrtab_t * tab, const char * name);
+int            chrtab_cmp   (chrtab_t * tab, int a, int b);
+long           parse_long   (const char * str);
+char         * sam_field    (char ** p, char * end);
+int            parse_contact(scratch_t *, chrtab_t *, int, int, writer_t, long, outbuf_t *, matrix_t **, int, stats_t *);
+void           write_hic    (outbuf_t *, const char *, long, map_t *, map_t *, chrtab_t *);
+void           write_cooler (outbuf_t *, const char *, long, map_t *, map_t *, chrtab_t *);
+void           write_tadbit (outbuf_t *, const char *, long, map_t *, map_t *, chrtab_t *);
+void           write_pairs  (outbuf_t *, const char *, long, map_t *, map_t *, chrtab_t *);
+void           write_binary (outbuf_t *, const char *, long, map_t *, map_t *, chrtab_t *);
+void           write_binary_id (outbuf_t *, const char *, long, map_t *, map_t *, chrtab_t *);
+void           write_none   (outbuf_t *, const char *, long, map_t *, map_t *, chrtab_t *);
+void           write_matrix (matrix_t * mx, chrtab_t * chr, const long * chrlen, const char * prefix);
+void           write_binary_header (chrtab_t * chr, int readid);
+void           write_pairs_header  (chrtab_t * chr, const long * chrlen, const char * organism);
+scratch_t    * new_scratch  (void);
+void           scratch_destroy (scratch_t *);
+size_t         scratch_size (scratch_t *);
 sam_t        * new_sam      (void);
 samstack_t   * new_samstack (int);
+void           samstack_destroy (samstack_t *);
 mapstack_t   * new_mapstack (int);
+int            mapstack_reserve (mapstack_t **, int);
 int            sam_push     (sam_t *, samstack_t *);
 int             map_push     (map_t, mapstack_t **);
 void           sam_destroy  (sam_t * sam);
-int            find_pe_contacts (mapstack_t  * fw, mapstack_t  * rv, mapstack_t ** dst);
+int            find_pe_contacts (mapstack_t  * fw, mapstack_t  * rv, mapstack_t ** dst, mapstack_t ** tmp, stats_t * stats);
 void           place_in_read (mapstack_t * src, mapstack_t * dst);
+void           batch_append (batch_t * batch, const char * data, size_t len);
+void           batch_group  (batch_t * batch);
+void           batch_line   (batch_t * batch, size_t p);
+size_t         record_end   (int bam, const char * text, size_t p, size_t len);
+size_t         record_name  (int bam, char * rec, size_t len, char ** name);
+int            record_flag  (int bam, char * rec, size_t len);
+int            record_mapq  (int bam, char * rec, size_t len);
+batch_t      * reader_batch (pool_t * pool);
+void           reader_push  (pool_t * pool, batch_t * batch, size_t end);
+int            reader_read  (pool_t * pool, char ** text, size_t * len, size_t * size, long nrecords);
+void           reader_group (void * ctx, mate_t * m);
+void         * sam_reader   (void * arg);
+void         * mates_reader (void * arg);
+long           shard_boundary (const char * path, long data, long size, long x);
+void         * contact_worker (void * arg);
 
 // Restriction enzyme functions.
-int      parse_isd    (int re_fd, char* re_name, struct hsearch_data* htable);
-int      bisection    (int* data, int beg, int end, int target);
-int      read_enzyme_db (char *, char *, struct hsearch_data *);
-void     fill_re_fragment_info (map_t *, struct hsearch_data *);
+isd_t  * read_enzyme_db (char *, char *, int);
+void     fill_re_fragment_info (mapstack_t *, mapstack_t *, chrtab_t *);
 
 // Sort compar functions.
 int            sam_by_score_desc (const void *, const void *);
+int            str_by_name       (const void *, const void *);
 int            map_by_read_beg   (const void *, const void *);
 
-// Stats variables.
-long valid         = 0;
-long single_read   = 0;
-long unmapped      = 0;
-long repeats       = 0;
-long self_filter   = 0;
-long dangling      = 0;
-long unknown       = 0;
-long insert_filter = 0;
-
 
 int main(int argc, char *argv[])
 {
+   double start = wall_clock();
+
+   // Output formats (names of -f).
+   const char * format_name[NFORMATS] = {"hic", "cooler", "tadbit", "pairs", "binary", "none"};
+
+   // Parse options.
+   int verify = 0;
+   int unordered = 0;
+   int format = HIC_FORMAT;
+   int readid = 0;
+   int nres = 0;
+   long * res = NULL;
+   char * prefix = MATRIX_PREFIX;
+   char * jsonfile = NULL;
+   double interval = PROGRESS_INTERVAL;
+   int    sorted = 0;
+   long   memory = MATES_MEMORY;
+   char * tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+   int    shard = 0, nshards = 0;
+   int threads = sysconf(_SC_NPROCESSORS_ONLN);
+   struct option longopts[] = {
+      {"shard", required_argument, NULL, 'S'},
+      {NULL, 0, NULL, 0}
+   };
+   int opt;
+   while ((opt = getopt_long(argc, argv, "bcf:j:m:M:no:p:sS:T:t:u", longopts, NULL)) != -1) {
+      switch (opt) {
+      case 'b':
+         format = BINARY_FORMAT;
+         break;
+      case 'c':
+         verify = 1;
+         break;
+      case 'f':
+         for (format = 0; format < NFORMATS; format++)
+            if (strcasecmp(optarg, format_name[format]) == 0) break;
+         if (format == NFORMATS) {
+            fprintf(stderr, "error: unknown output format '%s' (hic, cooler, tadbit, pairs, binary or none).\n", optarg);
+            exit(1);
+         }
+         break;
+      case 'j':
+         jsonfile = optarg;
+         break;
+      case 'm':
+         // Comma-separated resolutions.
+         for (char * r = strtok(optarg, ","); r != NULL; r = strtok(NULL, ",")) {
+            res = realloc(res, (nres+1) * sizeof(long));
+            res[nres] = atol(r);
+            if (res[nres++] < 1) {
+               fprintf(stderr, "error: invalid matrix resolution '%s'.\n", r);
+               exit(1);
+            }
+         }
+         break;
+      case 'M':
+         memory = atol(optarg);
+         break;
+      case 'n':
+         readid = 1;
+         break;
+      case 's':
+         sorted = 1;
+         break;
+      case 'S':
+         if (sscanf(optarg, "%d/%d", &shard, &nshards) != 2 || shard < 0 || shard >= nshards) {
+            fprintf(stderr, "error: the shard must be i/N with 0 <= i < N (%s).\n", optarg);
+            exit(1);
+         }
+         break;
+      case 'T':
+         tmpdir = optarg;
+         break;
+      case 'o':
+         prefix = optarg;
+         break;
+      case 'p':
+         interval = atof(optarg);
+         break;
+      case 't':
+         threads = atoi(optarg);
+         break;
+      case 'u':
+         unordered = 1;
+         break;
+      default:
+         exit(1);
+      }
+   }
+   if (threads < 1) threads = 1;
+   if (readid && format != BINARY_FORMAT) {
+      fprintf(stderr, "error: -n requires binary output (-b or -f binary).\n");
+      exit(1);
+   }
+
    // Parse params.
-   if (argc < 4) {
-      fprintf(stderr, "usage: %s <organism> <RE> <hic-pe.sam> [mapq >= 20] [ins_size <= 2000]\n", argv[0]);
+   if (argc - optind < 3) {
+      fprintf(stderr, "usage: %s [-f format | -b [-n]] [-m res[,res...] [-o prefix]] [-j stats.json] [-p seconds] [-s [-M memory MB] [-T tmp dir]] [--shard i/N] [-c] [-t threads] [-u] <organism> <RE> <hic-pe.sam|bam> [mapq >= 20] [ins_size <= 2000]\n", argv[0]);
+      fprintf(stderr, "  -f  output format: hic (default), cooler, tadbit, pairs (4DN), binary or none\n");
+      fprintf(stderr, "  -b  write binary contact records (same as -f binary, see contacts.h)\n");
+      fprintf(stderr, "  -n  add the read number to binary records\n");
+      fprintf(stderr, "  -m  accumulate contact matrices at these resolutions (bp)\n");
+      fprintf(stderr, "  -o  prefix of the matrix files (default: %s, written to <prefix>.<res>.txt)\n", MATRIX_PREFIX);
+      fprintf(stderr, "  -j  write the run statistics (counters and stage times) to a JSON file\n");
+      fprintf(stderr, "  -p  seconds between progress lines (default: %d, 0: none)\n", PROGRESS_INTERVAL);
+      fprintf(stderr, "  -s  coordinate-sorted input: pair the records by read name (default if the header has SO:coordinate)\n");
+      fprintf(stderr, "  -M  memory budget of the pending mates in MB (default: %d, then spilled to temporary files)\n", MATES_MEMORY);
+      fprintf(stderr, "  -T  directory of the temporary files (default: $TMPDIR or /tmp)\n");
+      fprintf(stderr, "  -S, --shard i/N\n");
+      fprintf(stderr, "      process the i-th of N byte ranges of a SAM file (at read group boundaries, see merge_shards)\n");
+      fprintf(stderr, "  -c  verify the checksums of the digestion file\n");
+      fprintf(stderr, "  -t  number of threads (default: all cores)\n");
+      fprintf(stderr, "  -u  write contacts as they are found (not in input order)\n");
       exit(1);
    }
 
    fprintf(stderr, "open files...");
 
    // Get args.
-   char * organism = argv[1];
-   char * re_name  = argv[2];
+   char * organism = argv[optind];
+   char * re_name  = argv[optind+1];
+   char * samfile  = argv[optind+2];
    int    min_mapq = MIN_MAPQ;
    int    max_insz = MAX_INSERT_SIZE;
-   if (argc > 4) min_mapq = atoi(argv[4]);
-   if (argc > 5) max_insz = atoi(argv[5]);
+   if (argc - optind > 3) min_mapq = atoi(argv[optind+3]);
+   if (argc - optind > 4) max_insz = atoi(argv[optind+4]);
 
-   // Open files.
-   FILE * fin = fopen(argv[3], "r");
-   if (fin == NULL) {
-      fprintf(stderr, "error opening file: %s\n", argv[3]);
+   // Open files (plain, gzip or BGZF compressed).
+   bgzf_t * in = bgzf_open(samfile, threads);
+   if (in == NULL) {
+      fprintf(stderr, "error opening file: %s\n", samfile);
       exit(1);
    }
 
    // Read database.
    fprintf(stderr, "ok\nloading RE database...");
-   struct hsearch_data htable = {0};
-   hcreate_r(HASH_SIZE, &htable);
-   read_enzyme_db(organism, re_name, &htable);
+   isd_t * isd = read_enzyme_db(organism, re_name, verify);
    fprintf(stderr, "ok\nparsing sam file...");
 
-   // Read lines.
-   size_t lines = 0;
-   size_t bufsize = 200;
-   char * line = malloc(bufsize);
-   ssize_t bytes = 0;
-   char sam_last;
-   // SAM buffers.
-   samstack_t * stack = new_samstack(100);
-   sam_t      * sam   = new_sam();
-   
+   // BAM files start with their magic string and a binary header, SAM
+   // files with the header lines (the reader starts after them).
+   char   * head = malloc(4);
+   size_t   headlen = bgzf_read(in, head, 4);
+   int      nref = 0;
+   int      coord = 0;
+   long   * reflen;
+   char  ** ref;
+   int      bam = headlen == 4 && memcmp(head, BAM_MAGIC, 4) == 0;
+   if (bam) {
+      ref = bam_header(in, &nref, &reflen, &coord);
+      headlen = 0;
+   } else {
+      ref = sam_header(in, &head, &headlen, &nref, &reflen, &coord);
+   }
 
-   // Skip header until first read.
-   do {
-      bytes = getline(&line, &bufsize, fin);
-   } while (bytes > 0 && line[0] == '@');
-   // End of file.
-   if (bytes < 0) {
-      fprintf(stderr,"error: input file is empty.\n");
-      exit(1);
+   // Records of a read name are not adjacent in coordinate-sorted input.
+   if (coord && !sorted && !nshards) {
+      fprintf(stderr, "coordinate-sorted input, pairing mates by name...");
+      sorted = 1;
    }
-   // Parse line.
-   parse_sam(sam, line);
-
-   // File loop.
-   char * seqname = malloc(1000);
-   do {
-      // 0. Reset variables.
-      stack->pos = 0;
-      // 1. Save reference read.
-      strcpy(seqname, sam->seqname);
-      sam_push(sam, stack);
-      // 2. Store all reads with the same seqname.
-      do {
-         bytes = getline(&line, &bufsize, fin);
-         // End of file.
-         if (bytes < 0) break;
-         // Parse line.
-         parse_sam(sam, line);
-         // Compare seqnames.
-         if (strcmp(seqname, sam->seqname) != 0)
-            break;
-         sam_push(sam, stack);
-      } while (1);
-      // 3. Process reads.
-      parse_contact(stack, &htable, min_mapq, max_insz);
-   } while (bytes > 0);
 
-   fprintf(stderr, "ok\n\nValid pairs:            \t%ld\n", valid);
+   // Byte range of the shard. Both ends are moved to read group boundaries
+   // the same way, so the shards cover every group exactly once.
+   long shard_beg = 0, shard_end = 0, insize = 0;
+   if (nshards) {
+      struct stat st;
+      if (bam || in->mode != BGZF_PLAIN) {
+         fprintf(stderr, "error: --shard needs an uncompressed SAM file (compressed input).\n");
+         exit(1);
+      }
+      if (fstat(in->fd, &st) || !S_ISREG(st.st_mode)) {
+         fprintf(stderr, "error: --shard needs a regular file (input is not seekable).\n");
+         exit(1);
+      }
+      if (sorted || coord) {
+         fprintf(stderr, "error: --shard needs the records of a read name to be adjacent (not sorted by coordinate).\n");
+         exit(1);
+      }
+      // Start of the records: the file position minus the bytes already
+      // read past the header.
+      long data = lseek(in->fd, 0, SEEK_CUR) - (in->npeek - in->ppeek) - headlen;
+      insize    = st.st_size;
+      shard_beg = shard_boundary(samfile, data, insize, insize / nshards * shard + insize % nshards * shard / nshards);
+      shard_end = shard_boundary(samfile, data, insize, insize / nshards * (shard + 1) + insize % nshards * (shard + 1) / nshards);
+      if (bgzf_range(in, shard_beg, shard_end)) {
+         fprintf(stderr, "error: cannot seek in %s.\n", samfile);
+         exit(1);
+      }
+      headlen = 0;
+      fprintf(stderr, "shard %d/%d: bytes %ld-%ld...", shard, nshards, shard_beg, shard_end);
+   }
+
+   // Intern chromosome names (BAM references are mapped to their IDs).
+   chrtab_t * chr = chrtab_build(isd, ref, nref);
+   int      * ref_id = malloc((nref + 1) * sizeof(int));
+   long     * chrlen = calloc(chr->nsorted, sizeof(long));
+   for (int i = 0; i < nref; i++) {
+      ref_id[i] = chrtab_id(chr, ref[i]);
+      chrlen[ref_id[i]] = reflen[i];
+      free(ref[i]);
+   }
+   ref_id[nref] = chrtab_id(chr, "*");
+   free(ref);
+   free(reflen);
+
+   // Contact pipeline.
+   pool_t pool = {
+      .in        = in,
+      .head      = head,
+      .headlen   = headlen,
+      .bytes     = headlen,
+      .bam       = bam,
+      .nref      = nref,
+      .ref_id    = ref_id,
+      .chr       = chr,
+      .min_mapq  = min_mapq,
+      .max_insz  = max_insz,
+      .unordered = unordered,
+      .write     = (writer_t []) {write_hic, write_cooler, write_tadbit, write_pairs,
+                                      readid ? write_binary_id : write_binary, write_none}[format],
+      .readid    = readid,
+      .nres      = nres,
+      .res       = res,
+      .nshards   = nshards,
+      .budget    = (size_t) memory << 20,
+      .tmpdir    = tmpdir,
+      .nslots    = 4*threads,
+      .lock      = PTHREAD_MUTEX_INITIALIZER,
+      .cond      = PTHREAD_COND_INITIALIZER,
+      .out_lock  = PTHREAD_MUTEX_INITIALIZER
+   };
+   pool.batch = calloc(pool.nslots, sizeof(batch_t));
+   progress_init(&pool.progress, interval);
+
+   if (format == BINARY_FORMAT)
+      write_binary_header(chr, readid);
+   else if (format == PAIRS_FORMAT)
+      write_pairs_header(chr, chrlen, organism);
+
+   pthread_t reader;
+   pthread_create(&reader, NULL, sorted ? mates_reader : sam_reader, &pool);
+   pthread_t * tid = malloc(threads * sizeof(pthread_t));
+   worker_t  * worker = calloc(threads, sizeof(worker_t));
+   for (int i = 0; i < threads; i++) {
+      worker[i].pool = &pool;
+      pthread_create(tid+i, NULL, contact_worker, worker+i);
+   }
+
+   // Write batches in input order (unordered batches are already written).
+   // All the consecutive batches that are done are written at once.
+   outbuf_t ** ready = malloc(pool.nslots * sizeof(outbuf_t *));
+   stage_t     output = {0};
+   while (1) {
+      batch_t * batch = pool.batch + (pool.nwritten % pool.nslots);
+      pthread_mutex_lock(&pool.lock);
+      while (!(pool.nwritten < pool.nbatches && batch->done) &&
+             !(pool.eof && pool.nwritten == pool.nbatches))
+         pthread_cond_wait(&pool.cond, &pool.lock);
+      int n = 0;
+      while (pool.nwritten + n < pool.nbatches && pool.batch[(pool.nwritten + n) % pool.nslots].done) {
+         ready[n] = &pool.batch[(pool.nwritten + n) % pool.nslots].out;
+         n++;
+      }
+      pthread_mutex_unlock(&pool.lock);
+      if (n == 0) break;
+
+      double t0 = wall_clock();
+      if (!unordered && out_write(STDOUT_FILENO, ready, n)) {
+         fprintf(stderr, "error writing contacts.\n");
+         exit(1);
+      }
+      if (!unordered) stage_count(&output, n, 1, wall_clock() - t0);
+
+      // Release slots.
+      pthread_mutex_lock(&pool.lock);
+      pool.nwritten += n;
+      pthread_cond_broadcast(&pool.cond);
+      pthread_mutex_unlock(&pool.lock);
+   }
+   free(ready);
+
+   pthread_join(reader, NULL);
+   for (int i = 0; i < threads; i++)
+      pthread_join(tid[i], NULL);
+
+   // Reduce stats of all threads.
+   stats_t s = {0};
+   for (int i = 0; i < threads; i++) {
+      s.valid         += worker[i].stats.valid;
+      s.single_read   += worker[i].stats.single_read;
+      s.unmapped      += worker[i].stats.unmapped;
+      s.repeats       += worker[i].stats.repeats;
+      s.self_filter   += worker[i].stats.self_filter;
+      s.dangling      += worker[i].stats.dangling;
+      s.unknown       += worker[i].stats.unknown;
+      s.insert_filter += worker[i].stats.insert_filter;
+      s.groups        += worker[i].stats.groups;
+      s.scratch_bytes += worker[i].stats.scratch_bytes;
+      for (int k = 0; k < NSTAGES; k++)
+         stage_merge(s.stage + k, worker[i].stats.stage + k);
+      scratch_destroy(worker[i].scratch);
+   }
+   stage_merge(s.stage + STAGE_READ, &pool.read);
+   stage_merge(s.stage + STAGE_WRITE, &output);
+   double elapsed = wall_clock() - start;
+   long   nreads = s.stage[STAGE_PARSE].calls + pool.late;
+
+   fprintf(stderr, "ok\n\nValid pairs:            \t%ld\n", s.valid);
    fprintf(stderr, "Invalid pairs:          \t%ld\n", 
-           insert_filter+self_filter+single_read+unmapped+repeats+dangling+unknown);
-   fprintf(stderr, " - Repeats:             \t%ld\n", repeats);
-   fprintf(stderr, " - Dangling ends:       \t%ld\n", dangling);
-   fprintf(stderr, " - Self ligated:        \t%ld\n", self_filter);
-   fprintf(stderr, " - One read mapped:     \t%ld\n", single_read);
-   fprintf(stderr, " - Unmapped:            \t%ld\n", unmapped);
-   fprintf(stderr, " - Insert size (>%dbp):\t%ld\n", max_insz, insert_filter);
-   fprintf(stderr, " - Unknown event:       \t%ld\n", unknown);
-   free(stack);
-   free(sam);
+           s.insert_filter+s.self_filter+s.single_read+s.unmapped+s.repeats+s.dangling+s.unknown);
+   fprintf(stderr, " - Repeats:             \t%ld\n", s.repeats);
+   fprintf(stderr, " - Dangling ends:       \t%ld\n", s.dangling);
+   fprintf(stderr, " - Self ligated:        \t%ld\n", s.self_filter);
+   fprintf(stderr, " - One read mapped:     \t%ld\n", s.single_read);
+   fprintf(stderr, " - Unmapped:            \t%ld\n", s.unmapped);
+   fprintf(stderr, " - Insert size (>%dbp):\t%ld\n", max_insz, s.insert_filter);
+   fprintf(stderr, " - Unknown event:       \t%ld\n", s.unknown);
+   if (sorted)
+      fprintf(stderr, "\nSpilled mates:          \t%ld records (%d partitions)\n", pool.spilled, pool.nspills);
+   if (sorted)
+      fprintf(stderr, "Late secondary records: \t%ld (dropped, %ld with mapq >= %d)\n",
+              pool.late, pool.late_pass, min_mapq);
+   if (pool.late_pass > 0)
+      fprintf(stderr, "warning: %ld dropped secondary records pass the mapping quality threshold: the contacts may differ from those of the input grouped by read name.\n",
+              pool.late_pass);
+   // Allocations of the contact path (should not grow with the input).
+   fprintf(stderr, "\nScratch memory:         \t%ld bytes (%.4f bytes/read group)\n",
+           s.scratch_bytes, s.groups ? (double) s.scratch_bytes / s.groups : 0.0);
+
+   // Stage times are summed over threads (the workers time one read group
+   // in STAGE_SAMPLE).
+   const char * stage_name[NSTAGES] = {"read", bam ? "parse_bam" : "parse_sam", "parse_cigar",
+                                       "fill_re_fragment_info", "find_pe_contacts", "output", "write"};
+   fprintf(stderr, "\nRun time:               \t%.2f s (%.0f reads/s, %.1f MB/s)\n",
+           elapsed, nreads / elapsed, pool.bytes / 1e6 / elapsed);
+   for (int k = 0; k < NSTAGES; k++) {
+      char label[64];
+      snprintf(label, sizeof(label), " - %s:", stage_name[k]);
+      fprintf(stderr, "%-24s\t%.2f s (%ld calls)\n", label, stage_time(s.stage + k), s.stage[k].calls);
+   }
+
+   // Merge the matrices of all threads.
+   for (int r = 0; r < nres; r++) {
+      for (int i = 1; i < threads; i++) {
+         matrix_merge(worker[0].mx[r], worker[i].mx[r]);
+         matrix_destroy(worker[i].mx[r]);
+      }
+      write_matrix(worker[0].mx[r], chr, chrlen, prefix);
+      matrix_destroy(worker[0].mx[r]);
+   }
+   for (int i = 0; i < threads; i++)
+      free(worker[i].mx);
+
+   if (jsonfile != NULL) {
+      json_t * js = json_open(jsonfile);
+      if (js == NULL) {
+         fprintf(stderr, "error opening file: %s\n", jsonfile);
+         exit(1);
+      }
+      json_str(js, "program", "parse_contacts");
+      json_str(js, "input", samfile);
+      json_str(js, "format", format_name[format]);
+      if (nshards) {
+         json_begin(js, "shard");
+         json_long(js, "index", shard);
+         json_long(js, "count", nshards);
+         json_long(js, "begin", shard_beg);
+         json_long(js, "end", shard_end);
+         json_long(js, "file_bytes", insize);
+         json_end(js);
+      }
+      json_long(js, "threads", threads);
+      json_double(js, "seconds", elapsed);
+      json_long(js, "reads", nreads);
+      json_long(js, "read_groups", s.groups);
+      json_long(js, "bytes", pool.bytes);
+      json_begin(js, "pairs");
+      json_long(js, "valid", s.valid);
+      json_long(js, "invalid", s.insert_filter+s.self_filter+s.single_read+s.unmapped+s.repeats+s.dangling+s.unknown);
+      json_long(js, "repeats", s.repeats);
+      json_long(js, "dangling_ends", s.dangling);
+      json_long(js, "self_ligated", s.self_filter);
+      json_long(js, "one_read_mapped", s.single_read);
+      json_long(js, "unmapped", s.unmapped);
+      json_long(js, "insert_size", s.insert_filter);
+      json_long(js, "unknown", s.unknown);
+      json_end(js);
+      json_long(js, "scratch_bytes", s.scratch_bytes);
+      json_long(js, "coordinate_sorted", sorted);
+      if (nres > 0) {
+         // Matrix files by resolution.
+         json_begin(js, "matrices");
+         for (int r = 0; r < nres; r++) {
+            char key[32], * path = malloc(strlen(prefix) + 32);
+            sprintf(key, "%ld", res[r]);
+            sprintf(path, "%s.%ld.txt", prefix, res[r]);
+            json_str(js, key, path);
+            free(path);
+         }
+         json_end(js);
+      }
+      if (sorted) {
+         json_long(js, "spilled_records", pool.spilled);
+         json_long(js, "spilled_partitions", pool.nspills);
+         json_long(js, "late_secondary_records", pool.late);
+         json_long(js, "late_secondary_mapq_records", pool.late_pass);
+         if (pool.late_pass > 0)
+            json_str(js, "warning", "dropped secondary records pass the mapping quality threshold");
+      }
+      json_long(js, "stage_sample", STAGE_SAMPLE);
+      json_begin(js, "stages");
+      for (int k = 0; k < NSTAGES; k++)
+         json_stage(js, stage_name[k], s.stage + k);
+      json_end(js);
+      if (json_close(js)) {
+         fprintf(stderr, "error writing file: %s\n", jsonfile);
+         exit(1);
+      }
+   }
+   for (int i = 0; i < pool.nslots; i++) {
+      free(pool.batch[i].text);
+      free(pool.batch[i].line);
+      free(pool.batch[i].group);
+      out_free(&pool.batch[i].out);
+   }
+   free(pool.batch);
+   free(head);
+   free(ref_id);
+   free(chrlen);
+   free(res);
+   chrtab_destroy(chr);
+   free(worker);
+   free(tid);
+   bgzf_close(in);
+   isd_close(isd);
 
    return 0;
 }
- 
+
+void
+batch_append
+(
+ batch_t    * batch,
+ const char * data,
+ size_t       len
+)
+{
+   while (batch->len + len > batch->size) {
+      batch->size = batch->size ? 2*batch->size : 2*READ_BLOCK;
+      batch->text = realloc(batch->text, batch->size);
+   }
+   memcpy(batch->text + batch->len, data, len);
+   batch->len += len;
+}
+
+// Waits for a free slot and returns its (empty) batch.
+batch_t *
+reader_batch
+(
+ pool_t * pool
+)
+{
+   pthread_mutex_lock(&pool->lock);
+   while (pool->nbatches - pool->nwritten >= pool->nslots)
+      pthread_cond_wait(&pool->cond, &pool->lock);
+   pthread_mutex_unlock(&pool->lock);
+   batch_t * batch = pool->batch + (pool->nbatches % pool->nslots);
+   batch->len = batch->nlines = batch->ngroups = 0;
+   return batch;
+}
+
+// Hands the lines of 'batch' (which end at 'end') to the workers.
+void
+reader_push
+(
+ pool_t  * pool,
+ batch_t * batch,
+ size_t    end
+)
+{
+   batch->line[batch->nlines] = end;
+   batch->first_group = pool->ngroups;
+   pool->ngroups += batch->ngroups;
+   pthread_mutex_lock(&pool->lock);
+   batch->done = 0;
+   pool->nbatches++;
+   pthread_cond_broadcast(&pool->cond);
+   pthread_mutex_unlock(&pool->lock);
+}
+
+// Returns the end of the record that starts at p in text[0,len): a SAM
+// line or a BAM record (block_size and data, see the SAM specification).
+// Returns 0 if the record is not complete.
+size_t
+record_end
+(
+ int          bam,
+ const char * text,
+ size_t       p,
+ size_t       len
+)
+{
+   const char * rec  = text + p;
+   size_t       left = len - p;
+   if (bam)
+      return left >= 4 && left >= 4 + (size_t) bam_i32(rec) ? p + 4 + bam_i32(rec) : 0;
+   const char * eol = memchr(rec, '\n', left);
+   return eol ? eol - text + 1 : 0;
+}
+
+// Read name of the record [rec,rec+len). Returns its length.
+size_t
+record_name
+(
+ int          bam,
+ char       * rec,
+ size_t       len,
+ char      ** name
+)
+{
+   if (bam) {
+      *name = rec + 36;
+      return (unsigned char) rec[12] - 1;
+   }
+   char * tab = memchr(rec, '\t', len - 1);
+   *name = rec;
+   return tab ? tab - rec : len - 1;
+}
+
+// Flag of the record [rec,rec+len).
+int
+record_flag
+(
+ int    bam,
+ char * rec,
+ size_t len
+)
+{
+   if (bam)
+      return (unsigned char) rec[18] | ((unsigned char) rec[19] << 8);
+   char * tab = memchr(rec, '\t', len);
+   return tab ? parse_long(tab + 1) : 0;
+}
+
+// Mapping quality of the record [rec,rec+len).
+int
+record_mapq
+(
+ int    bam,
+ char * rec,
+ size_t len
+)
+{
+   if (bam)
+      return (unsigned char) rec[13];
+   char * p = rec, * end = rec + len;
+   for (int i = 0; i < 4 && p != NULL; i++) {
+      p = memchr(p, '\t', end - p);
+      if (p != NULL) p++;
+   }
+   return p ? parse_long(p) : 0;
+}
+
+// Starts a read group at the next record of the batch.
+void
+batch_group
+(
+ batch_t * batch
+)
+{
+   if (batch->ngroups >= batch->maxgroups) {
+      batch->maxgroups = batch->maxgroups ? 2*batch->maxgroups : 1024;
+      batch->group = realloc(batch->group, batch->maxgroups*sizeof(int));
+   }
+   batch->group[batch->ngroups++] = batch->nlines;
+}
+
+// Adds the record at offset p of the batch text.
+void
+batch_line
+(
+ batch_t * batch,
+ size_t    p
+)
+{
+   // Record offsets (one more for the end of the last record).
+   if (batch->nlines + 1 >= batch->maxlines) {
+      batch->maxlines = batch->maxlines ? 2*batch->maxlines : 1024;
+      batch->line = realloc(batch->line, batch->maxlines*sizeof(long));
+   }
+   batch->line[batch->nlines++] = p;
+}
+
+// Reads the next block of the input at the end of text[0,*len), which
+// grows if needed. Returns 0 at the end of the input.
+int
+reader_read
+(
+ pool_t  * pool,
+ char   ** text,
+ size_t  * len,
+ size_t  * size,
+ long      nrecords
+)
+{
+   if (*len + READ_BLOCK + 1 > *size) {
+      while (*len + READ_BLOCK + 1 > *size)
+         *size = *size ? 2 * *size : 2*READ_BLOCK;
+      *text = realloc(*text, *size);
+   }
+   double  t0 = wall_clock();
+   ssize_t bytes = bgzf_read(pool->in, *text + *len, READ_BLOCK);
+   stage_count(&pool->read, 1, 1, wall_clock() - t0);
+   if (bytes <= 0) return 0;
+   *len += bytes;
+   pool->bytes += bytes;
+   progress_update(&pool->progress, nrecords, pool->bytes, "reads");
+   return 1;
+}
+
+// Splits the input in batches of records. The records of a read name are
+// adjacent (name-sorted or grouped input).
+void *
+sam_reader
+(
+ void * arg
+)
+{
+   pool_t  * pool = (pool_t *) arg;
+   batch_t * batch = reader_batch(pool);
+   size_t    p = 0;
+   size_t    name = 0, namelen = 0;
+   long      nrecords = 0;
+   int       eof = 0;
+
+   // The bytes read after the header, the rest of the file is read in
+   // blocks directly into the batches.
+   batch_append(batch, pool->head, pool->headlen);
+   while (1) {
+      // Find the end of the next record.
+      size_t next = record_end(pool->bam, batch->text, p, batch->len);
+      if (next == 0) {
+         if (eof) break;
+         if (!reader_read(pool, &batch->text, &batch->len, &batch->size, nrecords)) {
+            eof = 1;
+            if (p < batch->len) {
+               if (pool->bam) {
+                  fprintf(stderr, "error: truncated BAM record.\n");
+                  exit(1);
+               }
+               // Last line without newline.
+               batch->text[batch->len++] = '\n';
+            }
+         }
+         continue;
+      }
+
+      // Read name.
+      char * rec;
+      size_t len = record_name(pool->bam, batch->text + p, next - p, &rec);
+      if (batch->ngroups == 0 || len != namelen || memcmp(rec, batch->text + name, len) != 0) {
+         if (batch->nlines >= BATCH_LINES) {
+            // Batches end at group boundaries, the rest of the text is
+            // copied to the next batch (workers do not touch it).
+            batch_t * full = batch;
+            reader_push(pool, full, p);
+            batch = reader_batch(pool);
+            batch_append(batch, full->text + p, full->len - p);
+            p = 0;
+            continue;
+         }
+         batch_group(batch);
+         name = rec - batch->text;
+         namelen = len;
+      }
+
+      batch_line(batch, p);
+      nrecords++;
+      p = next;
+   }
+
+   // Shards may be empty (fewer read groups than shards).
+   if (nrecords == 0 && !pool->nshards) {
+      fprintf(stderr,"error: input file is empty.\n");
+      exit(1);
+   }
+
+   if (batch->nlines > 0)
+      reader_push(pool, batch, p);
+
+   pthread_mutex_lock(&pool->lock);
+   pool->eof = 1;
+   pthread_cond_broadcast(&pool->cond);
+   pthread_mutex_unlock(&pool->lock);
+
+   return NULL;
+}
+
+// Moves the byte offset x of a SAM file (records in [data,size)) to a read
+// group boundary: the end of the group of the first line that starts at or
+// after x. The result only depends on x, so consecutive shards meet at the
+// same boundary.
+long
+shard_boundary
+(
+ const char * path,
+ long         data,
+ long         size,
+ long         x
+)
+{
+   if (x <= data) return data;
+   if (x >= size) return size;
+   FILE * f = fopen(path, "r");
+   if (f == NULL || fseeko(f, x - 1, SEEK_SET)) {
+      fprintf(stderr, "error opening file: %s\n", path);
+      exit(1);
+   }
+
+   // Skip the rest of the line of byte x-1.
+   char  * line = NULL, * name = NULL;
+   size_t  cap = 0, namelen = 0;
+   ssize_t n = getline(&line, &cap, f);
+   long    b = n > 0 ? x - 1 + n : size;
+   while (n > 0 && (n = getline(&line, &cap, f)) > 0) {
+      size_t len = strcspn(line, "\t\n");
+      if (name == NULL) {
+         name = strndup(line, len);
+         namelen = len;
+      } else if (len != namelen || memcmp(line, name, len) != 0) {
+         break;
+      }
+      b += n;
+   }
+   free(line);
+   free(name);
+   fclose(f);
+   return b < size ? b : size;
+}
+
+// Appends a read group (the records of a name) to the batch of the reader.
+void
+reader_group
+(
+ void   * ctx,
+ mate_t * m
+)
+{
+   reader_t * r = (reader_t *) ctx;
+   batch_t  * batch = r->batch;
+   if (batch->nlines >= BATCH_LINES) {
+      reader_push(r->pool, batch, batch->len);
+      batch = r->batch = reader_batch(r->pool);
+   }
+
+   // Records arrive in coordinate order. Put them back in aligner order
+   // (first segment, then primary, supplementary and secondary records)
+   // because the alignments with equal scores are taken in input order.
+   int n = 0;
+   for (size_t p = 0, next; p < m->len; p = next) {
+      next = record_end(r->pool->bam, m->rec, p, m->len);
+      if (2*n + 2 > r->size) {
+         r->size = r->size ? 2*r->size : 64;
+         r->order = realloc(r->order, r->size * sizeof(long));
+      }
+      int flag = record_flag(r->pool->bam, m->rec + p, next - p);
+      long key = 3*((flag & FLAG_REVERSE_READ) != 0) +
+         (flag & FLAG_SECONDARY ? 2 : flag & FLAG_SUPPL_ALIGN ? 1 : 0);
+      // Insertion sort (stable, the groups are small).
+      int i = n++;
+      while (i > 0 && r->order[2*i-2] > key) {
+         r->order[2*i]   = r->order[2*i-2];
+         r->order[2*i+1] = r->order[2*i-1];
+         i--;
+      }
+      r->order[2*i]   = key;
+      r->order[2*i+1] = p;
+   }
+
+   batch_group(batch);
+   for (int i = 0; i < n; i++) {
+      size_t p = r->order[2*i+1];
+      batch_line(batch, batch->len);
+      batch_append(batch, m->rec + p, record_end(r->pool->bam, m->rec, p, m->len) - p);
+   }
+}
+
+// Splits coordinate-sorted input in batches of read groups. The records
+// wait in the mate table (see mates.h) until their group is complete.
+void *
+mates_reader
+(
+ void * arg
+)
+{
+   pool_t   * pool = (pool_t *) arg;
+   reader_t   r = {pool, reader_batch(pool), NULL, 0};
+   mates_t  * mt = mates_new(pool->budget, pool->tmpdir);
+   char     * text = NULL;
+   size_t     len = 0, size = 0, p = 0;
+   long       nrecords = 0;
+   int        eof = 0;
+
+   text = malloc(pool->headlen + 1);
+   memcpy(text, pool->head, pool->headlen);
+   len = size = pool->headlen;
+   while (1) {
+      // Find the end of the next record.
+      size_t next = record_end(pool->bam, text, p, len);
+      if (next == 0) {
+         if (eof) break;
+         // Keep the partial record and read more.
+         memmove(text, text + p, len - p);
+         len -= p;
+         p = 0;
+         if (!reader_read(pool, &text, &len, &size, nrecords)) {
+            eof = 1;
+            if (len > 0) {
+               if (pool->bam) {
+                  fprintf(stderr, "error: truncated BAM record.\n");
+                  exit(1);
+               }
+               // Last line without newline.
+               text[len++] = '\n';
+            }
+         }
+         continue;
+      }
+
+      // Segment (first or last), kind and SA entries of the record.
+      char * rec = text + p;
+      char * name;
+      size_t namelen = record_name(pool->bam, rec, next - p, &name);
+      int    flag = record_flag(pool->bam, rec, next - p), nsa = 0;
+      char * sa = NULL;
+      if (pool->bam) {
+         unsigned char * u = (unsigned char *) rec;
+         char * tags = rec + 36 + u[12] + 4*(u[16] | (u[17] << 8));
+         tags += (bam_i32(rec + 20) + 1)/2 + bam_i32(rec + 20);
+         char * tag = bam_tag(tags, text + next, "SA");
+         if (tag != NULL && tag[2] == 'Z') sa = tag + 3;
+      } else {
+         sa = memmem(rec, next - p, "\tSA:Z:", 6);
+         if (sa != NULL) sa += 6;
+      }
+      for (; sa != NULL && sa < text + next && *sa && *sa != '\t' && *sa != '\n'; sa++)
+         nsa += *sa == ';';
+      int kind = flag & FLAG_SECONDARY ? MATE_SECOND : flag & FLAG_SUPPL_ALIGN ? MATE_SUPPL : MATE_PRIMARY;
+      int nseg = flag & FLAG_MULTISEGMENT ? 2 : 1;
+      int seg  = nseg == 2 && (flag & FLAG_REVERSE_READ);
+
+      int      pass = record_mapq(pool->bam, rec, next - p) >= pool->min_mapq;
+      mate_t * m = mates_add(mt, name, namelen, rec, next - p, nseg, seg, kind, nsa, pass);
+      if (m != NULL) {
+         reader_group(&r, m);
+         free(m->rec);
+         free(m);
+      }
+      nrecords++;
+      p = next;
+   }
+
+   if (nrecords == 0) {
+      fprintf(stderr,"error: input file is empty.\n");
+      exit(1);
+   }
+
+   // Incomplete and spilled groups.
+   mates_flush(mt, reader_group, &r);
+   pool->spilled = mt->spilled;
+   pool->nspills = mt->nspills;
+   pool->late    = mt->late;
+   pool->late_pass = mt->late_pass;
+   mates_destroy(mt);
+   free(r.order);
+   free(text);
+
+   if (r.batch->nlines > 0)
+      reader_push(pool, r.batch, r.batch->len);
+
+   pthread_mutex_lock(&pool->lock);
+   pool->eof = 1;
+   pthread_cond_broadcast(&pool->cond);
+   pthread_mutex_unlock(&pool->lock);
+
+   return NULL;
+}
+
+void *
+contact_worker
+(
+ void * arg
+)
+{
+   worker_t   * worker  = (worker_t *) arg;
+   pool_t     * pool    = worker->pool;
+   scratch_t  * scratch = worker->scratch = new_scratch();
+   samstack_t * stack   = scratch->sams;
+   sam_t      * sam     = new_sam();
+   worker->stats.scratch_bytes = scratch_size(scratch);
+   worker->mx = malloc(pool->nres * sizeof(matrix_t *));
+   for (int r = 0; r < pool->nres; r++)
+      worker->mx[r] = matrix_new(pool->res[r]);
+
+   pthread_mutex_lock(&pool->lock);
+   while (1) {
+      while (pool->next == pool->nbatches && !pool->eof)
+         pthread_cond_wait(&pool->cond, &pool->lock);
+      if (pool->next == pool->nbatches) break;
+      batch_t * batch = pool->batch + (pool->next++ % pool->nslots);
+      pthread_mutex_unlock(&pool->lock);
+
+      // Process read groups.
+      outbuf_t * out = &batch->out;
+      for (int g = 0; g < batch->ngroups; g++) {
+         int end = g + 1 < batch->ngroups ? batch->group[g+1] : batch->nlines;
+         size_t size = scratch_size(scratch);
+         stats_t * st = &worker->stats;
+         st->timing = st->groups % STAGE_SAMPLE == 0;
+         double t0 = st->timing ? wall_clock() : 0;
+         stack->pos = 0;
+         for (int i = batch->group[g]; i < end; i++) {
+            // SAM lines end with a newline.
+            if (pool->bam)
+               parse_bam(sam, batch->text + batch->line[i], pool->ref_id, pool->nref);
+            else
+               parse_sam(sam, batch->text + batch->line[i], batch->text + batch->line[i+1] - 1, pool->chr, st);
+            sam_push(sam, stack);
+         }
+         stage_count(st->stage + STAGE_PARSE, end - batch->group[g], st->timing, st->timing ? wall_clock() - t0 : 0);
+         long readid = pool->readid ? batch->first_group + g : -1;
+         parse_contact(scratch, pool->chr, pool->min_mapq, pool->max_insz, pool->write, readid, out, worker->mx, pool->nres, &worker->stats);
+         worker->stats.scratch_bytes += scratch_size(scratch) - size;
+         worker->stats.groups++;
+      }
+
+      if (pool->unordered) {
+         pthread_mutex_lock(&pool->out_lock);
+         double t0 = wall_clock();
+         if (out_write(STDOUT_FILENO, &out, 1)) {
+            fprintf(stderr, "error writing contacts.\n");
+            exit(1);
+         }
+         stage_count(worker->stats.stage + STAGE_WRITE, 1, 1, wall_clock() - t0);
+         pthread_mutex_unlock(&pool->out_lock);
+      }
+
+      pthread_mutex_lock(&pool->lock);
+      batch->done = 1;
+      pthread_cond_broadcast(&pool->cond);
+   }
+   pthread_mutex_unlock(&pool->lock);
+
+   sam_destroy(sam);
+   return NULL;
+}
+
 int
 parse_contact
 (
- samstack_t * stack,
- struct hsearch_data * htable,
+ scratch_t * scratch,
+ chrtab_t * chr,
  int min_mapq,
- int max_insz
+ int max_insz,
+ writer_t write,
+ long readid,
+ outbuf_t * out,
+ matrix_t ** mx,
+ int nmx,
+ stats_t * stats
 )
 {
+   samstack_t * stack = scratch->sams;
+
    // Sort sam by score.
    qsort(stack->buf, stack->pos, sizeof(sam_t*), sam_by_score_desc);
 
    // Note: Contacts in the same reads are directly accepted (if Q > thr).
    // Contacts between reads must satisfy insert size restrictions as well.
-   mapstack_t * mapf = new_mapstack(10);
-   mapstack_t * mapr = new_mapstack(10);
+   mapstack_t * mapf = scratch->mapf;
+   mapstack_t * mapr = scratch->mapr;
+   mapf->pos = mapr->pos = 0;
    for (int i = 0; i < stack->pos; i++) {
       sam_t * sam = stack->buf[i];
       int f = sam->flag;
@@ -246,7 +1305,7 @@ parse_contact
          continue;
 
       // Define map coordinates 5'->3'.
-      cigar_t cigar = parse_cigar(sam->cigar);
+      cigar_t cigar = sam->cigar;
       int   revcomp = sam->flag & FLAG_REVCOMP;
       map_t map = (map_t) {
          .chr      = sam->chr,
@@ -268,17 +1327,20 @@ parse_contact
          map_push(map, &mapr);
    }
 
-   mapstack_t * mf = new_mapstack(max(1,mapf->pos));
-   mapstack_t * mr = new_mapstack(max(1,mapr->pos));
+   mapstack_reserve(&scratch->mf, mapf->pos);
+   mapstack_reserve(&scratch->mr, mapr->pos);
+   mapstack_t * mf = scratch->mf;
+   mapstack_t * mr = scratch->mr;
+   mf->pos = mr->pos = 0;
 
    // Apply filters.
    if (mapr->pos + mapf->pos == 0) {
-      unmapped++;
-      goto free_and_return;
+      stats->unmapped++;
+      goto done;
    }
    else if (mapr->pos + mapf->pos == 1) {
-      single_read++;
-      goto free_and_return;
+      stats->single_read++;
+      goto done;
    }
 
 
@@ -289,102 +1351,247 @@ parse_contact
 
    // Filter by quality and fill restriction enzyme fragment info.
    mapf->pos = mapr->pos = 0;
-   for (int i = 0; i < mf->pos; i++) {
-      if (mf->map[i].mapq >= min_mapq) {
-         mapf->map[mapf->pos] = mf->map[i];
-         fill_re_fragment_info(mapf->map+(mapf->pos++), htable);
-      }
-   }
+   for (int i = 0; i < mf->pos; i++)
+      if (mf->map[i].mapq >= min_mapq)
+         mapf->map[mapf->pos++] = mf->map[i];
 
-   for (int i = 0; i < mr->pos; i++) {
-      if (mr->map[i].mapq >= min_mapq) {
-         mapr->map[mapr->pos] = mr->map[i];
-         fill_re_fragment_info(mapr->map+(mapr->pos++), htable);
-      }
-   }
+   for (int i = 0; i < mr->pos; i++)
+      if (mr->map[i].mapq >= min_mapq)
+         mapr->map[mapr->pos++] = mr->map[i];
+
+   double t0 = stats->timing ? wall_clock() : 0;
+   fill_re_fragment_info(mapf, mapr, chr);
+   double t1 = stats->timing ? wall_clock() : 0;
+   stage_count(stats->stage + STAGE_LOOKUP, 1, stats->timing, t1 - t0);
 
    if (mapr->pos + mapf->pos < 2) {
-      repeats++;
-      goto free_and_return;
+      stats->repeats++;
+      goto done;
    }
 
    // Millor primer: Join fragments between reads. (aixo eliminara duplicats)
    // Despres: Imprimir els contactes tal qual.
-   int insert_size = find_pe_contacts(mapf, mapr, &mf);
+   t0 = stats->timing ? wall_clock() : 0;
+   int insert_size = find_pe_contacts(mapf, mapr, &scratch->mf, &scratch->tmp, stats);
+   t1 = stats->timing ? wall_clock() : 0;
+   stage_count(stats->stage + STAGE_PAIRS, 1, stats->timing, t1 - t0);
+   mf = scratch->mf;
    if (insert_size > max_insz) {
-      insert_filter++;
-      goto free_and_return;
+      stats->insert_filter++;
+      goto done;
    }
    
    // Output contacts.
+   t0 = stats->timing ? wall_clock() : 0;
+   long valid = stats->valid;
    for (int i = 0; i < mf->pos-1; i++) {
       for (int j = i+1; j < mf->pos; j++) {
-         valid++;
+         stats->valid++;
          map_t m1 = mf->map[i];
          map_t m2 = mf->map[j];
-         int chrcmp = strcmp(m1.chr, m2.chr);
+         int chrcmp = chrtab_cmp(chr, m1.chr, m2.chr);
          if (chrcmp > 0 || (chrcmp == 0 && m2.beg_ref < m1.beg_ref)) {
             m2 = mf->map[i];
             m1 = mf->map[j];
          }
-#if FORMAT == HIC_FORMAT
-         fprintf(stdout, "%s %d %s %ld %d %d %s %ld %d %d %d\n",
-                 stack->buf[0]->seqname,
-                 m1.rc ? 1 : 0,
-                 m1.chr,
-                 m1.beg_ref,
-                 m1.frag_id,
-                 m2.rc ? 1 : 0,
-                 m2.chr,
-                 m2.beg_ref,
-                 m2.frag_id,
-                 m1.mapq,
-                 m2.mapq
-                 );
-#elif FORMAT == COOLER_FORMAT
-         fprintf(stdout, "%s\t%ld\t%s\t%s\t%ld\t%s\n",
-                 m1.chr,
-                 m1.beg_ref,
-                 m1.rc ? "-" : "+",
-                 m2.chr,
-                 m2.beg_ref,
-                 m2.rc ? "-" : "+"
-                 );
-#else
-         fprintf(stdout, "%s\t%s\t%ld\t%d\t%ld\t%ld\t%ld\t%s\t%ld\t%d\t%ld\t%ld\t%ld\n",
-                 stack->buf[0]->seqname,
-                 m1.chr,
-                 m1.beg_ref,
-                 m1.rc ? 1 : 0,
-                 m1.end_ref - m1.beg_ref,
-                 m1.beg_frag,
-                 m1.end_frag,
-                 m2.chr,
-                 m2.beg_ref,
-                 m2.rc ? 1 : 0,
-                 m2.end_ref - m2.beg_ref,
-                 m2.beg_frag,
-                 m2.end_frag
-                 );
-#endif
-
-      }
-   }
-
- free_and_return:
-   free(mapf);
-   free(mapr);
-   free(mr);
-   free(mf);
+         write(out, stack->buf[0]->seqname, readid, &m1, &m2, chr);
+         for (int r = 0; r < nmx; r++)
+            matrix_add(mx[r], m1.chr, m1.beg_ref, m2.chr, m2.beg_ref);
+      }
+   }
+   t1 = stats->timing ? wall_clock() : 0;
+   stage_count(stats->stage + STAGE_OUTPUT, stats->valid - valid, stats->timing, t1 - t0);
+
+ done:
+   // Stacks that grew with map_push.
+   scratch->mapf = mapf;
+   scratch->mapr = mapr;
    return 0;
 }
 
+// Contact writers. Text formats write the chromosome names, binary records
+// their IDs (and the read ID with write_binary_id).
+
+// hic: read name, strand, chromosome, locus and fragment ID of both ends,
+// and their mapping qualities (the input of merge_contacts).
+void
+write_hic
+(
+ outbuf_t   * out,
+ const char * seqname,
+ long         readid,
+ map_t      * m1,
+ map_t      * m2,
+ chrtab_t   * chr
+)
+{
+   out_str(out, seqname);
+   out_str(out, m1->rc ? " 1 " : " 0 ");
+   out_str(out, chrtab_name(chr, m1->chr));
+   out_char(out, ' ');
+   out_long(out, m1->beg_ref);
+   out_char(out, ' ');
+   out_long(out, m1->frag_id);
+   out_str(out, m2->rc ? " 1 " : " 0 ");
+   out_str(out, chrtab_name(chr, m2->chr));
+   out_char(out, ' ');
+   out_long(out, m2->beg_ref);
+   out_char(out, ' ');
+   out_long(out, m2->frag_id);
+   out_char(out, ' ');
+   out_long(out, m1->mapq);
+   out_char(out, ' ');
+   out_long(out, m2->mapq);
+   out_char(out, '\n');
+}
+
+// cooler: chromosome, locus and strand (+/-) of both ends.
+void
+write_cooler
+(
+ outbuf_t   * out,
+ const char * seqname,
+ long         readid,
+ map_t      * m1,
+ map_t      * m2,
+ chrtab_t   * chr
+)
+{
+   out_str(out, chrtab_name(chr, m1->chr));
+   out_char(out, '\t');
+   out_long(out, m1->beg_ref);
+   out_str(out, m1->rc ? "\t-\t" : "\t+\t");
+   out_str(out, chrtab_name(chr, m2->chr));
+   out_char(out, '\t');
+   out_long(out, m2->beg_ref);
+   out_str(out, m2->rc ? "\t-\n" : "\t+\n");
+}
+
+// TADbit: read name, then chromosome, locus, strand, mapped length and RE
+// sites around the mapping of both ends.
+void
+write_tadbit
+(
+ outbuf_t   * out,
+ const char * seqname,
+ long         readid,
+ map_t      * m1,
+ map_t      * m2,
+ chrtab_t   * chr
+)
+{
+   map_t * m[2] = {m1, m2};
+   out_str(out, seqname);
+   for (int i = 0; i < 2; i++) {
+      out_char(out, '\t');
+      out_str(out, chrtab_name(chr, m[i]->chr));
+      out_char(out, '\t');
+      out_long(out, m[i]->beg_ref);
+      out_str(out, m[i]->rc ? "\t1\t" : "\t0\t");
+      out_long(out, m[i]->end_ref - m[i]->beg_ref);
+      out_char(out, '\t');
+      out_long(out, m[i]->beg_frag);
+      out_char(out, '\t');
+      out_long(out, m[i]->end_frag);
+   }
+   out_char(out, '\n');
+}
+
+// 4DN pairs: readID chr1 pos1 chr2 pos2 strand1 strand2, then the fragment
+// IDs and mapping qualities (see write_pairs_header).
+void
+write_pairs
+(
+ outbuf_t   * out,
+ const char * seqname,
+ long         readid,
+ map_t      * m1,
+ map_t      * m2,
+ chrtab_t   * chr
+)
+{
+   out_str(out, seqname);
+   out_char(out, '\t');
+   out_str(out, chrtab_name(chr, m1->chr));
+   out_char(out, '\t');
+   out_long(out, m1->beg_ref);
+   out_char(out, '\t');
+   out_str(out, chrtab_name(chr, m2->chr));
+   out_char(out, '\t');
+   out_long(out, m2->beg_ref);
+   out_str(out, m1->rc ? "\t-" : "\t+");
+   out_str(out, m2->rc ? "\t-\t" : "\t+\t");
+   out_long(out, m1->frag_id);
+   out_char(out, '\t');
+   out_long(out, m2->frag_id);
+   out_char(out, '\t');
+   out_long(out, m1->mapq);
+   out_char(out, '\t');
+   out_long(out, m2->mapq);
+   out_char(out, '\n');
+}
+
+// Binary record (see contacts.h).
+void
+write_binary
+(
+ outbuf_t   * out,
+ const char * seqname,
+ long         readid,
+ map_t      * m1,
+ map_t      * m2,
+ chrtab_t   * chr
+)
+{
+   // Chromosomes must be in the dictionary of the header.
+   if (m1->chr >= chr->nsorted || m2->chr >= chr->nsorted) {
+      fprintf(stderr, "error: chromosome %s is not in the digestion nor in the header (required by binary output).\n",
+              chrtab_name(chr, m1->chr >= chr->nsorted ? m1->chr : m2->chr));
+      exit(1);
+   }
+   cbrec_t rec = {
+      .chr1   = m1->chr,
+      .chr2   = m2->chr,
+      .pos1   = m1->beg_ref,
+      .pos2   = m2->beg_ref,
+      .frag1  = m1->frag_id,
+      .frag2  = m2->frag_id,
+      .strand = (m1->rc ? CB_RC1 : 0) | (m2->rc ? CB_RC2 : 0),
+      .mapq1  = m1->mapq,
+      .mapq2  = m2->mapq
+   };
+   out_reserve(out, sizeof(cbrec_t));
+   memcpy(out->buf + out->len, &rec, sizeof(cbrec_t));
+   out->len += sizeof(cbrec_t);
+}
+
+// Binary record followed by the read ID (-n).
+void
+write_binary_id
+(
+ outbuf_t   * out,
+ const char * seqname,
+ long         readid,
+ map_t      * m1,
+ map_t      * m2,
+ chrtab_t   * chr
+)
+{
+   write_binary(out, seqname, readid, m1, m2, chr);
+   uint64_t id = readid;
+   out_reserve(out, sizeof(uint64_t));
+   memcpy(out->buf + out->len, &id, sizeof(uint64_t));
+   out->len += sizeof(uint64_t);
+}
+
 int
 find_pe_contacts
 (
  mapstack_t  * fw,
  mapstack_t  * rv,
- mapstack_t ** dst
+ mapstack_t ** dst,
+ mapstack_t ** tmpp,
+ stats_t     * stats
 )
 {
    int insert_size = 0;
@@ -457,7 +1664,9 @@ find_pe_contacts
       }
    }
    // Add other fragments.
-   mapstack_t * tmp = new_mapstack(fw->pos+rv->pos);
+   mapstack_reserve(tmpp, fw->pos+rv->pos);
+   mapstack_t * tmp = *tmpp;
+   tmp->pos = 0;
    int beg = (outer_merged ? 1 : 0);
    int end_fw = fw->pos - (inner_merged ? 1 : 0);
    int end_rv = rv->pos - (inner_merged ? 1 : 0);
@@ -485,17 +1694,15 @@ find_pe_contacts
 
    if ((*dst)->pos == 1) {
       if (self_ligation)
-         self_filter++;
+         stats->self_filter++;
       else if (unknown_event)
-         unknown++;
+         stats->unknown++;
       else if (inner_merged)
-         dangling++;
+         stats->dangling++;
       else
-         single_read++;
+         stats->single_read++;
    }
 
-   free(tmp);
-
    return insert_size;
 }
 
@@ -528,124 +1735,702 @@ place_in_read
    }
 }
 
+// Finds the RE fragments of the forward and reverse maps of a read group
+// with a single batch of lookups.
 void
 fill_re_fragment_info
 (
- map_t * map,
- struct hsearch_data * htable
+ mapstack_t * fw,
+ mapstack_t * rv,
+ chrtab_t   * tab
 )
 {
-   // Get chromosome RE sites.
-   ENTRY * item;
-   hsearch_r((ENTRY){.key = map->chr}, FIND, &item, htable);
-   
-   if (item == NULL) {
-      fprintf(stderr, "warning: chromosome not found in digestion file: %s. RE info set to -1.\n", map->chr);
-      return;
-   }
-   isdchr_t * ref = (isdchr_t *) item->data;
-   // Find fragment by bisection.
-   int idx = bisection(ref->re_site, 0, ref->cnt-1, map->beg_ref);
-   map->beg_frag = ref->re_site[idx];
-   map->end_frag = ref->re_site[idx+1];
-   map->frag_id  = idx;
-   
-   return;
-}
-
-int
-bisection
-(
- int * data,
- int   beg,
- int   end,
- int   target
- )
-{
-   if (end - beg < 2) return beg;
-   int mid = (beg+end)/2;
-   if (target < data[mid]) end = mid;
-   else if (target > data[mid]) beg = mid;
-   else return mid;
-   
-   return bisection(data,beg,end,target);
+   isdq_t  q[LOOKUP_BATCH];
+   map_t * map[LOOKUP_BATCH];
+   int     n = 0;
+   for (int i = 0; i < fw->pos + rv->pos; i++) {
+      map_t * m = i < fw->pos ? fw->map + i : rv->map + (i - fw->pos);
+      // Get chromosome RE sites.
+      isdchr_t * ref = m->chr < tab->nsorted ? tab->ref[m->chr] : NULL;
+      if (ref == NULL) {
+         fprintf(stderr, "warning: chromosome not found in digestion file: %s. RE info set to -1.\n", chrtab_name(tab, m->chr));
+      } else {
+         map[n] = m;
+         q[n++] = (isdq_t) {.chr = ref, .pos = m->beg_ref};
+      }
+      if (n == LOOKUP_BATCH || (n > 0 && i == fw->pos + rv->pos - 1)) {
+         // Find fragments (decodes one block of packed digestions).
+         isd_find_batch(q, n);
+         for (int j = 0; j < n; j++) {
+            map[j]->frag_id  = q[j].idx;
+            map[j]->beg_frag = q[j].beg;
+            map[j]->end_frag = q[j].end;
+         }
+         n = 0;
+      }
+   }
 }
 
+// Summarizes the CIGAR string [str,end). M, = and X are matches, D and
+// N consume the reference only, and clips are at the end of the read once
+// a match, insertion or deletion was seen.
 cigar_t
 parse_cigar
 (
- char * str
+ const char * str,
+ const char * end
 )
 {
    cigar_t cigar = (cigar_t){.beg_clip = 0, .end_clip = 0, .matches = 0, .insertions = 0, .deletions = 0};
 
    if (str[0] == '*') return cigar;
 
-   char * num = str;
-   int len = strlen(str);
-   for (int i = 0; i < len; i++) {
-      if (str[i] == 'H' || str[i] == 'S') {
-         str[i] = 0;
-         if (cigar.matches + cigar.insertions + cigar.deletions)
-            cigar.end_clip += atoi(num);
-         else
-            cigar.beg_clip += atoi(num);
-         num = str+i+1;
-      } else if (str[i] == 'M') {
-         str[i] = 0;
-         cigar.matches += atoi(num);
-         num = str+i+1;
-      } else if (str[i] == 'I') {
-         str[i] = 0;
-         cigar.insertions += atoi(num);
-         num = str+i+1;
-      } else if (str[i] == 'D') {
-         str[i] = 0;
-         cigar.deletions += atoi(num);
-         num = str+i+1;
+   int num = 0;
+   for (; str < end; str++) {
+      if (*str >= '0' && *str <= '9') {
+         num = 10*num + (*str - '0');
+         continue;
       }
+      cigar_op(&cigar, *str, num);
+      num = 0;
    }
    return cigar;
 }
 
+// Adds 'num' operations 'op' to the summary of a CIGAR.
+void
+cigar_op
+(
+ cigar_t * cigar,
+ char      op,
+ int       num
+)
+{
+   switch (op) {
+   case 'M':
+   case '=':
+   case 'X':
+      cigar->matches += num;
+      break;
+   case 'I':
+      cigar->insertions += num;
+      break;
+   case 'D':
+   case 'N':
+      cigar->deletions += num;
+      break;
+   case 'S':
+   case 'H':
+      if (cigar->matches + cigar->insertions + cigar->deletions)
+         cigar->end_clip += num;
+      else
+         cigar->beg_clip += num;
+      break;
+   }
+}
+
+long
+parse_long
+(
+ const char * str
+)
+{
+   int  neg = (*str == '-');
+   long val = 0;
+   str += neg;
+   while (*str >= '0' && *str <= '9')
+      val = 10*val + (*str++ - '0');
+   return neg ? -val : val;
+}
+
+// Returns the field at *p (NUL-terminated in place) and moves *p to the
+// next one.
+char *
+sam_field
+(
+ char ** p,
+ char  * end
+)
+{
+   char * field = *p;
+   char * tab = memchr(field, '\t', end - field);
+   if (tab == NULL) tab = end;
+   *tab = 0;
+   *p = tab < end ? tab + 1 : end;
+   return field;
+}
+
+// Tokenizes the SAM line [samline,end) in a single pass. Names point to
+// the line, which is modified.
 void
 parse_sam
 (
- sam_t * sam,
- char  * samline
+ sam_t    * sam,
+ char     * samline,
+ char     * end,
+ chrtab_t * tab,
+ stats_t  * stats
+)
+{
+   char * p = samline;
+   sam->seqname = sam_field(&p, end);
+   sam->flag    = parse_long(sam_field(&p, end));
+   sam->chr     = chrtab_id(tab, sam_field(&p, end));
+   sam->locus   = parse_long(sam_field(&p, end));
+   sam->mapq    = parse_long(sam_field(&p, end));
+   char * cigar = sam_field(&p, end);
+   double t0 = stats->timing ? wall_clock() : 0;
+   sam->cigar   = parse_cigar(cigar, p > cigar ? p - 1 : end);
+   stage_count(stats->stage + STAGE_CIGAR, 1, stats->timing, stats->timing ? wall_clock() - t0 : 0);
+   sam->score   = 0;
+
+   // Skip RNEXT, PNEXT, TLEN, SEQ and QUAL, then find the AS tag.
+   for (int i = 0; i < 5 && p < end; i++) {
+      char * tab = memchr(p, '\t', end - p);
+      p = tab ? tab + 1 : end;
+   }
+   while (p < end) {
+      char * tag = sam_field(&p, end);
+      if (tag[0] == 'A' && tag[1] == 'S' && tag[2] == ':' && tag[3] && tag[4]) {
+         sam->score = parse_long(tag+5);
+         break;
+      }
+   }
+}
+
+// Decodes the BAM record at rec (starting with block_size) without a text
+// step. The read name points to the record, ref_id maps the references to
+// chromosome IDs (unmapped reads get the ID of "*").
+void
+parse_bam
+(
+ sam_t     * sam,
+ char      * rec,
+ const int * ref_id,
+ int         nref
+)
+{
+   unsigned char * u = (unsigned char *) rec;
+   char  * end   = rec + 4 + bam_i32(rec);
+   int     ref   = bam_i32(rec + 4);
+   int     ncig  = u[16] | (u[17] << 8);
+   int     l_seq = bam_i32(rec + 20);
+   sam->seqname = rec + 36;
+   sam->chr     = ref >= 0 && ref < nref ? ref_id[ref] : ref_id[nref];
+   sam->locus   = bam_i32(rec + 8) + 1;
+   sam->mapq    = u[13];
+   sam->flag    = u[18] | (u[19] << 8);
+   sam->score   = 0;
+
+   // Binary CIGAR: length << 4 | operation.
+   char * p = rec + 36 + u[12];
+   sam->cigar = (cigar_t){.beg_clip = 0, .end_clip = 0, .matches = 0, .insertions = 0, .deletions = 0};
+   for (int i = 0; i < ncig; i++, p += 4) {
+      uint32_t op = (uint32_t) bam_i32(p);
+      if ((op & 0xf) < 9)
+         cigar_op(&sam->cigar, "MIDNSHP=X"[op & 0xf], op >> 4);
+   }
+
+   // Skip SEQ and QUAL, then find the AS tag.
+   p += (l_seq + 1)/2 + l_seq;
+   char * as = bam_tag(p, end, "AS");
+   if (as != NULL) {
+      char * val = as + 3;
+      switch (as[2]) {
+      case 'c': sam->score = (int8_t) val[0]; break;
+      case 'C': sam->score = (uint8_t) val[0]; break;
+      case 's': sam->score = (int16_t) ((uint8_t) val[0] | ((uint8_t) val[1] << 8)); break;
+      case 'S': sam->score = (uint8_t) val[0] | ((uint8_t) val[1] << 8); break;
+      case 'i':
+      case 'I': sam->score = bam_i32(val); break;
+      }
+   }
+}
+
+// Finds a tag in the BAM tags [p,end). Returns the tag (its name, type and
+// value) or NULL.
+char *
+bam_tag
+(
+ char       * p,
+ char       * end,
+ const char * tag
 )
 {
-   strcpy(sam->seqname,strtok(samline, "\t"));
-   sam->flag = atoi(strtok(NULL,"\t"));
-   strcpy(sam->chr, strtok(NULL,"\t"));
-   sam->locus = atoi(strtok(NULL,"\t"));
-   sam->mapq = atoi(strtok(NULL,"\t"));
-   strcpy(sam->cigar, strtok(NULL,"\t"));
-   char * str;
-   while (str = strtok(NULL,"\t")) {
-      if (str[0] == 'A' && str[1] == 'S') {
-         sam->score = atoi(str+5);
+   while (p + 3 < end) {
+      char type = p[2];
+      char * val = p + 3;
+      if (p[0] == tag[0] && p[1] == tag[1])
+         return p;
+      // Skip the value.
+      switch (type) {
+      case 'A':
+      case 'c':
+      case 'C':
+         p = val + 1;
+         break;
+      case 's':
+      case 'S':
+         p = val + 2;
+         break;
+      case 'i':
+      case 'I':
+      case 'f':
+         p = val + 4;
+         break;
+      case 'Z':
+      case 'H':
+         p = memchr(val, 0, end - val);
+         p = p ? p + 1 : end;
+         break;
+      case 'B': {
+         int size = strchr("cC", val[0]) ? 1 : strchr("sS", val[0]) ? 2 : 4;
+         p = val + 5 + (long) size * bam_i32(val + 1);
          break;
       }
+      default:
+         p = end;
+      }
    }
+   return NULL;
+}
+
+// Little-endian int32 at p (BAM fields are not aligned).
+int32_t
+bam_i32
+(
+ const char * p
+)
+{
+   int32_t v;
+   memcpy(&v, p, 4);
+   return v;
 }
 
 void
-samcpy
+bam_read
 (
- sam_t * sam_d,
- sam_t * sam_s
+ bgzf_t * in,
+ void   * buf,
+ size_t   len
 )
 {
-   strcpy(sam_d->seqname,sam_s->seqname);
-   sam_d->flag = sam_s->flag;
-   strcpy(sam_d->chr, sam_s->chr);
-   sam_d->locus = sam_s->locus;
-   sam_d->mapq = sam_s->mapq;
-   sam_d->score = sam_s->score;
-   strcpy(sam_d->cigar, sam_s->cigar);
+   if (bgzf_read(in, buf, len) != (ssize_t) len) {
+      fprintf(stderr, "error: truncated BAM header.\n");
+      exit(1);
+   }
 }
 
+// Reads the BAM header (after the magic string) and returns the names of
+// the references.
+char **
+bam_header
+(
+ bgzf_t * in,
+ int    * nref,
+ long  ** reflen,
+ int    * coord
+)
+{
+   char buf[4];
+   bam_read(in, buf, 4);
+   int32_t l_text = bam_i32(buf);
+   char * text = malloc(l_text + 1);
+   bam_read(in, text, l_text);
+   text[l_text] = 0;
+   // Sort order (SO field of the @HD line).
+   *coord = strncmp(text, "@HD\t", 4) == 0 &&
+            strstr(text, "\tSO:coordinate") != NULL &&
+            strstr(text, "\tSO:coordinate") < text + strcspn(text, "\n");
+   free(text);
+
+   bam_read(in, buf, 4);
+   *nref = bam_i32(buf);
+   char ** ref = malloc(*nref * sizeof(char *));
+   *reflen = malloc(*nref * sizeof(long));
+   for (int i = 0; i < *nref; i++) {
+      bam_read(in, buf, 4);
+      int32_t l_name = bam_i32(buf);
+      ref[i] = malloc(l_name + 1);
+      bam_read(in, ref[i], l_name);
+      ref[i][l_name] = 0;
+      bam_read(in, buf, 4);
+      (*reflen)[i] = bam_i32(buf);
+   }
+   return ref;
+}
+
+// Writes the header of binary records (with the chromosome dictionary) to
+// the standard output.
+void
+write_binary_header
+(
+ chrtab_t * chr,
+ int        readid
+)
+{
+   outbuf_t out = {0};
+   cbhdr_t  hdr = {
+      .magic      = CB_MAGIC,
+      .version    = CB_VERSION,
+      .nchrom     = chr->nsorted,
+      .flags      = readid ? CB_READID : 0
+   };
+   for (int i = 0; i < chr->nsorted; i++)
+      hdr.names_size += strlen(chr->name[i]) + 1;
+
+   out_reserve(&out, sizeof(cbhdr_t));
+   memcpy(out.buf, &hdr, sizeof(cbhdr_t));
+   out.len = sizeof(cbhdr_t);
+   for (int i = 0; i < chr->nsorted; i++) {
+      out_str(&out, chr->name[i]);
+      out_char(&out, 0);
+   }
+   outbuf_t * o = &out;
+   if (out_write(STDOUT_FILENO, &o, 1)) {
+      fprintf(stderr, "error writing contacts.\n");
+      exit(1);
+   }
+   out_free(&out);
+}
+
+// No contact output (-f none, e.g. with matrices).
+void
+write_none
+(
+ outbuf_t   * out,
+ const char * seqname,
+ long         readid,
+ map_t      * m1,
+ map_t      * m2,
+ chrtab_t   * chr
+)
+{
+}
+
+// Writes a matrix to <prefix>.<res>.txt, one line per cell that is not
+// empty: chromosome, start and end of both bins (0-based, end excluded)
+// and the contact count. Cells are sorted by chromosome ID and bin.
+void
+write_matrix
+(
+ matrix_t   * mx,
+ chrtab_t   * chr,
+ const long * chrlen,
+ const char * prefix
+)
+{
+   char * path = malloc(strlen(prefix) + 32);
+   sprintf(path, "%s.%ld.txt", prefix, mx->res);
+   int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0) {
+      fprintf(stderr, "error opening file: %s\n", path);
+      exit(1);
+   }
+
+   long       n = mx->n;
+   outbuf_t   out = {0};
+   outbuf_t * o = &out;
+   matrix_sort(mx);
+   for (long i = 0; i < n; i++) {
+      mxcell_t * c = mx->cell + i;
+      int32_t chrom[2] = {c->chr1, c->chr2};
+      long    bin[2]   = {c->bin1, c->bin2};
+      for (int k = 0; k < 2; k++) {
+         long end = (bin[k] + 1) * mx->res;
+         if (chrom[k] < chr->nsorted && chrlen[chrom[k]] > 0 && end > chrlen[chrom[k]])
+            end = chrlen[chrom[k]];
+         out_str(&out, chrtab_name(chr, chrom[k]));
+         out_char(&out, '\t');
+         out_long(&out, bin[k] * mx->res);
+         out_char(&out, '\t');
+         out_long(&out, end);
+         out_char(&out, '\t');
+      }
+      out_long(&out, c->count);
+      out_char(&out, '\n');
+      if (out.len >= OUT_BLOCK && out_write(fd, &o, 1)) {
+         fprintf(stderr, "error writing file: %s\n", path);
+         exit(1);
+      }
+   }
+   if (out_write(fd, &o, 1) || close(fd)) {
+      fprintf(stderr, "error writing file: %s\n", path);
+      exit(1);
+   }
+   char label[64];
+   snprintf(label, sizeof(label), "Matrix %ld bp:", mx->res);
+   fprintf(stderr, "%-24s\t%ld cells (%s)\n", label, n, path);
+   out_free(&out);
+   free(path);
+}
+
+// Header of the 4DN pairs format. Chromosome sizes (those of the SAM/BAM
+// header) are listed in ID order, the order of the ends of the contacts.
+void
+write_pairs_header
+(
+ chrtab_t   * chr,
+ const long * chrlen,
+ const char * organism
+)
+{
+   outbuf_t out = {0};
+   out_str(&out, "## pairs format v" PAIRS_VERSION "\n");
+   out_str(&out, "#sorted: none\n");
+   out_str(&out, "#shape: upper triangle\n");
+   out_str(&out, "#genome_assembly: ");
+   out_str(&out, organism);
+   out_char(&out, '\n');
+   for (int i = 0; i < chr->nsorted; i++) {
+      if (chrlen[i] <= 0) continue;
+      out_str(&out, "#chromsize: ");
+      out_str(&out, chr->name[i]);
+      out_char(&out, ' ');
+      out_long(&out, chrlen[i]);
+      out_char(&out, '\n');
+   }
+   out_str(&out, "#columns: readID chr1 pos1 chr2 pos2 strand1 strand2 frag1 frag2 mapq1 mapq2\n");
+   outbuf_t * o = &out;
+   if (out_write(STDOUT_FILENO, &o, 1)) {
+      fprintf(stderr, "error writing contacts.\n");
+      exit(1);
+   }
+   out_free(&out);
+}
+
+// Skips the header lines of a SAM file and returns the names of the @SQ
+// lines. On input, text holds the first len bytes of the file; on output
+// it holds the bytes read after the header.
+char **
+sam_header
+(
+ bgzf_t  * in,
+ char   ** text,
+ size_t  * len,
+ int     * nref,
+ long   ** reflen,
+ int     * coord
+)
+{
+   char ** ref = NULL;
+   int     max = 0;
+   size_t  p = 0;
+   *nref = 0;
+   *reflen = NULL;
+   while (1) {
+      char * line = *text + p;
+      char * eol = p < *len ? memchr(line, '\n', *len - p) : NULL;
+      if (eol == NULL && (p == *len || line[0] == '@')) {
+         // Read more (drops the header lines already parsed).
+         memmove(*text, line, *len - p);
+         *len -= p;
+         p = 0;
+         *text = realloc(*text, *len + READ_BLOCK);
+         ssize_t bytes = bgzf_read(in, *text + *len, READ_BLOCK);
+         if (bytes > 0) {
+            *len += bytes;
+            continue;
+         }
+         // Last line without newline.
+         eol = *text + *len;
+         line = *text;
+      }
+      if (line == *text + *len || line[0] != '@') break;
+
+      // Sort order (SO field).
+      if (strncmp(line, "@HD\t", 4) == 0) {
+         char c = *eol;
+         *eol = 0;
+         *coord = strstr(line, "\tSO:coordinate") != NULL;
+         *eol = c;
+      }
+
+      // Name and length of the reference sequence (SN and LN fields).
+      if (strncmp(line, "@SQ\t", 4) == 0) {
+         char c = *eol;
+         *eol = 0;
+         char * sn = strstr(line, "\tSN:");
+         char * ln = strstr(line, "\tLN:");
+         long   length = ln != NULL ? atol(ln + 4) : 0;
+         *eol = c;
+         if (sn != NULL) {
+            sn += 4;
+            size_t n = strcspn(sn, "\t\n");
+            if (sn + n > eol) n = eol - sn;
+            if (*nref >= max) {
+               max = max ? 2*max : 64;
+               ref = realloc(ref, max * sizeof(char *));
+               *reflen = realloc(*reflen, max * sizeof(long));
+            }
+            ref[*nref] = strndup(sn, n);
+            (*reflen)[*nref] = length;
+            (*nref)++;
+         }
+      }
+      p = min((size_t)(eol - *text + 1), *len);
+   }
+
+   memmove(*text, *text + p, *len - p);
+   *len -= p;
+   return ref;
+}
+
+chrtab_t *
+chrtab_build
+(
+ isd_t  * isd,
+ char  ** names,
+ int      n
+)
+{
+   chrtab_t * tab = calloc(1, sizeof(chrtab_t));
+   if (tab == NULL)
+      return NULL;
+
+   // Sorted and unique names (digestion, header and "*").
+   tab->name = malloc((isd->nchrom + n + 1) * sizeof(char *));
+   for (int i = 0; i < isd->nchrom; i++)
+      tab->name[tab->n++] = strdup(isd->chrom[i].chr);
+   for (int i = 0; i < n; i++)
+      tab->name[tab->n++] = strdup(names[i]);
+   tab->name[tab->n++] = strdup("*");
+   qsort(tab->name, tab->n, sizeof(char *), str_by_name);
+   int u = 0;
+   for (int i = 0; i < tab->n; i++) {
+      if (u > 0 && strcmp(tab->name[u-1], tab->name[i]) == 0)
+         free(tab->name[i]);
+      else
+         tab->name[u++] = tab->name[i];
+   }
+   tab->n = tab->nsorted = u;
+
+   // Name to ID (plus one, zero is not found).
+   hcreate_r(2*tab->n + HASH_SIZE, &tab->htable);
+   for (int i = 0; i < tab->n; i++) {
+      ENTRY * item;
+      hsearch_r((ENTRY){.key = tab->name[i], .data = (void *)(intptr_t)(i+1)}, ENTER, &item, &tab->htable);
+   }
+
+   // Slots of the names found only in the reads (the pages are only
+   // touched if there are any).
+   tab->slot = calloc(CHRTAB_SLOTS, sizeof(int));
+
+   // Restriction sites by ID.
+   tab->ref = calloc(tab->n, sizeof(isdchr_t *));
+   for (int i = 0; i < isd->nchrom; i++)
+      tab->ref[chrtab_id(tab, isd->chrom[i].chr)] = isd->chrom + i;
+
+   pthread_mutex_init(&tab->lock, NULL);
+
+   return tab;
+}
+
+void
+chrtab_destroy
+(
+ chrtab_t * tab
+)
+{
+   hdestroy_r(&tab->htable);
+   for (int i = 0; i < tab->n; i++)
+      free((char *) chrtab_name(tab, i));
+   for (int c = 0; c < CHRTAB_CHUNKS; c++)
+      free(tab->extra[c]);
+   free(tab->name);
+   free(tab->slot);
+   free(tab->ref);
+   pthread_mutex_destroy(&tab->lock);
+   free(tab);
+}
+
+// Slot of name in the table of the names found only in the reads: either
+// the slot of its ID or the empty slot where it goes.
+int *
+chrtab_slot
+(
+ chrtab_t   * tab,
+ const char * name
+)
+{
+   uint64_t h = 0xcbf29ce484222325ULL;
+   for (const char * c = name; *c; c++)
+      h = (h ^ (unsigned char) *c) * 0x100000001b3ULL;
+   for (long i = h & (CHRTAB_SLOTS - 1); ; i = (i + 1) & (CHRTAB_SLOTS - 1)) {
+      int id = __atomic_load_n(tab->slot + i, __ATOMIC_ACQUIRE);
+      if (id == 0 || strcmp(chrtab_name(tab, id - 1), name) == 0)
+         return tab->slot + i;
+   }
+}
+
+// Returns the ID of a chromosome name, adding it to the table if it was
+// not in the digestion nor in the header.
+int
+chrtab_id
+(
+ chrtab_t   * tab,
+ const char * name
+)
+{
+   ENTRY * item;
+   if (hsearch_r((ENTRY){.key = (char *) name}, FIND, &item, &tab->htable))
+      return (intptr_t) item->data - 1;
+
+   int * slot = chrtab_slot(tab, name);
+   int   id = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+   if (id > 0)
+      return id - 1;
+
+   // New name (unless another thread added it meanwhile).
+   pthread_mutex_lock(&tab->lock);
+   slot = chrtab_slot(tab, name);
+   id = *slot;
+   if (id == 0) {
+      int k = tab->n - tab->nsorted;
+      if (k >= CHRTAB_CHUNK*CHRTAB_CHUNKS) {
+         fprintf(stderr, "error: more than %d sequence names are not in the digestion nor in the header.\n",
+                 CHRTAB_CHUNK*CHRTAB_CHUNKS);
+         exit(1);
+      }
+      if (tab->extra[k / CHRTAB_CHUNK] == NULL)
+         tab->extra[k / CHRTAB_CHUNK] = malloc(CHRTAB_CHUNK * sizeof(char *));
+      tab->extra[k / CHRTAB_CHUNK][k % CHRTAB_CHUNK] = strdup(name);
+      id = tab->n + 1;
+      __atomic_store_n(&tab->n, tab->n + 1, __ATOMIC_RELEASE);
+      __atomic_store_n(slot, id, __ATOMIC_RELEASE);
+   }
+   pthread_mutex_unlock(&tab->lock);
+
+   return id - 1;
+}
+
+// Name of an ID (the chunk of an extra name was published with its ID).
+const char *
+chrtab_name
+(
+ chrtab_t * tab,
+ int        id
+)
+{
+   if (id < tab->nsorted)
+      return tab->name[id];
+   int k = id - tab->nsorted;
+   return tab->extra[k / CHRTAB_CHUNK][k % CHRTAB_CHUNK];
+}
+
+// Compares chromosomes like their names.
+int
+chrtab_cmp
+(
+ chrtab_t * tab,
+ int        a,
+ int        b
+)
+{
+   if (a < tab->nsorted && b < tab->nsorted)
+      return a - b;
+   return strcmp(chrtab_name(tab, a), chrtab_name(tab, b));
+}
 
 sam_t *
 new_sam
@@ -653,14 +2438,8 @@ new_sam
  void
 )
 {
-   sam_t * sam = malloc(sizeof(sam_t));
+   sam_t * sam = calloc(1, sizeof(sam_t));
    if (!sam) return NULL;
-   sam->seqname = malloc(100);
-   sam->flag = 0;
-   sam->chr = malloc(100);
-   sam->locus = 0;
-   sam->mapq = 0;
-   sam->cigar = malloc(100);
 
    return sam;
 }
@@ -671,9 +2450,6 @@ sam_destroy
  sam_t * sam
 )
 {
-   free(sam->seqname);
-   free(sam->chr);
-   free(sam->cigar);
    free(sam);
 }
 
@@ -708,6 +2484,7 @@ samstack_destroy
    for (int i = 0; i < stack->max; i++) 
       sam_destroy(stack->buf[i]);
 
+   free(stack->buf);
    free(stack);
 }
 
@@ -726,6 +2503,76 @@ new_mapstack
    return stack;
 }
 
+// Grows the stack (doubling its size) to fit at least 'size' maps.
+int
+mapstack_reserve
+(
+ mapstack_t ** stackp,
+ int           size
+)
+{
+   mapstack_t * stack = *stackp;
+   if (stack->max >= size) return 0;
+
+   int newsize = stack->max;
+   while (newsize < size) newsize *= 2;
+   stack = realloc(stack, sizeof(mapstack_t) + newsize * sizeof(map_t));
+   if (stack == NULL)
+      return 1;
+   stack->max = newsize;
+   *stackp = stack;
+   return 0;
+}
+
+scratch_t *
+new_scratch
+(
+ void
+)
+{
+   scratch_t * scratch = malloc(sizeof(scratch_t));
+   if (scratch == NULL)
+      return NULL;
+
+   scratch->sams = new_samstack(100);
+   scratch->mapf = new_mapstack(10);
+   scratch->mapr = new_mapstack(10);
+   scratch->mf   = new_mapstack(10);
+   scratch->mr   = new_mapstack(10);
+   scratch->tmp  = new_mapstack(20);
+
+   return scratch;
+}
+
+void
+scratch_destroy
+(
+ scratch_t * scratch
+)
+{
+   samstack_destroy(scratch->sams);
+   free(scratch->mapf);
+   free(scratch->mapr);
+   free(scratch->mf);
+   free(scratch->mr);
+   free(scratch->tmp);
+   free(scratch);
+}
+
+// Bytes allocated by the workspace.
+size_t
+scratch_size
+(
+ scratch_t * scratch
+)
+{
+   mapstack_t * map[5] = {scratch->mapf, scratch->mapr, scratch->mf, scratch->mr, scratch->tmp};
+   size_t size = sizeof(scratch_t) + scratch->sams->max * (sizeof(sam_t *) + sizeof(sam_t));
+   for (int i = 0; i < 5; i++)
+      size += sizeof(mapstack_t) + map[i]->max * sizeof(map_t);
+   return size;
+}
+
 int
 sam_push
 (
@@ -738,9 +2585,11 @@ sam_push
       stack->buf= realloc(stack->buf, newsize*sizeof(sam_t *));
       if (stack->buf == NULL)
          return 1;
+      for (int i = stack->max; i < newsize; i++)
+         stack->buf[i] = new_sam();
       stack->max = newsize;
    }
-   samcpy(stack->buf[stack->pos++], sam);
+   *stack->buf[stack->pos++] = *sam;
    return 0;
 }
 
@@ -778,6 +2627,16 @@ sam_by_score_desc
    else return -1;
 }
 
+int
+str_by_name
+(
+ const void * ap,
+ const void * bp
+)
+{
+   return strcmp(*(char **) ap, *(char **) bp);
+}
+
 int 
 map_by_read_beg
 (
@@ -806,12 +2665,12 @@ map_by_read_end
    else return -1;
 }
 
-int
+isd_t *
 read_enzyme_db
 (
  char                * organism,
  char                * re_name,
- struct hsearch_data * htable
+ int                   verify
 )
 {
    // Open digest files.
@@ -820,74 +2679,11 @@ read_enzyme_db
    char * db_path = malloc(strlen(re_name)+strlen(organism)+9);
    sprintf(db_path, "db/%s/%s.isd", organism, re_name);
 
-   // Open file and store fd.
-   int re_fd = open(db_path, O_RDONLY);
+   // Map digestion (v1 or v2).
+   isd_t * isd = isd_open(db_path, verify);
    free(db_path);
-   if (re_fd < 0) {
-      fprintf(stderr, "error while opening RE database: %s.\n",db_path);
+   if (isd == NULL)
       exit(1);
-   }
-
-   // Parse digest files.
-   parse_isd(re_fd, re_name, htable);
 
-   close(re_fd);
-}  
-
-int
-parse_isd
-(
- int         re_fd,
- char      * re_name,
- struct hsearch_data * htable
-)
-{
-   struct stat sb;
-   char * p, * pmap;
-   
-   // mmap file.
-   if (fstat(re_fd, &sb) == -1) {
-      fprintf(stderr, "error reading digestion file (fstat).\n");
-      exit(1);
-   }
-
-   pmap = mmap(0, sb.st_size, PROT_READ, MAP_SHARED, re_fd, 0);
-   if (pmap == NULL) {
-      fprintf(stderr, "error reading digestion file (mmap).\n");
-      exit(1);
-   }
-
-   p = pmap;
-   // Read RE information.
-   p += strlen(p)+1;
-   p += sizeof(int);
-   p += sizeof(int);
-
-   // Get number of chromosomes.
-   int nchrom = *((int *)p);
-   p += sizeof(int);
-   
-   // Parse each chromosome.
-   int re_name_len = strlen(re_name);
-   for (int i = 0; i < nchrom; i++) {
-      // Create isd chromosome entry.
-      isdchr_t * isdchr = malloc(sizeof(isdchr_t));
-
-      // Insert isdchr in hash table (key is chromosome name).
-      ENTRY * item;
-      hsearch_r((ENTRY){.key = p, .data = isdchr}, ENTER, &item, htable);
-     
-      // Chromosome name.
-      isdchr->chr = p;
-      p += strlen(isdchr->chr)+1;
-      // Number of RE sites.
-      isdchr->cnt = *((int *)p);
-      p += sizeof(int);
-      // RE site list.
-      isdchr->re_site = ((int *)p);
-      p += isdchr->cnt*sizeof(int);
-   }
-
-   return 0;
+   return isd;
 }
-      
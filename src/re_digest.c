@@ -5,144 +5,46 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <libgen.h>
 #include <ctype.h>
+#include <pthread.h>
+#include "re_scan.h"
+#include "fasta.h"
+#include "bgzf.h"
+#include "isd.h"
+#include "twobit.h"
+#include "runstats.h"
 
 #define HASH_SIZE 2048
 #define MAX_FRAGMENT_SIZE 2000
+#define CHUNK_SIZE (4 << 20)
+#define STREAM_BUFSIZE (1 << 20)
+#define ANNOT_WINDOW 200
+
+// Stages of the digestion (timed per chunk).
+#define STAGE_READ     0
+#define STAGE_FETCH    1
+#define STAGE_SCAN     2
+#define STAGE_ANNOTATE 3
+#define STAGE_WRITE    4
+#define NSTAGES        5
 
 #define max(a,b) ((a) > (b) ? (a) : (b))
 #define min(a,b) ((a) < (b) ? (a) : (b))
 
+// G+C and non-ACGT (N) nucleotides.
+static const char gc_nt[256] = {['C'] = 1, ['G'] = 1, ['c'] = 1, ['g'] = 1};
+static const char acgt_nt[256] = {['A'] = 1, ['C'] = 1, ['G'] = 1, ['T'] = 1,
+                                  ['a'] = 1, ['c'] = 1, ['g'] = 1, ['t'] = 1};
+
 #define lowercase(s) for(char * p = s;*p;++p) *p=tolower(*p)
 
 #define HELP_MSG "Need help? Call 911 modafacka.\n"
 
 
-/* Nucleic acid notation:
-** 
-** A [0b0001]: Adenine
-** C [0b0010]: Cytosine
-** G [0b0100]: Guanine
-** T [0b1000]: Thymine
-** W [0b1001]: Weak (A or T)
-** S [0b0110]: Strong (C or G)
-** M [0b0011]: Amino (A or C)
-** K [0b1100]: Keto (G or T)
-** R [0b0101]: Purine (A or G)
-** Y [0b1010]: Pyridimine (C or T)
-** B [0b1110]: not A
-** D [0b1101]: not C
-** H [0b1011]: not G
-** V [0b0111]: not T
-** N [0b1111]: Any nucleotide
-*/
-
-#define NT_A 0b0001
-#define NT_C 0b0010
-#define NT_G 0b0100
-#define NT_T 0b1000
-#define NT_W 0b1001
-#define NT_S 0b0110
-#define NT_M 0b0011
-#define NT_K 0b1100
-#define NT_R 0b0101
-#define NT_Y 0b1010
-#define NT_B 0b1110
-#define NT_D 0b1101
-#define NT_H 0b1011
-#define NT_V 0b0111
-#define NT_N 0b1111
-#define NT_Z 0b0000
-
-// Reverse complements
-
-#define RC_A NT_T
-#define RC_C NT_G
-#define RC_G NT_C
-#define RC_T NT_A
-#define RC_W NT_W
-#define RC_S NT_S
-#define RC_M NT_K
-#define RC_K NT_M
-#define RC_R NT_Y
-#define RC_Y NT_R
-#define RC_B NT_V
-#define RC_D NT_H
-#define RC_H NT_D
-#define RC_V NT_B
-#define RC_N NT_N
-
-
-// Variable definitions.
-
-const char re_nt[128] = {
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,NT_A,NT_B,NT_C,NT_D,0,
-   0,NT_G,NT_H,0,0,NT_K,0,NT_M,NT_N,0,
-   0,0,NT_R,NT_S,NT_T,0,NT_V,NT_W,0,NT_Y,
-   0,0,0,0,0,0,NT_A,NT_B,NT_C,NT_D,0,
-   0,NT_G,NT_H,0,0,NT_K,0,NT_M,NT_N,0,
-   0,0,NT_R,NT_S,NT_T,0,NT_V,NT_W,0,NT_Y,
-   0,0,0,0,0
-};
-
-const char re_rc[128] = {
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,RC_A,RC_B,RC_C,RC_D,0,
-   0,RC_G,RC_H,0,0,RC_K,0,RC_M,RC_N,0,
-   0,0,RC_R,RC_S,RC_T,0,RC_V,RC_W,0,RC_Y,
-   0,0,0,0,0,0,RC_A,RC_B,RC_C,RC_D,0,
-   0,RC_G,RC_H,0,0,RC_K,0,RC_M,RC_N,0,
-   0,0,RC_R,RC_S,RC_T,0,RC_V,RC_W,0,RC_Y,
-   0,0,0,0,0
-};
-
-const char dna_nt[128] = {
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,NT_A,0,NT_C,0,0,
-   0,NT_G,0,0,0,0,0,0,NT_Z,0,
-   0,0,0,0,NT_T,0,0,0,0,0,
-   0,0,0,0,0,0,0,NT_A,0,NT_C,
-   0,0,0,NT_G,0,0,0,0,0,0,
-   NT_Z,0,0,0,0,0,NT_T,0,0,0,
-   0,0,0,0,0,0,0,0
-};
-
-const char dna_rc[128] = {
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,0,0,0,0,0,
-   0,0,0,0,0,RC_A,0,RC_C,0,0,
-   0,RC_G,0,0,0,0,0,0,NT_Z,0,
-   0,0,0,0,RC_T,0,0,0,0,0,
-   0,0,0,0,0,0,0,RC_A,0,RC_C,
-   0,0,0,RC_G,0,0,0,0,0,0,
-   NT_Z,0,0,0,0,0,RC_T,0,0,0,
-   0,0,0,0,0,0,0,0
-};
-
-
 // Struct definitions.
 
 typedef struct {
@@ -155,9 +57,9 @@ typedef struct {
 } sam_t;
 
 typedef struct {
-   int  pos;
-   int  size;
-   int  val[];
+   int     pos;
+   int     size;
+   int64_t val[];
 } stack_t;
 
 typedef struct {
@@ -166,35 +68,80 @@ typedef struct {
    char * locus[];
 } cstack_t;
 
+// Fragment annotation data at a site (or chromosome end). Counts are
+// relative to the chunk until the writer adds the previous chunks.
 typedef struct {
-   char   * seqname;
-   char   * seq;
-   size_t   seqlen;
-} ref_t;
+   int64_t   gc;
+   int64_t   n;
+   int32_t   gc_l;
+   int32_t   gc_r;
+} annot_t;
 
 typedef struct {
-   int     pos;
-   int     size;
-   ref_t * ref[];
-} refstack_t;
+   long      pos;
+   int64_t   gc;
+   int64_t   n;
+} cursor_t;
+
+typedef struct {
+   char    * name;
+   int       chr;
+   long      beg;
+   long      end;
+   int       last;
+   int       done;
+   char    * seq;
+   long      len;
+   stack_t * site;
+   annot_t * annot;
+   int64_t   gc;
+   int64_t   n;
+   double    time[NSTAGES];
+} chunk_t;
+
+// Digestion pipeline: a producer splits the genome in chunks, the workers
+// find their RE sites and the main thread writes them in genome order. The
+// chunks live in a ring of nslots, so the memory in use is bounded.
+typedef struct {
+   tb_t            * tb;
+   fai_t           * fai;
+   const char      * genome;
+   bgzf_t          * stream;
+   re_scan_t       * scan;
+   int               window;
+   chunk_t         * chunk;
+   int               nslots;
+   long              nchunks;
+   long              next;
+   long              nwritten;
+   int               eof;
+   stage_t           read;
+   pthread_mutex_t   lock;
+   pthread_cond_t    cond;
+} pool_t;
 
 // Function headers.
 stack_t      * stack_new        (int size);
-stack_t      * stack_push       (stack_t ** stackp, int val);
-int            stack_pop        (stack_t * stack);
+stack_t      * stack_push       (stack_t ** stackp, int64_t val);
+int64_t        stack_pop        (stack_t * stack);
 cstack_t     * cstack_new       (int size);
 cstack_t     * cstack_push      (cstack_t ** stackp, char * ptr);
 char         * cstack_pop       (cstack_t * stack);
-refstack_t   * refstack_new     (int size);
-refstack_t   * refstack_push    (refstack_t ** stackp, ref_t * ptr);
-ref_t        * refstack_pop     (refstack_t * stack);
-void           digest_sequence  (ref_t * ref, char * pattern, stack_t ** stack);
-refstack_t   * read_genome      (FILE * fg);
+void           push_site        (void * ctx, long pos);
+void           pool_push        (pool_t * pool, chunk_t chunk);
+void           digest_chunk     (pool_t * pool, chunk_t * chunk, char * buf);
+void           cursor_advance   (cursor_t * cur, const char * buf, long pos);
+void           annotate_chunk   (pool_t * pool, chunk_t * chunk, const char * buf, long off, long len);
+void           annotate_chr     (const stack_t * site, const annot_t * annot, int window, int32_t ** col);
+void         * digest_worker    (void * arg);
+void         * mapped_producer  (void * arg);
+void         * stream_producer  (void * arg);
 
 // Source.
 
 int main(int argc, char *argv[])
 {
+   double start = wall_clock();
 
    // 1. Parse arguments.
    //    arg list:
@@ -203,46 +150,167 @@ int main(int argc, char *argv[])
    //    3. RE sequence.
    //    4. 5' cut offset (from first 5' nucleotide).
    //    5. 3' cut offset (from first 5' nucleotide).
+   //    (3-5 may be repeated for enzyme cocktails.)
 
    char * organism;
    char * re_name_;
-   char * re_seq;
-   int    cut_fw;
-   int    cut_rv;
-
-   if (argc > 1 && strcmp(argv[1], "-h") == 0) {
-      fprintf(stderr, "%s", HELP_MSG);
-      exit(0);
+   char * re_seq[RE_MAX_ENZYMES];
+   int    cut_fw[RE_MAX_ENZYMES];
+   int    cut_rv[RE_MAX_ENZYMES];
+   int    nenz;
+   int    threads = sysconf(_SC_NPROCESSORS_ONLN);
+   int    encoding = ISD_RAW64;
+   int    annotate = 0;
+   int    window = ANNOT_WINDOW;
+   char * jsonfile = NULL;
+   double interval = PROGRESS_INTERVAL;
+
+   // Parse options.
+   int opt;
+   while ((opt = getopt(argc, argv, "ht:zaw:j:p:")) != -1) {
+      switch (opt) {
+      case 'h':
+         fprintf(stderr, "%s", HELP_MSG);
+         exit(0);
+      case 't':
+         threads = atoi(optarg);
+         break;
+      case 'z':
+         encoding = ISD_PACKED;
+         break;
+      case 'a':
+         annotate = 1;
+         break;
+      case 'w':
+         window = atoi(optarg);
+         break;
+      case 'j':
+         jsonfile = optarg;
+         break;
+      case 'p':
+         interval = atof(optarg);
+         break;
+      default:
+         fprintf(stderr, "type \"%s -h\" for help.\n", argv[0]);
+         exit(1);
+      }
+   }
+   if (threads < 1) threads = 1;
+   if (window < 1) {
+      fprintf(stderr, "invalid annotation window: %d.\n", window);
+      exit(1);
    }
-   
+
    // Parse params.
-   if (argc != 6) {
-      fprintf(stderr, "usage: %s <organism name> <RE name> <re_sequence> <cut_fw> <cut_rv>\n", argv[0]);
+   nenz = (argc - optind - 2) / 3;
+   if (argc - optind < 5 || (argc - optind - 2) % 3 != 0 || nenz > RE_MAX_ENZYMES) {
+      fprintf(stderr, "usage: %s [-t threads] [-z] [-a [-w window]] [-j stats.json] [-p seconds] <organism name> <RE name> <re_sequence> <cut_fw> <cut_rv> [<re_sequence> <cut_fw> <cut_rv> ...]\n", argv[0]);
       fprintf(stderr, "type \"%s -h\" for help.\n", argv[0]);
       exit(1);
    }
 
-   organism = argv[1];
-   re_name_ = argv[2];
-   re_seq = argv[3];
-   cut_fw = atoi(argv[4]);
-   cut_rv = atoi(argv[5]);
-
-   // Open genome file.
-   char * genomepath = malloc(strlen(organism)+17);
-   sprintf(genomepath,"db/%s/genome.fasta",organism);
+   organism = argv[optind];
+   re_name_ = argv[optind+1];
+   for (int i = 0; i < nenz; i++) {
+      re_seq[i] = argv[optind+2+3*i];
+      cut_fw[i] = atoi(argv[optind+3+3*i]);
+      cut_rv[i] = atoi(argv[optind+4+3*i]);
+   }
 
-   FILE * genfile = fopen(genomepath,"r");
-   if (genfile == NULL) {
-      fprintf(stderr, "could not open: %s. Did you create a folder for this organism?\nThe genome of %s must be readable in %s.\n", genomepath, organism, genomepath);
+   // Compile RE patterns (all enzymes are found in the same pass).
+   re_scan_t * scan = re_scan_new(nenz, re_seq);
+   if (scan == NULL) {
+      fprintf(stderr, "invalid RE sequence (IUPAC nucleotides, max %d).\n", RE_MAX_PATTERN);
       exit(1);
    }
 
-   // Read genome.
-   fprintf(stderr, "reading genome...");
-   refstack_t * chr_stack = read_genome(genfile);
-   fprintf(stderr, "\tdone\n");
-   fclose(genfile);
+   // Find genome file (plain FASTA, gzip or BGZF).
+   char * genome_files[] = {"genome.fasta", "genome.fasta.gz", "genome.fa.gz"};
+   char * genomepath = malloc(strlen(organism)+20);
+   for (int i = 0; i < 3; i++) {
+      sprintf(genomepath,"db/%s/%s",organism,genome_files[i]);
+      if (access(genomepath, R_OK) == 0) break;
+      sprintf(genomepath,"db/%s/genome.fasta",organism);
+   }
+
+   // Packed genome cache (see twobit.h), built from the FASTA genome the
+   // first time and whenever the genome is newer.
+   char * cachepath = malloc(strlen(organism)+20);
+   sprintf(cachepath,"db/%s/genome.2bp",organism);
+   struct stat sb, cb;
+   int have_genome = stat(genomepath, &sb) == 0;
+   int use_cache = stat(cachepath, &cb) == 0 && (!have_genome || cb.st_mtime >= sb.st_mtime);
+   if (have_genome && !use_cache) {
+      fprintf(stderr, "packing genome...");
+      use_cache = tb_build(cachepath, genomepath, threads) == 0;
+      if (use_cache)
+         fprintf(stderr, "\tdone\n");
+      else
+         fprintf(stderr, "\twarning: could not write %s.\n", cachepath);
+   }
+
+   tb_t   * tb     = use_cache ? tb_open(cachepath) : NULL;
+   if (tb != NULL) fprintf(stderr, "reading genome...\tcached\n");
+   char   * genome = NULL;
+   fai_t  * fai    = NULL;
+   bgzf_t * stream = NULL;
+   if (tb == NULL) {
+      int genfd = open(genomepath, O_RDONLY);
+      if (genfd < 0) {
+         fprintf(stderr, "could not open: %s. Did you create a folder for this organism?\nThe genome of %s must be readable in %s (or %s.gz).\n", genomepath, organism, genomepath, genomepath);
+         exit(1);
+      }
+
+      fprintf(stderr, "reading genome...");
+      if (fstat(genfd, &sb) == -1) {
+         fprintf(stderr, "error reading genome file (fstat).\n");
+         exit(1);
+      }
+      unsigned char magic[2] = {0};
+      pread(genfd, magic, 2, 0);
+
+      if (magic[0] == 0x1f && magic[1] == 0x8b) {
+         // Compressed genome, decompressed (in parallel if BGZF) and
+         // digested as a stream.
+         stream = bgzf_fdopen(genfd, threads);
+         if (stream == NULL) {
+            fprintf(stderr, "error reading genome file (gzip).\n");
+            exit(1);
+         }
+         fprintf(stderr, "\t%s stream\n", stream->mode == BGZF_BLOCKS ? "bgzf" : "gzip");
+      } else {
+         // Map genome and load (or build) its .fai index. Chromosomes are
+         // digested in place, so the genome is never copied to the heap.
+         // This is only used when the cache cannot be written.
+         if (sb.st_size > 0) {
+            genome = mmap(0, sb.st_size, PROT_READ, MAP_SHARED, genfd, 0);
+            if (genome == MAP_FAILED) {
+               fprintf(stderr, "error reading genome file (mmap).\n");
+               exit(1);
+            }
+         }
+         fai = fai_load(genomepath, genome, sb.st_size);
+         if (fai != NULL) {
+            fprintf(stderr, "\tdone\n");
+            close(genfd);
+         } else {
+            // Not indexable (irregular line lengths): digested as a stream.
+            if (genome != NULL) munmap(genome, sb.st_size);
+            genome = NULL;
+            if (lseek(genfd, 0, SEEK_SET) != 0 || (stream = bgzf_fdopen(genfd, threads)) == NULL) {
+               fprintf(stderr, "error reading genome file.\n");
+               exit(1);
+            }
+            fprintf(stderr, "\tplain stream\n");
+         }
+      }
+   }
+
+   // Annotations need the nucleotides around the chunks.
+   if (annotate && stream != NULL) {
+      fprintf(stderr, "fragment annotation (-a) needs the genome cache or an indexable uncompressed genome.\n");
+      exit(1);
+   }
 
    // Create new digest file.
    char * re_name = strdup(re_name_);
@@ -256,70 +324,540 @@ int main(int argc, char *argv[])
       exit(1);
    }
 
-   int dbfd = open(db_path, O_WRONLY | O_CREAT, 0644);
-   if (dbfd < 0) {
+   // Header lists the RE sequences and cut sites of each enzyme.
+   isdw_t * isd = isd_create(db_path, re_name_, nenz, re_seq, cut_fw, cut_rv, encoding);
+   if (isd == NULL) {
       fprintf(stderr, "error while opening: %s.\n",db_path);
       exit(1);
    }
-   
-   // Write RE seq and cut sites.
-   write(dbfd, re_seq, strlen(re_seq)+1);
-   write(dbfd, &cut_fw, sizeof(int));
-   write(dbfd, &cut_rv, sizeof(int));
-   // Write number of chromosomes.
-   write(dbfd, &(chr_stack->pos), sizeof(int));
-   // Digest genome.
+
+   // Fragment annotations (.isa side table).
+   isaw_t * isa = NULL;
+   char * isa_path = NULL;
+   if (annotate) {
+      isa_path = strdup(db_path);
+      strcpy(isa_path + strlen(isa_path) - 3, "isa");
+      isa = isa_create(isa_path, window);
+      if (isa == NULL) {
+         fprintf(stderr, "error while opening: %s.\n",isa_path);
+         exit(1);
+      }
+   }
+
+   // Digestion pipeline.
+   pool_t pool = {
+      .tb       = tb,
+      .fai      = fai,
+      .genome   = genome,
+      .stream   = stream,
+      .scan     = scan,
+      .window   = annotate ? window : 0,
+      .nslots   = 4*threads,
+      .nchunks  = 0,
+      .next     = 0,
+      .nwritten = 0,
+      .eof      = 0,
+      .lock     = PTHREAD_MUTEX_INITIALIZER,
+      .cond     = PTHREAD_COND_INITIALIZER
+   };
+   pool.chunk = malloc(pool.nslots * sizeof(chunk_t));
+
+   pthread_t producer;
+   pthread_create(&producer, NULL, stream ? stream_producer : mapped_producer, &pool);
+   pthread_t * tid = malloc(threads * sizeof(pthread_t));
+   for (int i = 0; i < threads; i++)
+      pthread_create(tid+i, NULL, digest_worker, &pool);
+
+   // Write chromosomes in order as their chunks are done.
+   stage_t    stage[NSTAGES] = {{0}};
+   progress_t progress;
+   long       nchrom = 0, nsites = 0, nbases = 0;
+   progress_init(&progress, interval);
    stack_t * re_sites = stack_new(1024);
-   for (int i = 0; i < chr_stack->pos; i++) {
-      // Get next chromosome.
-      ref_t * ref = chr_stack->ref[i];
-      // Find RE sites.
-      re_sites->pos = 0;
-      fprintf(stderr,"digesting %s...",ref->seqname);
-      digest_sequence(ref, re_seq, &re_sites);
-      // Write to database. (use low-level write instead of fprint)
-      fprintf(stderr,"done\nwrite digestion...");
-      // 1. Write chromosome name.
-      write(dbfd, ref->seqname, strlen(ref->seqname)+1);
-      // 2. Write RE site count.
-      write(dbfd, &(re_sites->pos), sizeof(int));
-      // 3. Write RE sites.
-      size_t offset = 0;
-      ssize_t b;
-      while ((b = write(dbfd, ((char *)&(re_sites->val))+offset, (re_sites->pos*sizeof(int))-offset)) > 0) offset += b;
-      fprintf(stderr,"%ld/%ld bytes written (%d sites)\n",offset,re_sites->pos*sizeof(int), re_sites->pos);
+   long      nann = 0, maxann = 1024;
+   annot_t * ann = malloc(maxann*sizeof(annot_t));
+   int64_t   gc_offset = 0, n_offset = 0;
+   while (1) {
+      // Wait for next chunk.
+      chunk_t * chunk = pool.chunk + (pool.nwritten % pool.nslots);
+      pthread_mutex_lock(&pool.lock);
+      while (!(pool.nwritten < pool.nchunks && chunk->done) &&
+             !(pool.eof && pool.nwritten == pool.nchunks))
+         pthread_cond_wait(&pool.cond, &pool.lock);
+      int end = pool.nwritten == pool.nchunks;
+      pthread_mutex_unlock(&pool.lock);
+      if (end) break;
+
+      // Stage times of the chunk (the stream is not fetched).
+      for (int k = STAGE_FETCH; k <= STAGE_ANNOTATE; k++)
+         if ((k != STAGE_FETCH || !stream) && (k != STAGE_ANNOTATE || annotate))
+            stage_count(stage + k, 1, 1, chunk->time[k]);
+      nbases += chunk->end - chunk->beg;
+      nsites += chunk->site->pos;
+
+      // Collect RE sites.
+      if (chunk->beg == 0) {
+         re_sites->pos = 0;
+         fprintf(stderr,"digesting %s...",chunk->name);
+         stack_push(&re_sites,0);
+         nann = gc_offset = n_offset = 0;
+      }
+      for (int j = 0; j < chunk->site->pos; j++)
+         stack_push(&re_sites, chunk->site->val[j]);
+
+      if (annotate) {
+         // Counts of the chunk start where the previous chunk ended.
+         long cnt = chunk->site->pos + (chunk->beg == 0) + chunk->last;
+         while (nann + cnt > maxann)
+            ann = realloc(ann, (maxann *= 2)*sizeof(annot_t));
+         for (long j = 0; j < cnt; j++) {
+            ann[nann] = chunk->annot[j];
+            ann[nann].gc += gc_offset;
+            ann[nann++].n += n_offset;
+         }
+         gc_offset += chunk->gc;
+         n_offset += chunk->n;
+         free(chunk->annot);
+      }
+      free(chunk->site);
+
+      if (chunk->last) {
+         double t0 = wall_clock();
+         nchrom++;
+         stack_push(&re_sites,chunk->end-1);
+         if (annotate) {
+            long nfrag = re_sites->pos - 1;
+            int32_t * col[ISA_NCOLS];
+            for (int k = 0; k < ISA_NCOLS; k++)
+               col[k] = malloc(nfrag*sizeof(int32_t));
+            annotate_chr(re_sites, ann, window, col);
+            if (isa_write_chr(isa, nfrag, col)) {
+               fprintf(stderr, "error while writing: %s.\n",isa_path);
+               exit(1);
+            }
+            for (int k = 0; k < ISA_NCOLS; k++)
+               free(col[k]);
+         }
+         // Write to database.
+         fprintf(stderr,"done\nwrite digestion...");
+         if (isd_write_chr(isd, chunk->name, chunk->end, re_sites->val, re_sites->pos)) {
+            fprintf(stderr, "error while writing: %s.\n",db_path);
+            exit(1);
+         }
+         stage_count(stage + STAGE_WRITE, 1, 1, wall_clock() - t0);
+         fprintf(stderr,"%ld bytes written (%d sites)\n",re_sites->pos*sizeof(int64_t), re_sites->pos);
+         if (stream) free(chunk->name);
+      }
+
+      progress_update(&progress, nsites, nbases, "sites");
+
+      // Release slot.
+      pthread_mutex_lock(&pool.lock);
+      pool.nwritten++;
+      pthread_cond_broadcast(&pool.cond);
+      pthread_mutex_unlock(&pool.lock);
+   }
+
+   pthread_join(producer, NULL);
+   for (int i = 0; i < threads; i++)
+      pthread_join(tid[i], NULL);
+
+   if (isd_finish(isd)) {
+      fprintf(stderr, "error while writing: %s.\n",db_path);
+      exit(1);
+   }
+   if (isa != NULL && isa_finish(isa)) {
+      fprintf(stderr, "error while writing: %s.\n",isa_path);
+      exit(1);
+   }
+
+   // Run statistics (worker stages are summed over threads).
+   const char * stage_name[NSTAGES] = {"read", "fetch", "re_scan", "annotate", "write"};
+   double elapsed = wall_clock() - start;
+   stage_merge(stage + STAGE_READ, &pool.read);
+   fprintf(stderr, "\nRun time:               \t%.2f s (%.1f Mb/s, %ld sites in %ld chromosomes)\n",
+           elapsed, nbases / 1e6 / elapsed, nsites, nchrom);
+   for (int k = 0; k < NSTAGES; k++) {
+      char label[64];
+      snprintf(label, sizeof(label), " - %s:", stage_name[k]);
+      fprintf(stderr, "%-24s\t%.2f s (%ld calls)\n", label, stage_time(stage + k), stage[k].calls);
+   }
+   if (jsonfile != NULL) {
+      json_t * js = json_open(jsonfile);
+      if (js == NULL) {
+         fprintf(stderr, "error opening file: %s\n", jsonfile);
+         exit(1);
+      }
+      json_str(js, "program", "re_digest");
+      json_str(js, "organism", organism);
+      json_str(js, "enzyme", re_name_);
+      json_str(js, "genome", tb != NULL ? cachepath : genomepath);
+      json_long(js, "threads", threads);
+      json_double(js, "seconds", elapsed);
+      json_long(js, "chromosomes", nchrom);
+      json_long(js, "bases", nbases);
+      json_long(js, "sites", nsites);
+      json_begin(js, "stages");
+      for (int k = 0; k < NSTAGES; k++)
+         json_stage(js, stage_name[k], stage + k);
+      json_end(js);
+      if (json_close(js)) {
+         fprintf(stderr, "error writing file: %s\n", jsonfile);
+         exit(1);
+      }
    }
 
    // Close files and free.
-   close(dbfd);
    free(genomepath);
+   free(cachepath);
    free(re_name);
    free(re_sites);
+   free(ann);
+   free(isa_path);
    free(db_path);
+   free(pool.chunk);
+   free(tid);
+   re_scan_free(scan);
+   tb_close(tb);
+   fai_destroy(fai);
+   bgzf_close(stream);
+   if (genome != NULL) munmap(genome, sb.st_size);
 
    return 0;
 }
 
 
 void
-digest_sequence
+push_site
+(
+ void * ctx,
+ long   pos
+)
+{
+   chunk_t * chunk = (chunk_t *) ctx;
+   // Shorter enzymes may match in the overlap, those belong to the next chunk.
+   if (chunk->beg + pos < chunk->end)
+      stack_push(&chunk->site, chunk->beg + pos);
+}
+
+void
+pool_push
+(
+ pool_t  * pool,
+ chunk_t   chunk
+)
+{
+   // Wait for a free slot.
+   pthread_mutex_lock(&pool->lock);
+   while (pool->nchunks - pool->nwritten >= pool->nslots)
+      pthread_cond_wait(&pool->cond, &pool->lock);
+   chunk.done = 0;
+   chunk.site = stack_new(1024);
+   pool->chunk[pool->nchunks % pool->nslots] = chunk;
+   pool->nchunks++;
+   pthread_cond_broadcast(&pool->cond);
+   pthread_mutex_unlock(&pool->lock);
+}
+
+void
+digest_chunk
+(
+ pool_t  * pool,
+ chunk_t * chunk,
+ char    * buf
+)
+{
+   // Scan the chunk plus the first pattern-1 nucleotides of the next one,
+   // so that sites starting in [beg,end) are found exactly once.
+   if (chunk->seq == NULL) {
+      // Annotations also need 'window' nucleotides at both sides.
+      long beg = max(chunk->beg - pool->window, 0);
+      long end = chunk->end + max(pool->scan->len - 1, pool->window);
+      double t0 = wall_clock();
+      long len = pool->tb != NULL ?
+         tb_fetch(pool->tb, chunk->chr, beg, end, buf) :
+         fai_fetch(pool->fai, pool->genome, chunk->chr, beg, end, buf);
+      long off = chunk->beg - beg;
+      double t1 = wall_clock();
+      re_scan(pool->scan, buf + off, min(len - off, chunk->end - chunk->beg + pool->scan->len - 1),
+              push_site, chunk);
+      double t2 = wall_clock();
+      if (pool->window)
+         annotate_chunk(pool, chunk, buf, off, len);
+      chunk->time[STAGE_FETCH]    = t1 - t0;
+      chunk->time[STAGE_SCAN]     = t2 - t1;
+      chunk->time[STAGE_ANNOTATE] = wall_clock() - t2;
+   } else {
+      double t0 = wall_clock();
+      re_scan(pool->scan, chunk->seq, chunk->len, push_site, chunk);
+      chunk->time[STAGE_SCAN] = wall_clock() - t0;
+      free(chunk->seq);
+      chunk->seq = NULL;
+   }
+}
+
+void
+cursor_advance
+(
+ cursor_t   * cur,
+ const char * buf,
+ long         pos
+)
+{
+   for (; cur->pos < pos; cur->pos++) {
+      unsigned char c = buf[cur->pos];
+      cur->gc += gc_nt[c];
+      cur->n  += !acgt_nt[c];
+   }
+}
+
+// Computes the annotation data at the chromosome start (first chunk), the
+// sites and the chromosome end (last chunk). The chunk starts at 'off' in
+// buf, which holds 'len' nucleotides. Three cursors walk the buffer at
+// window nucleotides before, at and after each site.
+void
+annotate_chunk
+(
+ pool_t     * pool,
+ chunk_t    * chunk,
+ const char * buf,
+ long         off,
+ long         len
+)
+{
+   long first = chunk->beg == 0;
+   long cnt   = chunk->site->pos + first + chunk->last;
+   long w     = pool->window;
+   cursor_t lo = {0}, mid = {0}, hi = {0};
+
+   chunk->annot = malloc(cnt*sizeof(annot_t));
+   cursor_advance(&mid, buf, off);
+   cursor_t start = mid;
+   for (long i = 0; i < cnt; i++) {
+      long pos;
+      if (first && i == 0) pos = 0;
+      else if (chunk->last && i == cnt-1) pos = chunk->end - 1;
+      else pos = chunk->site->val[i-first];
+      long x = max(pos - chunk->beg + off, 0);
+      cursor_advance(&lo, buf, max(x - w, 0));
+      cursor_advance(&mid, buf, x);
+      cursor_advance(&hi, buf, min(x + w, len));
+      chunk->annot[i] = (annot_t) {
+         .gc   = mid.gc - start.gc,
+         .n    = mid.n - start.n,
+         .gc_l = mid.gc - lo.gc,
+         .gc_r = hi.gc - mid.gc
+      };
+   }
+   cursor_advance(&mid, buf, min(chunk->end - chunk->beg + off, len));
+   chunk->gc = mid.gc - start.gc;
+   chunk->n  = mid.n - start.n;
+}
+
+// Fills the annotation columns of the fragments [site[i],site[i+1]) of a
+// chromosome. The end windows are clipped to the fragment.
+void
+annotate_chr
+(
+ const stack_t * site,
+ const annot_t * annot,
+ int             window,
+ int32_t      ** col
+)
+{
+   for (long i = 0; i < site->pos - 1; i++) {
+      long len = site->val[i+1] - site->val[i];
+      long gc  = annot[i+1].gc - annot[i].gc;
+      col[ISA_LENGTH][i] = len;
+      col[ISA_GC][i]     = gc;
+      col[ISA_N][i]      = annot[i+1].n - annot[i].n;
+      col[ISA_GC5][i]    = len > window ? annot[i].gc_r : gc;
+      col[ISA_GC3][i]    = len > window ? annot[i+1].gc_l : gc;
+   }
+}
+
+void *
+digest_worker
+(
+ void * arg
+)
+{
+   pool_t * pool = (pool_t *) arg;
+   // Chunk buffer, the genome is copied here without newlines.
+   char * buf = malloc(CHUNK_SIZE + pool->scan->len + 2*pool->window);
+
+   pthread_mutex_lock(&pool->lock);
+   while (1) {
+      while (pool->next == pool->nchunks && !pool->eof)
+         pthread_cond_wait(&pool->cond, &pool->lock);
+      if (pool->next == pool->nchunks) break;
+      chunk_t * chunk = pool->chunk + (pool->next++ % pool->nslots);
+      pthread_mutex_unlock(&pool->lock);
+
+      digest_chunk(pool, chunk, buf);
+
+      pthread_mutex_lock(&pool->lock);
+      chunk->done = 1;
+      pthread_cond_broadcast(&pool->cond);
+   }
+   pthread_mutex_unlock(&pool->lock);
+
+   free(buf);
+   return NULL;
+}
+
+void *
+mapped_producer
+(
+ void * arg
+)
+{
+   pool_t * pool = (pool_t *) arg;
+   int      n    = pool->tb != NULL ? pool->tb->n : pool->fai->n;
+
+   // Every chromosome has at least one chunk (even if empty).
+   for (int i = 0; i < n; i++) {
+      char * name = pool->tb != NULL ? pool->tb->chr[i].name : pool->fai->chr[i].name;
+      long   len  = pool->tb != NULL ? pool->tb->chr[i].len : pool->fai->chr[i].len;
+      long   beg  = 0;
+      do {
+         long end = min(beg + CHUNK_SIZE, len);
+         pool_push(pool, (chunk_t) {
+               .name = name,
+               .chr  = i,
+               .beg  = beg,
+               .end  = end,
+               .last = end == len,
+               .seq  = NULL
+            });
+         beg = end;
+      } while (beg < len);
+   }
+
+   pthread_mutex_lock(&pool->lock);
+   pool->eof = 1;
+   pthread_cond_broadcast(&pool->cond);
+   pthread_mutex_unlock(&pool->lock);
+   return NULL;
+}
+
+void
+stream_append
+(
+ pool_t     * pool,
+ chunk_t    * chunk,
+ const char * src,
+ long         len
+)
+{
+   // Append bases to the chunk, and push it when it is full. The next
+   // chunk starts with the pattern-1 overlap.
+   long ov  = pool->scan->len - 1;
+   long cap = CHUNK_SIZE + ov;
+   while (len > 0) {
+      long cnt = min(len, cap - chunk->len);
+      memcpy(chunk->seq + chunk->len, src, cnt);
+      chunk->len += cnt;
+      src += cnt;
+      len -= cnt;
+      if (chunk->len == cap) {
+         char * seq = malloc(cap);
+         memcpy(seq, chunk->seq + CHUNK_SIZE, ov);
+         chunk_t full = *chunk;
+         full.end  = full.beg + CHUNK_SIZE;
+         full.last = 0;
+         pool_push(pool, full);
+         chunk->seq = seq;
+         chunk->beg += CHUNK_SIZE;
+         chunk->len = ov;
+      }
+   }
+}
+
+void *
+stream_producer
 (
- ref_t    * ref,
- char     * pattern,
- stack_t ** stack
+ void * arg
 )
 {
-   // Find pattern.
-   int pattlen = strlen(pattern);
-   stack_push(stack,0);
-   for (int i = 0; i < ref->seqlen; i++) {
-      int j = 0;
-      while (j <= pattlen && (dna_nt[ref->seq[i + j]] & re_nt[pattern[j++]]));
-      if (j == pattlen + 1) {
-         stack_push(stack, i);
+   pool_t * pool = (pool_t *) arg;
+   long     cap  = CHUNK_SIZE + pool->scan->len - 1;
+   char   * in   = malloc(STREAM_BUFSIZE);
+   size_t   namesize = 256, namelen = 0;
+   char   * name = malloc(namesize);
+   chunk_t  chunk = {0};
+
+   // FASTA parser states.
+   enum { AT_LINE, IN_NAME, IN_DESC, IN_SEQ } state = AT_LINE;
+
+   ssize_t bytes;
+   while (1) {
+      double t0 = wall_clock();
+      bytes = bgzf_read(pool->stream, in, STREAM_BUFSIZE);
+      stage_count(&pool->read, 1, 1, wall_clock() - t0);
+      if (bytes <= 0) break;
+      char * p = in, * end = in + bytes;
+      while (p < end) {
+         if (state == AT_LINE) {
+            if (*p == '>') {
+               // New chromosome, push last chunk of the previous one.
+               if (chunk.name != NULL) {
+                  chunk.end  = chunk.beg + chunk.len;
+                  chunk.last = 1;
+                  pool_push(pool, chunk);
+                  chunk.name = NULL;
+               }
+               namelen = 0;
+               state = IN_NAME;
+               p++;
+               continue;
+            }
+            state = IN_SEQ;
+         }
+         if (state == IN_NAME) {
+            // Name is the header up to the first space.
+            while (p < end && !isspace(*p)) {
+               if (namelen + 1 >= namesize) name = realloc(name, namesize *= 2);
+               name[namelen++] = *p++;
+            }
+            if (p == end) continue;
+            name[namelen] = 0;
+            chunk = (chunk_t) {
+               .name = strdup(name),
+               .beg  = 0,
+               .seq  = malloc(cap),
+               .len  = 0
+            };
+            state = IN_DESC;
+         }
+         char * eol = memchr(p, '\n', end - p);
+         char * e = eol ? eol : end;
+         if (state == IN_SEQ && chunk.name != NULL) {
+            // Append sequence line (without '\r').
+            while (p < e) {
+               char * r = memchr(p, '\r', e - p);
+               stream_append(pool, &chunk, p, (r ? r : e) - p);
+               p = r ? r + 1 : e;
+            }
+         }
+         p = eol ? eol + 1 : end;
+         if (eol) state = AT_LINE;
       }
    }
-   stack_push(stack,ref->seqlen-1);
+   if (chunk.name != NULL) {
+      chunk.end  = chunk.beg + chunk.len;
+      chunk.last = 1;
+      pool_push(pool, chunk);
+   }
+
+   free(in);
+   free(name);
+
+   pthread_mutex_lock(&pool->lock);
+   pool->eof = 1;
+   pthread_cond_broadcast(&pool->cond);
+   pthread_mutex_unlock(&pool->lock);
+   return NULL;
 }
 
 stack_t *
@@ -328,7 +866,7 @@ stack_new
  int size
 )
 {
-   stack_t * stack = malloc(sizeof(stack_t) + size*sizeof(int));
+   stack_t * stack = malloc(sizeof(stack_t) + size*sizeof(int64_t));
    if (!stack)
       return NULL;
    stack->size = size;
@@ -340,13 +878,13 @@ stack_t *
 stack_push
 (
  stack_t ** stackp,
- int        val
+ int64_t    val
 )
 {
    stack_t * stack = *stackp;
    if (stack->pos >= stack->size) {
       int newsize = 2*stack->size;
-      *stackp = stack = realloc(stack, sizeof(stack_t) + newsize*sizeof(int));
+      *stackp = stack = realloc(stack, sizeof(stack_t) + newsize*sizeof(int64_t));
       if (!stack) return NULL;
       stack->size = newsize;
    }
@@ -356,7 +894,7 @@ stack_push
    return stack;
 }
 
-int
+int64_t
 stack_pop
 (
  stack_t * stack
@@ -409,107 +947,3 @@ cstack_pop
    if (stack->pos == 0) return NULL;
    else return stack->locus[--stack->pos];
 }
-
-refstack_t *
-refstack_new
-(
- int size
-)
-{
-   refstack_t * stack = malloc(sizeof(refstack_t) + size*sizeof(ref_t *));
-   if (!stack)
-      return NULL;
-   stack->size = size;
-   stack->pos = 0;
-   return stack;
-}
-
-refstack_t *
-refstack_push
-(
- refstack_t ** stackp,
- ref_t       * ptr
-)
-{
-   refstack_t * stack = *stackp;
-   if (stack->pos >= stack->size) {
-      int newsize = 2*stack->size;
-      *stackp = stack = realloc(stack, sizeof(refstack_t) + newsize*sizeof(ref_t *));
-      if (!stack) return NULL;
-      stack->size = newsize;
-   }
-
-   stack->ref[stack->pos++] = ptr;
-
-   return stack;
-}
-
-ref_t *
-refstack_pop
-(
- refstack_t * stack
-)
-{
-   if (stack->pos == 0) return NULL;
-   else return stack->ref[--stack->pos];
-}
-
-refstack_t *
-read_genome
-(
- FILE      * fg
-)
-{
-   // Create hash table.
-   refstack_t * chrstack = refstack_new(128);
-   
-   size_t lines = 0, n = 100;
-   ssize_t bytes = 0, bufsize;
-   char * line = malloc(n);
-   ref_t * ref = NULL;
-   ENTRY * item;
-   while((bytes = getline(&line, &n, fg)) > 0) {
-      if (line[bytes-1] == '\n') line[--bytes] = 0;
-      // New chromosome.
-      if (line[0] == '>') {
-         // Realloc current buffer.
-         if (ref != NULL) {
-            ref->seq = realloc(ref->seq, ref->seqlen*sizeof(char));
-         }
-         // Crop line.
-         strtok(line+1, " ");
-         // Create new buffer for the next chromosome.
-         bufsize = 1024;
-         ref = malloc(sizeof(ref_t));
-         ref->seqname = strdup(line+1);
-         ref->seq = malloc(bufsize);
-         ref->seqlen = 0;
-         // Insert buffer into hash table.
-         refstack_push(&chrstack, ref);
-      }
-      // Input is a sequence.
-      else {
-         // Realloc buffer if full.
-         while (ref->seqlen + bytes > bufsize) {
-            bufsize *= 2;
-            ref->seq = realloc(ref->seq, bufsize*sizeof(char));
-            if (ref->seq == NULL) {
-               fprintf(stderr, "Error: realloc buffer\n");
-               exit(1);
-            }
-         }
-         // Copy data.
-         memcpy(ref->seq + ref->seqlen,line,bytes);
-         ref->seqlen += bytes;
-      }
-   }
-   free(line);
-
-   if (ref != NULL) {
-      ref->seq = realloc(ref->seq, ref->seqlen*sizeof(char));
-   }
-
-   
-   // Return hash table.
-   return chrstack;
-}
@@ -0,0 +1,341 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RE_SCAN_X86
+#endif
+#include "re_scan.h"
+
+#define max(a,b) ((a) > (b) ? (a) : (b))
+
+// Variable definitions.
+
+const char re_nt[128] = {
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,NT_A,NT_B,NT_C,NT_D,0,
+   0,NT_G,NT_H,0,0,NT_K,0,NT_M,NT_N,0,
+   0,0,NT_R,NT_S,NT_T,0,NT_V,NT_W,0,NT_Y,
+   0,0,0,0,0,0,NT_A,NT_B,NT_C,NT_D,0,
+   0,NT_G,NT_H,0,0,NT_K,0,NT_M,NT_N,0,
+   0,0,NT_R,NT_S,NT_T,0,NT_V,NT_W,0,NT_Y,
+   0,0,0,0,0
+};
+
+const char re_rc[128] = {
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,RC_A,RC_B,RC_C,RC_D,0,
+   0,RC_G,RC_H,0,0,RC_K,0,RC_M,RC_N,0,
+   0,0,RC_R,RC_S,RC_T,0,RC_V,RC_W,0,RC_Y,
+   0,0,0,0,0,0,RC_A,RC_B,RC_C,RC_D,0,
+   0,RC_G,RC_H,0,0,RC_K,0,RC_M,RC_N,0,
+   0,0,RC_R,RC_S,RC_T,0,RC_V,RC_W,0,RC_Y,
+   0,0,0,0,0
+};
+
+const char dna_nt[128] = {
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,NT_A,0,NT_C,0,0,
+   0,NT_G,0,0,0,0,0,0,NT_Z,0,
+   0,0,0,0,NT_T,0,0,0,0,0,
+   0,0,0,0,0,0,0,NT_A,0,NT_C,
+   0,0,0,NT_G,0,0,0,0,0,0,
+   NT_Z,0,0,0,0,0,NT_T,0,0,0,
+   0,0,0,0,0,0,0,0
+};
+
+const char dna_rc[128] = {
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,0,0,0,0,0,
+   0,0,0,0,0,RC_A,0,RC_C,0,0,
+   0,RC_G,0,0,0,0,0,0,NT_Z,0,
+   0,0,0,0,RC_T,0,0,0,0,0,
+   0,0,0,0,0,0,0,RC_A,0,RC_C,
+   0,0,0,RC_G,0,0,0,0,0,0,
+   NT_Z,0,0,0,0,0,RC_T,0,0,0,
+   0,0,0,0,0,0,0,0
+};
+
+
+
+// Scanner engine in use (resolved by re_scan_new, before any thread scans).
+static int scan_engine = RE_ENGINE_AUTO;
+
+// Source.
+
+static int
+pattern_compile
+(
+ re_pattern_t * patt,
+ const char   * pattern
+)
+{
+   int len = strlen(pattern);
+   if (len < 1 || len > RE_MAX_PATTERN)
+      return 1;
+
+   patt->len = len;
+   for (int k = 0; k < len; k++) {
+      unsigned char c = pattern[k];
+      if (c > 127 || re_nt[c] == 0)
+         return 1;
+      // Accepted genome bytes at this position (same as dna_nt & re_nt).
+      for (int b = 0; b < 128; b++)
+         patt->ok[k][b] = (dna_nt[b] & re_nt[c]) != 0;
+      // Accepted lowercase nucleotides, for the vector engines.
+      const char * nts = "acgt";
+      for (int j = 0; j < 4; j++) {
+         if (re_nt[c] & (1 << j))
+            patt->set[k][patt->nset[k]++] = nts[j];
+      }
+   }
+   patt->seq = strdup(pattern);
+
+   return 0;
+}
+
+re_scan_t *
+re_scan_new
+(
+ int     npatt,
+ char ** pattern
+)
+{
+   if (npatt < 1 || npatt > RE_MAX_ENZYMES)
+      return NULL;
+
+   re_scan_t * scan = calloc(1, sizeof(re_scan_t) + npatt*sizeof(re_pattern_t));
+   if (scan == NULL)
+      return NULL;
+
+   for (int p = 0; p < npatt; p++) {
+      if (pattern_compile(scan->patt + p, pattern[p])) {
+         re_scan_free(scan);
+         return NULL;
+      }
+      scan->npatt++;
+      scan->len = max(scan->len, scan->patt[p].len);
+   }
+   if (scan_engine == RE_ENGINE_AUTO)
+      re_scan_engine(RE_ENGINE_AUTO);
+
+   return scan;
+}
+
+void
+re_scan_free
+(
+ re_scan_t * scan
+)
+{
+   if (scan == NULL) return;
+   for (int p = 0; p < scan->npatt; p++)
+      free(scan->patt[p].seq);
+   free(scan);
+}
+
+static void
+scan_scalar
+(
+ const re_scan_t * scan,
+ const char      * seq,
+ long              beg,
+ long              len,
+ re_hit_t          hit,
+ void            * ctx
+)
+{
+   for (long i = beg; i < len; i++) {
+      for (int p = 0; p < scan->npatt; p++) {
+         const re_pattern_t * patt = scan->patt + p;
+         if (i + patt->len > len) continue;
+         int j = 0;
+         while (j < patt->len && patt->ok[j][(unsigned char) seq[i+j]]) j++;
+         if (j == patt->len) {
+            hit(ctx, i);
+            break;
+         }
+      }
+   }
+}
+
+#ifdef RE_SCAN_X86
+
+// The vector engines test 16/32 consecutive start positions at once. For
+// every pattern position k the block at seq+i+k is case-folded and compared
+// against the accepted nucleotides of k; the per-position masks are then
+// ANDed so that bit b of the result is set iff the pattern matches at i+b.
+// The results of all the patterns are ORed, so every site is reported once
+// even if several enzymes recognize it.
+
+__attribute__((target("sse4.2")))
+static void
+scan_sse42
+(
+ const re_scan_t * scan,
+ const char      * seq,
+ long              len,
+ re_hit_t          hit,
+ void            * ctx
+)
+{
+   int plen = scan->len;
+   __m128i fold = _mm_set1_epi8(0x20);
+   __m128i nt[RE_MAX_ENZYMES][RE_MAX_PATTERN][4];
+   for (int p = 0; p < scan->npatt; p++)
+      for (int k = 0; k < scan->patt[p].len; k++)
+         for (int j = 0; j < scan->patt[p].nset[k]; j++)
+            nt[p][k][j] = _mm_set1_epi8(scan->patt[p].set[k][j]);
+
+   long i = 0;
+   for (; i + 16 + plen - 1 <= len; i += 16) {
+      __m128i any = _mm_setzero_si128();
+      for (int p = 0; p < scan->npatt; p++) {
+         const re_pattern_t * patt = scan->patt + p;
+         __m128i acc = _mm_set1_epi8(-1);
+         for (int k = 0; k < patt->len; k++) {
+            __m128i v = _mm_or_si128(_mm_loadu_si128((const __m128i *)(seq+i+k)), fold);
+            __m128i m = _mm_cmpeq_epi8(v, nt[p][k][0]);
+            for (int j = 1; j < patt->nset[k]; j++)
+               m = _mm_or_si128(m, _mm_cmpeq_epi8(v, nt[p][k][j]));
+            acc = _mm_and_si128(acc, m);
+         }
+         any = _mm_or_si128(any, acc);
+      }
+      unsigned int mask = _mm_movemask_epi8(any);
+      while (mask) {
+         hit(ctx, i + __builtin_ctz(mask));
+         mask &= mask - 1;
+      }
+   }
+   // Tail.
+   scan_scalar(scan, seq, i, len, hit, ctx);
+}
+
+__attribute__((target("avx2")))
+static void
+scan_avx2
+(
+ const re_scan_t * scan,
+ const char      * seq,
+ long              len,
+ re_hit_t          hit,
+ void            * ctx
+)
+{
+   int plen = scan->len;
+   __m256i fold = _mm256_set1_epi8(0x20);
+   __m256i nt[RE_MAX_ENZYMES][RE_MAX_PATTERN][4];
+   for (int p = 0; p < scan->npatt; p++)
+      for (int k = 0; k < scan->patt[p].len; k++)
+         for (int j = 0; j < scan->patt[p].nset[k]; j++)
+            nt[p][k][j] = _mm256_set1_epi8(scan->patt[p].set[k][j]);
+
+   long i = 0;
+   for (; i + 32 + plen - 1 <= len; i += 32) {
+      __m256i any = _mm256_setzero_si256();
+      for (int p = 0; p < scan->npatt; p++) {
+         const re_pattern_t * patt = scan->patt + p;
+         __m256i acc = _mm256_set1_epi8(-1);
+         for (int k = 0; k < patt->len; k++) {
+            __m256i v = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(seq+i+k)), fold);
+            __m256i m = _mm256_cmpeq_epi8(v, nt[p][k][0]);
+            for (int j = 1; j < patt->nset[k]; j++)
+               m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, nt[p][k][j]));
+            acc = _mm256_and_si256(acc, m);
+         }
+         any = _mm256_or_si256(any, acc);
+      }
+      unsigned int mask = _mm256_movemask_epi8(any);
+      while (mask) {
+         hit(ctx, i + __builtin_ctz(mask));
+         mask &= mask - 1;
+      }
+   }
+   // Tail.
+   scan_scalar(scan, seq, i, len, hit, ctx);
+}
+
+#endif
+
+int
+re_scan_engine
+(
+ int engine
+)
+{
+   // Select the requested engine, falling back to the best one available.
+#ifdef RE_SCAN_X86
+   __builtin_cpu_init();
+   int best = RE_ENGINE_SCALAR;
+   if (__builtin_cpu_supports("sse4.2")) best = RE_ENGINE_SSE42;
+   if (__builtin_cpu_supports("avx2"))   best = RE_ENGINE_AVX2;
+#else
+   int best = RE_ENGINE_SCALAR;
+#endif
+   if (engine == RE_ENGINE_AUTO || engine > best)
+      engine = best;
+   scan_engine = engine;
+   return engine;
+}
+
+const char *
+re_scan_engine_name
+(
+ int engine
+)
+{
+   switch (engine) {
+   case RE_ENGINE_SCALAR: return "scalar";
+   case RE_ENGINE_SSE42:  return "sse4.2";
+   case RE_ENGINE_AVX2:   return "avx2";
+   default:               return "auto";
+   }
+}
+
+// Reports every position i where any of the patterns matches seq (within
+// [0,len)). Matching follows dna_nt/re_nt: only A,C,G,T (any case) can
+// match a pattern nucleotide, so N's in the genome never produce a site.
+void
+re_scan
+(
+ const re_scan_t * scan,
+ const char      * seq,
+ long              len,
+ re_hit_t          hit,
+ void            * ctx
+)
+{
+   switch (scan_engine) {
+#ifdef RE_SCAN_X86
+   case RE_ENGINE_AVX2:
+      scan_avx2(scan, seq, len, hit, ctx);
+      break;
+   case RE_ENGINE_SSE42:
+      scan_sse42(scan, seq, len, hit, ctx);
+      break;
+#endif
+   default:
+      scan_scalar(scan, seq, 0, len, hit, ctx);
+   }
+}
@@ -0,0 +1,108 @@
+#ifndef _RE_SCAN_H
+#define _RE_SCAN_H
+
+/* Nucleic acid notation:
+** 
+** A [0b0001]: Adenine
+** C [0b0010]: Cytosine
+** G [0b0100]: Guanine
+** T [0b1000]: Thymine
+** W [0b1001]: Weak (A or T)
+** S [0b0110]: Strong (C or G)
+** M [0b0011]: Amino (A or C)
+** K [0b1100]: Keto (G or T)
+** R [0b0101]: Purine (A or G)
+** Y [0b1010]: Pyridimine (C or T)
+** B [0b1110]: not A
+** D [0b1101]: not C
+** H [0b1011]: not G
+** V [0b0111]: not T
+** N [0b1111]: Any nucleotide
+*/
+
+#define NT_A 0b0001
+#define NT_C 0b0010
+#define NT_G 0b0100
+#define NT_T 0b1000
+#define NT_W 0b1001
+#define NT_S 0b0110
+#define NT_M 0b0011
+#define NT_K 0b1100
+#define NT_R 0b0101
+#define NT_Y 0b1010
+#define NT_B 0b1110
+#define NT_D 0b1101
+#define NT_H 0b1011
+#define NT_V 0b0111
+#define NT_N 0b1111
+#define NT_Z 0b0000
+
+// Reverse complements
+
+#define RC_A NT_T
+#define RC_C NT_G
+#define RC_G NT_C
+#define RC_T NT_A
+#define RC_W NT_W
+#define RC_S NT_S
+#define RC_M NT_K
+#define RC_K NT_M
+#define RC_R NT_Y
+#define RC_Y NT_R
+#define RC_B NT_V
+#define RC_D NT_H
+#define RC_H NT_D
+#define RC_V NT_B
+#define RC_N NT_N
+
+
+// Longest restriction site accepted by the scanner.
+#define RE_MAX_PATTERN 32
+// Maximum number of restriction sites scanned in one pass.
+#define RE_MAX_ENZYMES 16
+
+// Scanner engines (selected at runtime, see re_scan_engine).
+#define RE_ENGINE_AUTO   0
+#define RE_ENGINE_SCALAR 1
+#define RE_ENGINE_SSE42  2
+#define RE_ENGINE_AVX2   3
+
+// Variable definitions.
+
+extern const char re_nt[128];
+extern const char re_rc[128];
+extern const char dna_nt[128];
+extern const char dna_rc[128];
+
+// Struct definitions.
+
+// Compiled restriction site. For every position of the pattern 'set'
+// holds the lowercase nucleotides (a,c,g,t) accepted there, so that a
+// genome byte 'b' matches position 'k' iff (b | 0x20) is in set[k].
+typedef struct {
+   int    len;
+   int    nset[RE_MAX_PATTERN];
+   char   set[RE_MAX_PATTERN][4];
+   char   ok[RE_MAX_PATTERN][256];
+   char * seq;
+} re_pattern_t;
+
+// Set of restriction sites found together in a single pass.
+typedef struct {
+   int          npatt;
+   int          len;
+   re_pattern_t patt[];
+} re_scan_t;
+
+// Called for every position where any pattern matches, in increasing
+// order of position.
+typedef void (*re_hit_t)(void * ctx, long pos);
+
+// Function headers.
+re_scan_t    * re_scan_new      (int npatt, char ** pattern);
+void           re_scan_free     (re_scan_t * scan);
+void           re_scan          (const re_scan_t * scan, const char * seq, long len, re_hit_t hit, void * ctx);
+int            re_scan_engine   (int engine);
+const char   * re_scan_engine_name (int engine);
+
+#endif
@@ -0,0 +1,220 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "runstats.h"
+
+// Function headers.
+void           json_key     (json_t * js, const char * key);
+
+// Source.
+
+// Seconds of a monotonic clock.
+double
+wall_clock
+(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Counts calls of a stage. If timed, they took time seconds.
+void
+stage_count
+(
+ stage_t * st,
+ long      calls,
+ int       timed,
+ double    time
+)
+{
+   st->calls += calls;
+   if (timed) {
+      st->timed += calls;
+      st->time  += time;
+   }
+}
+
+void
+stage_merge
+(
+ stage_t       * dst,
+ const stage_t * src
+)
+{
+   dst->time  += src->time;
+   dst->calls += src->calls;
+   dst->timed += src->timed;
+}
+
+// Time of all the calls (extrapolated from the timed calls).
+double
+stage_time
+(
+ const stage_t * st
+)
+{
+   return st->timed > 0 ? st->time * st->calls / st->timed : 0.0;
+}
+
+// Progress lines every interval seconds (never if interval <= 0).
+void
+progress_init
+(
+ progress_t * pg,
+ double       interval
+)
+{
+   *pg = (progress_t) {.interval = interval};
+   pg->start = pg->last = wall_clock();
+}
+
+// Totals so far. Prints their rates (since the start) if a line is due.
+void
+progress_update
+(
+ progress_t * pg,
+ long         items,
+ long         bytes,
+ const char * unit
+)
+{
+   pg->items = items;
+   pg->bytes = bytes;
+   if (pg->interval <= 0) return;
+   double now = wall_clock();
+   if (now - pg->last < pg->interval) return;
+   double secs = now - pg->start;
+   pg->last = now;
+   // The first line starts after the current stderr message.
+   fprintf(stderr, "%sprogress: %ld %s (%.0f %s/s), %.1f MB (%.1f MB/s), %.0f s\n",
+           pg->lines++ ? "" : "\n", items, unit, items / secs, unit,
+           bytes / 1e6, bytes / 1e6 / secs, secs);
+}
+
+// JSON stats file. Values are written as the keys are added, so the
+// objects must be closed in order.
+json_t *
+json_open
+(
+ const char * path
+)
+{
+   FILE * f = fopen(path, "w");
+   if (f == NULL) return NULL;
+   json_t * js = calloc(1, sizeof(json_t));
+   js->f = f;
+   js->first = 1;
+   fprintf(f, "{");
+   return js;
+}
+
+int
+json_close
+(
+ json_t * js
+)
+{
+   fprintf(js->f, "\n}\n");
+   int err = ferror(js->f);
+   err |= fclose(js->f);
+   free(js);
+   return err;
+}
+
+void
+json_key
+(
+ json_t     * js,
+ const char * key
+)
+{
+   fprintf(js->f, "%s\n%*s\"%s\": ", js->first ? "" : ",", 2*(js->depth+1), "", key);
+   js->first = 0;
+}
+
+void
+json_begin
+(
+ json_t     * js,
+ const char * key
+)
+{
+   json_key(js, key);
+   fprintf(js->f, "{");
+   js->depth++;
+   js->first = 1;
+}
+
+void
+json_end
+(
+ json_t * js
+)
+{
+   js->depth--;
+   fprintf(js->f, "\n%*s}", 2*(js->depth+1), "");
+   js->first = 0;
+}
+
+void
+json_long
+(
+ json_t     * js,
+ const char * key,
+ long         val
+)
+{
+   json_key(js, key);
+   fprintf(js->f, "%ld", val);
+}
+
+void
+json_double
+(
+ json_t     * js,
+ const char * key,
+ double       val
+)
+{
+   json_key(js, key);
+   fprintf(js->f, "%.6f", val);
+}
+
+void
+json_str
+(
+ json_t     * js,
+ const char * key,
+ const char * val
+)
+{
+   json_key(js, key);
+   fputc('"', js->f);
+   for (const char * c = val; *c; c++) {
+      if (*c == '"' || *c == '\\')
+         fprintf(js->f, "\\%c", *c);
+      else if ((unsigned char) *c < 0x20)
+         fprintf(js->f, "\\u%04x", *c);
+      else
+         fputc(*c, js->f);
+   }
+   fputc('"', js->f);
+}
+
+// Seconds (extrapolated) and calls of a stage.
+void
+json_stage
+(
+ json_t        * js,
+ const char    * key,
+ const stage_t * st
+)
+{
+   json_begin(js, key);
+   json_double(js, "seconds", stage_time(st));
+   json_long(js, "calls", st->calls);
+   json_long(js, "timed_calls", st->timed);
+   json_end(js);
+}
@@ -0,0 +1,55 @@
+#ifndef _RUNSTATS_H
+#define _RUNSTATS_H
+
+#include <stdio.h>
+
+// Run statistics of the tools: wall-clock stage timers, periodic progress
+// lines and the JSON stats file (-j).
+//
+// Stages count all their calls but may time only some of them (e.g. one
+// read group in STAGE_SAMPLE), which keeps the clock reads off the hot
+// paths. Stage times are extrapolated from the timed calls.
+
+#define STAGE_SAMPLE      16
+#define PROGRESS_INTERVAL 30
+
+// Struct definitions.
+
+typedef struct {
+   double   time;
+   long     calls;
+   long     timed;
+} stage_t;
+
+typedef struct {
+   double   interval;
+   double   start;
+   double   last;
+   long     items;
+   long     bytes;
+   int      lines;
+} progress_t;
+
+typedef struct {
+   FILE   * f;
+   int      depth;
+   int      first;
+} json_t;
+
+// Function headers.
+double         wall_clock   (void);
+void           stage_count  (stage_t * st, long calls, int timed, double time);
+void           stage_merge  (stage_t * dst, const stage_t * src);
+double         stage_time   (const stage_t * st);
+void           progress_init (progress_t * pg, double interval);
+void           progress_update (progress_t * pg, long items, long bytes, const char * unit);
+json_t       * json_open    (const char * path);
+int            json_close   (json_t * js);
+void           json_begin   (json_t * js, const char * key);
+void           json_end     (json_t * js);
+void           json_long    (json_t * js, const char * key, long val);
+void           json_double  (json_t * js, const char * key, double val);
+void           json_str     (json_t * js, const char * key, const char * val);
+void           json_stage   (json_t * js, const char * key, const stage_t * st);
+
+#endif
@@ -0,0 +1,440 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "contacts.h"
+#include "output.h"
+
+#define MEMORY_MB    1024
+#define NKEYS        8
+#define RADIX_BITS   16
+#define RADIX_SIZE   (1 << RADIX_BITS)
+#define NDIGITS      (NKEYS * 32 / RADIX_BITS)
+#define MERGE_BUFFER (1 << 20)
+
+#define HELP_MSG "usage: sort_contacts [-t threads] [-m memory MB] [-T tmp dir] [contacts.bin]\n\n" \
+   "Sorts the binary contact records of parse_contacts -b (from the file or the standard\n" \
+   "input) by chromosome 1, chromosome 2, fragment 1, fragment 2, locus 1 and locus 2, the\n" \
+   "order expected by merge_contacts. Records with equal keys keep their input order.\n\n" \
+   "  -t  number of threads (default: all cores).\n" \
+   "  -m  memory budget in MB (default: 1024). Larger inputs are sorted in runs that are\n" \
+   "      spilled (compressed) to temporary files and merged.\n" \
+   "  -T  directory of the temporary files (default: $TMPDIR or /tmp).\n"
+
+
+// Struct definitions.
+
+// Sorted records: a slice of the memory buffer or a spilled run.
+typedef struct {
+   gzFile   gz;
+   char   * buf;
+   long     n;
+   long     pos;
+   long     max;
+} run_t;
+
+typedef struct {
+   char   * rec;
+   char   * tmp;
+   long     n;
+   size_t   recsize;
+} slice_t;
+
+// Function headers.
+void           rec_key      (const char * rec, uint32_t * key);
+int            rec_cmp      (const char * a, const char * b);
+void           radix_sort   (char * rec, char * tmp, long n, size_t recsize);
+void         * sort_slice   (void * arg);
+void           sort_buffer  (char * rec, char * tmp, long n, size_t recsize, int threads, run_t * runs);
+int            run_fill     (run_t * run, size_t recsize);
+void           merge_runs   (run_t * runs, int n, size_t recsize, gzFile gz);
+void           write_out    (outbuf_t * out, gzFile gz);
+gzFile         spill_run    (const char * tmpdir, run_t * runs, int n, size_t recsize);
+
+
+int main(int argc, char *argv[])
+{
+   // Parse options.
+   int    threads = sysconf(_SC_NPROCESSORS_ONLN);
+   long   memory  = MEMORY_MB;
+   char * tmpdir  = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+   int    opt;
+   while ((opt = getopt(argc, argv, "ht:m:T:")) != -1) {
+      switch (opt) {
+      case 'h':
+         fprintf(stderr, "%s", HELP_MSG);
+         exit(0);
+      case 't':
+         threads = atoi(optarg);
+         break;
+      case 'm':
+         memory = atol(optarg);
+         break;
+      case 'T':
+         tmpdir = optarg;
+         break;
+      default:
+         fprintf(stderr, "type \"%s -h\" for help.\n", argv[0]);
+         exit(1);
+      }
+   }
+   if (threads < 1) threads = 1;
+   if (memory < 1) memory = 1;
+
+   if (argc - optind > 1) {
+      fprintf(stderr, "usage: %s [-t threads] [-m memory MB] [-T tmp dir] [contacts.bin]\n", argv[0]);
+      fprintf(stderr, "type \"%s -h\" for help.\n", argv[0]);
+      exit(1);
+   }
+   FILE * fin = stdin;
+   if (argc - optind == 1 && strcmp(argv[optind], "-") != 0) {
+      fin = fopen(argv[optind], "r");
+      if (fin == NULL) {
+         fprintf(stderr, "error opening file: %s\n", argv[optind]);
+         exit(1);
+      }
+   }
+
+   // The header and the chromosome dictionary are copied to the output.
+   cbhdr_t hdr;
+   if (fread(&hdr, sizeof(cbhdr_t), 1, fin) != 1 ||
+       memcmp(hdr.magic, CB_MAGIC, 4) != 0 || hdr.version != CB_VERSION) {
+      fprintf(stderr, "error: input is not a binary contact file (parse_contacts -b).\n");
+      exit(1);
+   }
+   outbuf_t head = {0};
+   out_reserve(&head, sizeof(cbhdr_t) + hdr.names_size);
+   memcpy(head.buf, &hdr, sizeof(cbhdr_t));
+   if (fread(head.buf + sizeof(cbhdr_t), 1, hdr.names_size, fin) != hdr.names_size) {
+      fprintf(stderr, "error: truncated binary contact file.\n");
+      exit(1);
+   }
+   head.len = sizeof(cbhdr_t) + hdr.names_size;
+   write_out(&head, NULL);
+   out_free(&head);
+
+   // Records are read in chunks of half the budget (the other half is the
+   // buffer of the radix sort).
+   size_t recsize = sizeof(cbrec_t) + (hdr.flags & CB_READID ? sizeof(uint64_t) : 0);
+   long   cap = (memory << 20) / 2 / recsize;
+   if (cap < threads) cap = threads;
+   char * rec = malloc(cap * recsize);
+   char * tmp = malloc(cap * recsize);
+   if (rec == NULL || tmp == NULL) {
+      fprintf(stderr, "error: not enough memory (-m %ld).\n", memory);
+      exit(1);
+   }
+
+   run_t * slices = calloc(threads, sizeof(run_t));
+   run_t * runs   = NULL;
+   int     nruns  = 0;
+   long    total  = 0;
+   while (1) {
+      long n = fread(rec, recsize, cap, fin);
+      total += n;
+      // Last chunk (an input that fits in memory is not spilled).
+      int c = n < cap ? EOF : getc(fin);
+      if (c != EOF) ungetc(c, fin);
+      if (n == 0 && nruns == 0) break;
+      if (n > 0) sort_buffer(rec, tmp, n, recsize, threads, slices);
+      if (c == EOF && nruns == 0) {
+         merge_runs(slices, threads, recsize, NULL);
+         break;
+      }
+      if (n > 0) {
+         runs = realloc(runs, (nruns+1) * sizeof(run_t));
+         runs[nruns++] = (run_t) {.gz = spill_run(tmpdir, slices, threads, recsize)};
+      }
+      if (c == EOF) {
+         // Merge the spilled runs with the rest of the memory.
+         free(rec);
+         free(tmp);
+         rec = tmp = NULL;
+         long max = (memory << 20) / nruns / recsize;
+         if (max * recsize < MERGE_BUFFER) max = MERGE_BUFFER / recsize;
+         for (int i = 0; i < nruns; i++) {
+            runs[i].max = max;
+            runs[i].buf = malloc(max * recsize);
+         }
+         merge_runs(runs, nruns, recsize, NULL);
+         for (int i = 0; i < nruns; i++) {
+            gzclose(runs[i].gz);
+            free(runs[i].buf);
+         }
+         break;
+      }
+   }
+   if (ferror(fin)) {
+      fprintf(stderr, "error reading contacts.\n");
+      exit(1);
+   }
+
+   fprintf(stderr, "sorted %ld contacts (%d spilled run%s).\n", total, nruns, nruns == 1 ? "" : "s");
+
+   free(rec);
+   free(tmp);
+   free(runs);
+   free(slices);
+   if (fin != stdin) fclose(fin);
+   return 0;
+}
+
+// Sort key (most significant first). Signed fields are biased, so that
+// they sort as unsigned integers.
+void
+rec_key
+(
+ const char * rec,
+ uint32_t   * key
+)
+{
+   cbrec_t r;
+   memcpy(&r, rec, sizeof(cbrec_t));
+   key[0] = (uint32_t) r.chr1 ^ 0x80000000;
+   key[1] = (uint32_t) r.chr2 ^ 0x80000000;
+   key[2] = (uint32_t) r.frag1 ^ 0x80000000;
+   key[3] = (uint32_t) r.frag2 ^ 0x80000000;
+   key[4] = r.pos1 >> 32;
+   key[5] = r.pos1;
+   key[6] = r.pos2 >> 32;
+   key[7] = r.pos2;
+}
+
+int
+rec_cmp
+(
+ const char * a,
+ const char * b
+)
+{
+   uint32_t ka[NKEYS], kb[NKEYS];
+   rec_key(a, ka);
+   rec_key(b, kb);
+   for (int i = 0; i < NKEYS; i++)
+      if (ka[i] != kb[i]) return ka[i] < kb[i] ? -1 : 1;
+   return 0;
+}
+
+// Stable LSD radix sort of n records by their key, 16 bits at a time. The
+// histograms of all the digits are computed in one pass, and the digits
+// that are equal in all the records (e.g. the high bits of chromosome IDs)
+// are skipped.
+void
+radix_sort
+(
+ char   * rec,
+ char   * tmp,
+ long     n,
+ size_t   recsize
+)
+{
+   uint32_t * count = calloc((size_t) NDIGITS * RADIX_SIZE, sizeof(uint32_t));
+   uint32_t   key[NKEYS];
+   for (long i = 0; i < n; i++) {
+      rec_key(rec + i*recsize, key);
+      for (int d = 0; d < NDIGITS; d++)
+         count[d*RADIX_SIZE + ((key[NKEYS-1 - d/2] >> (16*(d%2))) & 0xffff)]++;
+   }
+
+   char * src = rec, * dst = tmp;
+   for (int d = 0; d < NDIGITS; d++) {
+      uint32_t * c = count + d*RADIX_SIZE;
+      int word = NKEYS-1 - d/2, shift = 16*(d%2);
+      rec_key(src, key);
+      if (c[(key[word] >> shift) & 0xffff] == n) continue;
+
+      // Bucket offsets.
+      long sum = 0;
+      for (int b = 0; b < RADIX_SIZE; b++) {
+         long cnt = c[b];
+         c[b] = sum;
+         sum += cnt;
+      }
+      for (long i = 0; i < n; i++) {
+         rec_key(src + i*recsize, key);
+         memcpy(dst + (c[(key[word] >> shift) & 0xffff]++)*recsize, src + i*recsize, recsize);
+      }
+      char * t = src; src = dst; dst = t;
+   }
+   if (src != rec)
+      memcpy(rec, src, n*recsize);
+
+   free(count);
+}
+
+void *
+sort_slice
+(
+ void * arg
+)
+{
+   slice_t * s = (slice_t *) arg;
+   radix_sort(s->rec, s->tmp, s->n, s->recsize);
+   return NULL;
+}
+
+// Sorts n records as 'threads' slices in parallel. The slices are returned
+// as memory runs.
+void
+sort_buffer
+(
+ char   * rec,
+ char   * tmp,
+ long     n,
+ size_t   recsize,
+ int      threads,
+ run_t  * runs
+)
+{
+   pthread_t * tid = malloc(threads * sizeof(pthread_t));
+   slice_t   * s   = malloc(threads * sizeof(slice_t));
+   for (int i = 0; i < threads; i++) {
+      long beg = n * i / threads, end = n * (i+1) / threads;
+      s[i] = (slice_t) {rec + beg*recsize, tmp + beg*recsize, end - beg, recsize};
+      runs[i] = (run_t) {.buf = s[i].rec, .n = s[i].n};
+      pthread_create(tid+i, NULL, sort_slice, s+i);
+   }
+   for (int i = 0; i < threads; i++)
+      pthread_join(tid[i], NULL);
+   free(tid);
+   free(s);
+}
+
+// Reads the next records of a spilled run. Returns 0 at the end of the run.
+int
+run_fill
+(
+ run_t  * run,
+ size_t   recsize
+)
+{
+   if (run->pos < run->n) return 1;
+   if (run->gz == NULL) return 0;
+   int bytes = gzread(run->gz, run->buf, run->max * recsize);
+   if (bytes < 0 || bytes % recsize) {
+      fprintf(stderr, "error reading temporary file.\n");
+      exit(1);
+   }
+   run->n = bytes / recsize;
+   run->pos = 0;
+   return run->n > 0;
+}
+
+// Multiway merge of sorted runs to gz (or to the standard output if NULL).
+// Ties are broken by run index, so the merge is stable.
+void
+merge_runs
+(
+ run_t  * runs,
+ int      n,
+ size_t   recsize,
+ gzFile   gz
+)
+{
+   // Binary heap of the runs that are not empty.
+   int * heap = malloc(n * sizeof(int));
+   int   size = 0;
+   for (int i = 0; i < n; i++) {
+      if (!run_fill(runs + i, recsize)) continue;
+      int j = size++;
+      heap[j] = i;
+      while (j > 0) {
+         int p = (j-1)/2;
+         run_t * a = runs + heap[j], * b = runs + heap[p];
+         int cmp = rec_cmp(a->buf + a->pos*recsize, b->buf + b->pos*recsize);
+         if (cmp > 0 || (cmp == 0 && heap[j] > heap[p])) break;
+         int t = heap[j]; heap[j] = heap[p]; heap[p] = t;
+         j = p;
+      }
+   }
+
+   outbuf_t out = {0};
+   while (size > 0) {
+      run_t * top = runs + heap[0];
+      out_reserve(&out, recsize);
+      memcpy(out.buf + out.len, top->buf + top->pos*recsize, recsize);
+      out.len += recsize;
+      if (out.len >= OUT_BLOCK)
+         write_out(&out, gz);
+
+      top->pos++;
+      if (!run_fill(top, recsize))
+         heap[0] = heap[--size];
+
+      // Sift down.
+      int j = 0;
+      while (1) {
+         int m = j;
+         for (int k = 2*j+1; k <= 2*j+2 && k < size; k++) {
+            run_t * a = runs + heap[k], * b = runs + heap[m];
+            int cmp = rec_cmp(a->buf + a->pos*recsize, b->buf + b->pos*recsize);
+            if (cmp < 0 || (cmp == 0 && heap[k] < heap[m])) m = k;
+         }
+         if (m == j) break;
+         int t = heap[j]; heap[j] = heap[m]; heap[m] = t;
+         j = m;
+      }
+   }
+   write_out(&out, gz);
+
+   out_free(&out);
+   free(heap);
+}
+
+void
+write_out
+(
+ outbuf_t * out,
+ gzFile     gz
+)
+{
+   if (gz != NULL) {
+      if (out->len > 0 && gzwrite(gz, out->buf, out->len) != (int) out->len) {
+         fprintf(stderr, "error writing temporary file.\n");
+         exit(1);
+      }
+      out->len = 0;
+   } else if (out_write(STDOUT_FILENO, &out, 1)) {
+      fprintf(stderr, "error writing contacts.\n");
+      exit(1);
+   }
+}
+
+// Merges the memory runs to a compressed temporary file and returns it
+// open for reading (the file is already unlinked).
+gzFile
+spill_run
+(
+ const char * tmpdir,
+ run_t      * runs,
+ int          n,
+ size_t       recsize
+)
+{
+   char * path = malloc(strlen(tmpdir) + 32);
+   sprintf(path, "%s/sort_contacts_XXXXXX", tmpdir);
+   int fd = mkstemp(path);
+   gzFile gz = fd < 0 ? NULL : gzdopen(fd, "wb1");
+   if (gz == NULL) {
+      fprintf(stderr, "error creating temporary file in %s.\n", tmpdir);
+      exit(1);
+   }
+   merge_runs(runs, n, recsize, gz);
+   if (gzclose(gz) != Z_OK) {
+      fprintf(stderr, "error writing temporary file.\n");
+      exit(1);
+   }
+
+   gz = gzopen(path, "rb");
+   unlink(path);
+   free(path);
+   if (gz == NULL) {
+      fprintf(stderr, "error reading temporary file.\n");
+      exit(1);
+   }
+   return gz;
+}
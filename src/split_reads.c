@@ -0,0 +1,552 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <pthread.h>
+#include "re_scan.h"
+#include "bgzf.h"
+#include "isd.h"
+
+#define BATCH_READS  16384
+#define IN_BUFSIZE   (1 << 20)
+#define MIN_LENGTH   20
+
+#define lowercase(s) for(char * p = s;*p;++p) *p=tolower(*p)
+
+#define HELP_MSG "usage: split_reads [-t threads] [-s] [-m min length] <organism> <RE name> <reads_1.fastq[.gz]> <reads_2.fastq[.gz]> <output prefix>\n\n" \
+   "Finds the ligation junctions of the enzyme(s) of db/<organism>/<RE name>.isd in paired reads\n" \
+   "and trims the reads at the first junction. Output is written to <prefix>_1.fastq and\n" \
+   "<prefix>_2.fastq.\n\n" \
+   "  -t  number of threads (default: all cores).\n" \
+   "  -s  split instead of trim, the pieces after the first junction are written to\n" \
+   "      <prefix>_split.fastq (single-end).\n" \
+   "  -m  minimum length of the split pieces (default: 20).\n"
+
+
+// Struct definitions.
+
+typedef struct {
+   char   * data;
+   size_t   len;
+   size_t   size;
+} buf_t;
+
+// Buffered line reader of a (compressed) FASTQ file.
+typedef struct {
+   bgzf_t * z;
+   char   * buf;
+   size_t   beg;
+   size_t   end;
+   int      eof;
+} fqin_t;
+
+typedef struct {
+   buf_t    in[2];
+   buf_t    out[3];
+   long     nreads;
+   long     njunct;
+   long     ntrim;
+   long     npieces;
+   int      done;
+} batch_t;
+
+// Same pipeline as re_digest: a reader fills batches of read pairs, the
+// workers trim or split them and the main thread writes them in order.
+typedef struct {
+   fqin_t            in[2];
+   re_scan_t       * scan;
+   int             * cut;
+   int               split;
+   int               minlen;
+   batch_t         * batch;
+   int               nslots;
+   long              nbatches;
+   long              next;
+   long              nwritten;
+   int               eof;
+   int               error;
+   pthread_mutex_t   lock;
+   pthread_cond_t    cond;
+} pool_t;
+
+// Junctions found in a read.
+typedef struct {
+   const pool_t * pool;
+   const char   * seq;
+   long           len;
+   long           n;
+   long           bound[];
+} junct_t;
+
+// Function headers.
+void           buf_append     (buf_t * buf, const char * data, size_t len);
+int            fq_line        (fqin_t * in, buf_t * dst);
+int            fq_record      (fqin_t * in, buf_t * dst);
+size_t         fq_linelen     (const buf_t * buf, size_t beg, size_t end);
+void           push_junction  (void * ctx, long pos);
+void           process_read   (pool_t * pool, batch_t * batch, char ** rec, int mate, junct_t * junct);
+void         * split_worker   (void * arg);
+void         * fastq_reader   (void * arg);
+
+// Source.
+
+int main(int argc, char *argv[])
+{
+   int threads = sysconf(_SC_NPROCESSORS_ONLN);
+   int split   = 0;
+   int minlen  = MIN_LENGTH;
+
+   // Parse options.
+   int opt;
+   while ((opt = getopt(argc, argv, "ht:sm:")) != -1) {
+      switch (opt) {
+      case 'h':
+         fprintf(stderr, "%s", HELP_MSG);
+         exit(0);
+      case 't':
+         threads = atoi(optarg);
+         break;
+      case 's':
+         split = 1;
+         break;
+      case 'm':
+         minlen = atoi(optarg);
+         break;
+      default:
+         fprintf(stderr, "type \"%s -h\" for help.\n", argv[0]);
+         exit(1);
+      }
+   }
+   if (threads < 1) threads = 1;
+
+   if (argc - optind != 5) {
+      fprintf(stderr, "usage: %s [-t threads] [-s] [-m min length] <organism> <RE name> <reads_1.fastq[.gz]> <reads_2.fastq[.gz]> <output prefix>\n", argv[0]);
+      fprintf(stderr, "type \"%s -h\" for help.\n", argv[0]);
+      exit(1);
+   }
+   char * organism = argv[optind];
+   char * re_name  = strdup(argv[optind+1]);
+   char * prefix   = argv[optind+4];
+   lowercase(re_name);
+
+   // Read enzymes from the digestion.
+   char * db_path = malloc(strlen(organism)+strlen(re_name)+9);
+   sprintf(db_path, "db/%s/%s.isd", organism, re_name);
+   isd_t * isd = isd_open(db_path, 0);
+   if (isd == NULL) exit(1);
+
+   // Ligation junctions of every pair of enzymes: the 5' end of the first
+   // site up to its reverse cut, then the second site from its forward cut.
+   // Reads are cut after the first part.
+   int    npatt = isd->nenz*isd->nenz;
+   char * junction[RE_MAX_ENZYMES];
+   int  * cut = malloc(npatt*sizeof(int));
+   if (npatt > RE_MAX_ENZYMES) {
+      fprintf(stderr, "too many enzymes in %s (max %d junctions).\n", db_path, RE_MAX_ENZYMES);
+      exit(1);
+   }
+   for (int i = 0; i < isd->nenz; i++) {
+      for (int j = 0; j < isd->nenz; j++) {
+         isdenz_t * a = isd->enz + i, * b = isd->enz + j;
+         int k = i*isd->nenz + j;
+         if (a->cut_rv < 0 || a->cut_rv > strlen(a->seq) || b->cut_fw < 0 || b->cut_fw > strlen(b->seq)) {
+            fprintf(stderr, "invalid cut sites in %s.\n", db_path);
+            exit(1);
+         }
+         junction[k] = malloc(2*ISD_MAX_SEQ);
+         snprintf(junction[k], 2*ISD_MAX_SEQ, "%.*s%s", a->cut_rv, a->seq, b->seq + b->cut_fw);
+         cut[k] = a->cut_rv;
+         fprintf(stderr, "ligation junction: %s\n", junction[k]);
+      }
+   }
+   re_scan_t * scan = re_scan_new(npatt, junction);
+   if (scan == NULL) {
+      fprintf(stderr, "invalid ligation junction (IUPAC nucleotides, max %d).\n", RE_MAX_PATTERN);
+      exit(1);
+   }
+
+   // Open input and output files.
+   pool_t pool = {
+      .scan     = scan,
+      .cut      = cut,
+      .split    = split,
+      .minlen   = minlen,
+      .nslots   = 4*threads,
+      .lock     = PTHREAD_MUTEX_INITIALIZER,
+      .cond     = PTHREAD_COND_INITIALIZER
+   };
+   for (int i = 0; i < 2; i++) {
+      pool.in[i] = (fqin_t) {
+         .z   = bgzf_open(argv[optind+2+i], threads),
+         .buf = malloc(IN_BUFSIZE)
+      };
+      if (pool.in[i].z == NULL) {
+         fprintf(stderr, "error while opening: %s.\n", argv[optind+2+i]);
+         exit(1);
+      }
+   }
+
+   const char * suffix[3] = {"_1.fastq", "_2.fastq", "_split.fastq"};
+   FILE * out[3] = {NULL};
+   char * path = malloc(strlen(prefix)+16);
+   for (int i = 0; i < 2 + split; i++) {
+      sprintf(path, "%s%s", prefix, suffix[i]);
+      out[i] = fopen(path, "w");
+      if (out[i] == NULL) {
+         fprintf(stderr, "error while opening: %s.\n", path);
+         exit(1);
+      }
+   }
+
+   pool.batch = calloc(pool.nslots, sizeof(batch_t));
+   pthread_t reader;
+   pthread_create(&reader, NULL, fastq_reader, &pool);
+   pthread_t * tid = malloc(threads * sizeof(pthread_t));
+   for (int i = 0; i < threads; i++)
+      pthread_create(tid+i, NULL, split_worker, &pool);
+
+   // Write batches in input order.
+   long nreads = 0, njunct = 0, ntrim = 0, npieces = 0;
+   while (1) {
+      batch_t * batch = pool.batch + (pool.nwritten % pool.nslots);
+      pthread_mutex_lock(&pool.lock);
+      while (!(pool.nwritten < pool.nbatches && batch->done) &&
+             !(pool.eof && pool.nwritten == pool.nbatches))
+         pthread_cond_wait(&pool.cond, &pool.lock);
+      int end = pool.nwritten == pool.nbatches;
+      pthread_mutex_unlock(&pool.lock);
+      if (end) break;
+
+      for (int i = 0; i < 2 + split; i++) {
+         if (fwrite(batch->out[i].data, 1, batch->out[i].len, out[i]) != batch->out[i].len) {
+            fprintf(stderr, "error while writing output (%s%s).\n", prefix, suffix[i]);
+            exit(1);
+         }
+      }
+      nreads  += batch->nreads;
+      njunct  += batch->njunct;
+      ntrim   += batch->ntrim;
+      npieces += batch->npieces;
+
+      pthread_mutex_lock(&pool.lock);
+      pool.nwritten++;
+      pthread_cond_broadcast(&pool.cond);
+      pthread_mutex_unlock(&pool.lock);
+   }
+
+   pthread_join(reader, NULL);
+   for (int i = 0; i < threads; i++)
+      pthread_join(tid[i], NULL);
+
+   if (pool.error == 2) {
+      fprintf(stderr, "error: quality and sequence lines of different lengths in %s or %s.\n", argv[optind+2], argv[optind+3]);
+      exit(1);
+   }
+   if (pool.error) {
+      fprintf(stderr, "error: truncated FASTQ or different number of reads in %s and %s.\n", argv[optind+2], argv[optind+3]);
+      exit(1);
+   }
+
+   fprintf(stderr, "read pairs:           %ld\n", nreads);
+   fprintf(stderr, "reads with junction:  %ld\n", njunct);
+   fprintf(stderr, "trimmed nucleotides:  %ld\n", ntrim);
+   if (split)
+      fprintf(stderr, "split pieces:         %ld\n", npieces);
+
+   // Close files and free.
+   for (int i = 0; i < 2 + split; i++) {
+      if (fclose(out[i]) != 0) {
+         fprintf(stderr, "error while writing output (%s%s).\n", prefix, suffix[i]);
+         exit(1);
+      }
+   }
+   for (int i = 0; i < 2; i++) {
+      bgzf_close(pool.in[i].z);
+      free(pool.in[i].buf);
+   }
+   for (int i = 0; i < pool.nslots; i++) {
+      for (int j = 0; j < 2; j++) free(pool.batch[i].in[j].data);
+      for (int j = 0; j < 3; j++) free(pool.batch[i].out[j].data);
+   }
+   for (int i = 0; i < npatt; i++)
+      free(junction[i]);
+   free(pool.batch);
+   free(tid);
+   free(cut);
+   free(path);
+   free(db_path);
+   free(re_name);
+   re_scan_free(scan);
+   isd_close(isd);
+
+   return 0;
+}
+
+void
+buf_append
+(
+ buf_t      * buf,
+ const char * data,
+ size_t       len
+)
+{
+   if (buf->len + len > buf->size) {
+      while (buf->len + len > buf->size)
+         buf->size = buf->size ? 2*buf->size : IN_BUFSIZE;
+      buf->data = realloc(buf->data, buf->size);
+   }
+   memcpy(buf->data + buf->len, data, len);
+   buf->len += len;
+}
+
+// Appends the next line of 'in' (with its newline) to 'dst'. Returns 0 at
+// the end of the file.
+int
+fq_line
+(
+ fqin_t * in,
+ buf_t  * dst
+)
+{
+   while (1) {
+      char * eol = memchr(in->buf + in->beg, '\n', in->end - in->beg);
+      if (eol != NULL) {
+         size_t len = eol - (in->buf + in->beg) + 1;
+         buf_append(dst, in->buf + in->beg, len);
+         in->beg += len;
+         return 1;
+      }
+      if (in->eof) {
+         // Last line without newline.
+         if (in->beg == in->end) return 0;
+         buf_append(dst, in->buf + in->beg, in->end - in->beg);
+         buf_append(dst, "\n", 1);
+         in->beg = in->end;
+         return 1;
+      }
+      // Refill (lines longer than the buffer are copied in parts).
+      if (in->beg == 0 && in->end == IN_BUFSIZE) {
+         buf_append(dst, in->buf, in->end);
+         in->end = 0;
+      }
+      memmove(in->buf, in->buf + in->beg, in->end - in->beg);
+      in->end -= in->beg;
+      in->beg = 0;
+      ssize_t bytes = bgzf_read(in->z, in->buf + in->end, IN_BUFSIZE - in->end);
+      if (bytes <= 0) in->eof = 1;
+      else in->end += bytes;
+   }
+}
+
+// Appends the next FASTQ record to 'dst'. Returns 1 if a record was read,
+// 0 at the end of the file, -1 if the record is truncated and -2 if its
+// quality line is not as long as its sequence.
+int
+fq_record
+(
+ fqin_t * in,
+ buf_t  * dst
+)
+{
+   size_t start = dst->len, line[4];
+   if (!fq_line(in, dst)) return 0;
+   if (dst->data[start] != '@') return -1;
+   for (int i = 0; i < 3; i++) {
+      line[i] = dst->len;
+      if (!fq_line(in, dst)) return -1;
+   }
+   line[3] = dst->len;
+   if (fq_linelen(dst, line[0], line[1]) != fq_linelen(dst, line[2], line[3])) return -2;
+   return 1;
+}
+
+// Length of the line [beg,end) of 'buf' without its newline (and \r).
+size_t
+fq_linelen
+(
+ const buf_t * buf,
+ size_t        beg,
+ size_t        end
+)
+{
+   size_t len = end - beg - 1;
+   if (len > 0 && buf->data[beg + len - 1] == '\r') len--;
+   return len;
+}
+
+void *
+fastq_reader
+(
+ void * arg
+)
+{
+   pool_t * pool = (pool_t *) arg;
+   int      eof  = 0;
+
+   while (!eof) {
+      // Wait for a free slot.
+      pthread_mutex_lock(&pool->lock);
+      while (pool->nbatches - pool->nwritten >= pool->nslots)
+         pthread_cond_wait(&pool->cond, &pool->lock);
+      pthread_mutex_unlock(&pool->lock);
+
+      batch_t * batch = pool->batch + (pool->nbatches % pool->nslots);
+      batch->in[0].len = batch->in[1].len = 0;
+      batch->nreads = 0;
+      while (batch->nreads < BATCH_READS) {
+         int r1 = fq_record(pool->in + 0, batch->in + 0);
+         int r2 = fq_record(pool->in + 1, batch->in + 1);
+         if (r1 != r2 || r1 < 0) {
+            pool->error = r1 == -2 || r2 == -2 ? 2 : 1;
+            eof = 1;
+            break;
+         }
+         if (r1 == 0) {
+            eof = 1;
+            break;
+         }
+         batch->nreads++;
+      }
+
+      pthread_mutex_lock(&pool->lock);
+      if (batch->nreads > 0) {
+         batch->done = 0;
+         pool->nbatches++;
+      }
+      pool->eof = eof;
+      pthread_cond_broadcast(&pool->cond);
+      pthread_mutex_unlock(&pool->lock);
+   }
+
+   return NULL;
+}
+
+void
+push_junction
+(
+ void * ctx,
+ long   pos
+)
+{
+   junct_t * junct = (junct_t *) ctx;
+   const re_scan_t * scan = junct->pool->scan;
+
+   // Cut after the first site of every junction that matches here.
+   for (int i = 0; i < scan->npatt; i++) {
+      const re_pattern_t * patt = scan->patt + i;
+      if (pos + patt->len > junct->len) continue;
+      int k = 0;
+      while (k < patt->len && patt->ok[k][(unsigned char) junct->seq[pos+k]]) k++;
+      if (k < patt->len) continue;
+      long bound = pos + junct->pool->cut[i];
+      if (junct->n == 0 || bound > junct->bound[junct->n-1])
+         junct->bound[junct->n++] = bound;
+      return;
+   }
+}
+
+// Writes mate 'mate' (lines in 'rec') trimmed at its first junction, and
+// the following pieces to the split output in split mode.
+void
+process_read
+(
+ pool_t   * pool,
+ batch_t  * batch,
+ char    ** rec,
+ int        mate,
+ junct_t  * junct
+)
+{
+   long len = rec[2] - rec[1] - 1;
+   if (len > 0 && rec[1][len-1] == '\r') len--;
+   junct->seq = rec[1];
+   junct->len = len;
+   junct->n   = 0;
+   re_scan(pool->scan, rec[1], len, push_junction, junct);
+
+   buf_t * out = batch->out + mate;
+   if (junct->n == 0) {
+      buf_append(out, rec[0], rec[4] - rec[0]);
+      return;
+   }
+
+   // Trimmed read (header and '+' lines unchanged).
+   long end = junct->bound[0];
+   batch->njunct++;
+   batch->ntrim += len - end;
+   buf_append(out, rec[0], rec[2] - rec[0] - (rec[2] - rec[1]) + end);
+   buf_append(out, "\n", 1);
+   buf_append(out, rec[2], rec[3] - rec[2]);
+   buf_append(out, rec[3], end);
+   buf_append(out, "\n", 1);
+   if (!pool->split) return;
+
+   // Pieces between the following junctions, named <read>:<mate>:<piece>.
+   size_t namelen = strcspn(rec[0], " \t\n\r");
+   char tag[48];
+   for (long i = 0; i < junct->n; i++) {
+      long beg = junct->bound[i];
+      long e   = i + 1 < junct->n ? junct->bound[i+1] : len;
+      if (e - beg < pool->minlen) continue;
+      int taglen = snprintf(tag, sizeof(tag), ":%d:%ld\n", mate + 1, i + 1);
+      buf_append(batch->out + 2, rec[0], namelen);
+      buf_append(batch->out + 2, tag, taglen);
+      buf_append(batch->out + 2, rec[1] + beg, e - beg);
+      buf_append(batch->out + 2, "\n+\n", 3);
+      buf_append(batch->out + 2, rec[3] + beg, e - beg);
+      buf_append(batch->out + 2, "\n", 1);
+      batch->npieces++;
+   }
+}
+
+void *
+split_worker
+(
+ void * arg
+)
+{
+   pool_t  * pool  = (pool_t *) arg;
+   // Junction ends are increasing (at most one per nucleotide of the read).
+   long      maxlen = 1024;
+   junct_t * junct = malloc(sizeof(junct_t) + maxlen*sizeof(long));
+   junct->pool = pool;
+
+   pthread_mutex_lock(&pool->lock);
+   while (1) {
+      while (pool->next == pool->nbatches && !pool->eof)
+         pthread_cond_wait(&pool->cond, &pool->lock);
+      if (pool->next == pool->nbatches) break;
+      batch_t * batch = pool->batch + (pool->next++ % pool->nslots);
+      pthread_mutex_unlock(&pool->lock);
+
+      for (int i = 0; i < 3; i++)
+         batch->out[i].len = 0;
+      batch->njunct = batch->ntrim = batch->npieces = 0;
+      char * p[2] = {batch->in[0].data, batch->in[1].data};
+      for (long r = 0; r < batch->nreads; r++) {
+         for (int mate = 0; mate < 2; mate++) {
+            // Start of the 4 lines of the record and end of the record.
+            char * rec[5];
+            for (int l = 0; l < 5; l++) {
+               rec[l] = p[mate];
+               if (l < 4) p[mate] = memchr(p[mate], '\n', batch->in[mate].data + batch->in[mate].len - p[mate]) + 1;
+            }
+            if (rec[2] - rec[1] > maxlen) {
+               maxlen = rec[2] - rec[1];
+               junct = realloc(junct, sizeof(junct_t) + maxlen*sizeof(long));
+            }
+            process_read(pool, batch, rec, mate, junct);
+         }
+      }
+
+      pthread_mutex_lock(&pool->lock);
+      batch->done = 1;
+      pthread_cond_broadcast(&pool->cond);
+   }
+   pthread_mutex_unlock(&pool->lock);
+
+   free(junct);
+   return NULL;
+}
@@ -0,0 +1,391 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include "bgzf.h"
+#include "twobit.h"
+
+#define TB_BUFSIZE (1 << 20)
+#define page_align(x) (((x) + TB_PAGE_SIZE - 1) / TB_PAGE_SIZE * TB_PAGE_SIZE)
+#define min(a,b) ((a) < (b) ? (a) : (b))
+
+// Struct definitions.
+
+// Cache being built.
+typedef struct {
+   FILE     * f;
+   uint64_t   offset;
+   tbtoc_t  * toc;
+   int        nchrom;
+   int        size;
+   char     * names;
+   size_t     names_size;
+   size_t     names_max;
+   tbrun_t  * runs;
+   long       nruns;
+   long       runs_max;
+   long       pos;
+   uint8_t    byte;
+   uint8_t  * buf;
+   size_t     nbuf;
+} tbw_t;
+
+// Function headers.
+int            tbw_pad      (tbw_t * w, size_t align);
+void           tbw_flush    (tbw_t * w);
+void           tbw_begin    (tbw_t * w, const char * name, size_t len);
+void           tbw_append   (tbw_t * w, const char * seq, size_t len);
+void           tbw_end      (tbw_t * w);
+
+// Source.
+
+tb_t *
+tb_open
+(
+ const char * path
+)
+{
+   int fd = open(path, O_RDONLY);
+   if (fd < 0) return NULL;
+
+   struct stat sb;
+   if (fstat(fd, &sb) == -1 || sb.st_size < sizeof(tbhdr_t)) {
+      fprintf(stderr, "error reading genome cache: %s.\n", path);
+      close(fd);
+      return NULL;
+   }
+
+   tb_t * tb = calloc(1, sizeof(tb_t));
+   tb->size = sb.st_size;
+   tb->map = mmap(0, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (tb->map == MAP_FAILED) {
+      fprintf(stderr, "error reading genome cache (mmap).\n");
+      free(tb);
+      return NULL;
+   }
+
+   // Validate header and TOC, the bases are used in place.
+   tbhdr_t * hdr = (tbhdr_t *) tb->map;
+   tbtoc_t * toc = (tbtoc_t *) (tb->map + hdr->toc_offset);
+   char    * names = (char *) (toc + hdr->nchrom);
+   if (memcmp(hdr->magic, TB_MAGIC, 4) != 0 || hdr->version != TB_VERSION ||
+       hdr->page_size != TB_PAGE_SIZE || hdr->toc_offset > tb->size ||
+       hdr->nchrom*sizeof(tbtoc_t) + hdr->names_size > tb->size - hdr->toc_offset)
+      goto corrupted;
+   uLong crc = crc32(0, (unsigned char *) toc, hdr->nchrom*sizeof(tbtoc_t));
+   if (crc32(crc, (unsigned char *) names, hdr->names_size) != hdr->crc)
+      goto corrupted;
+
+   tb->n = hdr->nchrom;
+   tb->chr = malloc(tb->n*sizeof(tbchr_t));
+   for (int i = 0; i < tb->n; i++) {
+      if (toc[i].name >= hdr->names_size ||
+          toc[i].offset + (toc[i].length+3)/4 > tb->size ||
+          toc[i].runs + toc[i].nruns*sizeof(tbrun_t) > tb->size)
+         goto corrupted;
+      tb->chr[i] = (tbchr_t) {
+         .name  = names + toc[i].name,
+         .len   = toc[i].length,
+         .bases = (uint8_t *) (tb->map + toc[i].offset),
+         .nruns = toc[i].nruns,
+         .runs  = (tbrun_t *) (tb->map + toc[i].runs)
+      };
+   }
+
+   // Nucleotides of every packed byte.
+   for (int b = 0; b < 256; b++)
+      for (int j = 0; j < 4; j++)
+         tb->unpack[b][j] = "ACGT"[(b >> 2*j) & 3];
+
+   return tb;
+
+ corrupted:
+   fprintf(stderr, "error reading genome cache: %s (corrupted or truncated, remove it to rebuild).\n", path);
+   tb_close(tb);
+   return NULL;
+}
+
+void
+tb_close
+(
+ tb_t * tb
+)
+{
+   if (tb == NULL) return;
+   free(tb->chr);
+   munmap(tb->map, tb->size);
+   free(tb);
+}
+
+// Copies the nucleotides [beg,end) of chromosome i to buf (uppercase, N
+// for everything but A, C, G and T). Returns the number of nucleotides.
+long
+tb_fetch
+(
+ const tb_t * tb,
+ int          i,
+ long         beg,
+ long         end,
+ char       * buf
+)
+{
+   const tbchr_t * chr = tb->chr + i;
+   end = min(end, chr->len);
+   if (beg >= end) return 0;
+
+   // Unpack whole bytes, then the partial bytes at both ends.
+   long p = beg;
+   for (; p < end && p % 4; p++)
+      buf[p-beg] = tb->unpack[chr->bases[p/4]][p%4];
+   for (; p + 4 <= end; p += 4)
+      memcpy(buf + p - beg, tb->unpack[chr->bases[p/4]], 4);
+   for (; p < end; p++)
+      buf[p-beg] = tb->unpack[chr->bases[p/4]][p%4];
+
+   // Mask the N runs that overlap [beg,end).
+   long lo = 0, hi = chr->nruns;
+   while (lo < hi) {
+      long mid = (lo+hi)/2;
+      if (chr->runs[mid].end <= beg) lo = mid+1;
+      else hi = mid;
+   }
+   for (long r = lo; r < chr->nruns && chr->runs[r].beg < end; r++) {
+      long rbeg = chr->runs[r].beg > beg ? chr->runs[r].beg : beg;
+      long rend = min(chr->runs[r].end, end);
+      memset(buf + rbeg - beg, 'N', rend - rbeg);
+   }
+
+   return end - beg;
+}
+
+// Packs the FASTA file 'fasta' (plain, gzip or BGZF) in 'path'. The cache
+// is written to a temporary file that is renamed when complete.
+int
+tb_build
+(
+ const char * path,
+ const char * fasta,
+ int          threads
+)
+{
+   bgzf_t * z = bgzf_open(fasta, threads);
+   if (z == NULL) return 1;
+
+   char * tmp = malloc(strlen(path)+32);
+   sprintf(tmp, "%s.%d.tmp", path, (int) getpid());
+   tbw_t w = {
+      .f         = fopen(tmp, "w"),
+      .offset    = TB_PAGE_SIZE,
+      .size      = 64,
+      .names_max = 1024,
+      .runs_max  = 1024
+   };
+   if (w.f == NULL) {
+      bgzf_close(z);
+      free(tmp);
+      return 1;
+   }
+   w.toc   = malloc(w.size*sizeof(tbtoc_t));
+   w.names = malloc(w.names_max);
+   w.runs  = malloc(w.runs_max*sizeof(tbrun_t));
+   w.buf   = malloc(TB_BUFSIZE);
+
+   // The header is written last, the bases start at the first page.
+   int err = fseek(w.f, w.offset, SEEK_SET) != 0;
+
+   // FASTA parser states (names end at the first space).
+   enum { AT_LINE, IN_NAME, IN_DESC, IN_SEQ } state = AT_LINE;
+   char   * in = malloc(TB_BUFSIZE);
+   size_t   namesize = 256, namelen = 0;
+   char   * name = malloc(namesize);
+   int      open_chr = 0;
+   ssize_t  bytes;
+   while ((bytes = bgzf_read(z, in, TB_BUFSIZE)) > 0) {
+      char * p = in, * end = in + bytes;
+      while (p < end) {
+         if (state == AT_LINE) {
+            if (*p == '>') {
+               if (open_chr) tbw_end(&w);
+               open_chr = 0;
+               namelen = 0;
+               state = IN_NAME;
+               p++;
+               continue;
+            }
+            state = IN_SEQ;
+         }
+         if (state == IN_NAME) {
+            while (p < end && !isspace(*p)) {
+               if (namelen + 1 >= namesize) name = realloc(name, namesize *= 2);
+               name[namelen++] = *p++;
+            }
+            if (p == end) continue;
+            name[namelen] = 0;
+            tbw_begin(&w, name, namelen+1);
+            open_chr = 1;
+            state = IN_DESC;
+         }
+         char * eol = memchr(p, '\n', end - p);
+         char * e = eol ? eol : end;
+         if (state == IN_SEQ && open_chr) {
+            // Append sequence line (without '\r').
+            while (p < e) {
+               char * r = memchr(p, '\r', e - p);
+               tbw_append(&w, p, (r ? r : e) - p);
+               p = r ? r + 1 : e;
+            }
+         }
+         p = eol ? eol + 1 : end;
+         if (eol) state = AT_LINE;
+      }
+   }
+   err |= bytes < 0;
+   if (open_chr) tbw_end(&w);
+
+   // TOC, names and header.
+   tbhdr_t hdr = {
+      .version    = TB_VERSION,
+      .nchrom     = w.nchrom,
+      .page_size  = TB_PAGE_SIZE,
+      .toc_offset = w.offset,
+      .names_size = w.names_size
+   };
+   memcpy(hdr.magic, TB_MAGIC, 4);
+   uLong crc = crc32(0, (unsigned char *) w.toc, w.nchrom*sizeof(tbtoc_t));
+   hdr.crc = crc32(crc, (unsigned char *) w.names, w.names_size);
+   err |= fwrite(w.toc, sizeof(tbtoc_t), w.nchrom, w.f) != w.nchrom;
+   err |= fwrite(w.names, 1, w.names_size, w.f) != w.names_size;
+   err |= fseek(w.f, 0, SEEK_SET) != 0;
+   err |= fwrite(&hdr, sizeof(tbhdr_t), 1, w.f) != 1;
+   err |= ferror(w.f) != 0;
+   err |= fclose(w.f) != 0;
+   if (!err) err = rename(tmp, path) != 0;
+   if (err) unlink(tmp);
+
+   bgzf_close(z);
+   free(in);
+   free(name);
+   free(tmp);
+   free(w.toc);
+   free(w.names);
+   free(w.runs);
+   free(w.buf);
+
+   return err;
+}
+
+// Writes zeros up to the next multiple of 'align'.
+int
+tbw_pad
+(
+ tbw_t  * w,
+ size_t   align
+)
+{
+   static const char zero[TB_PAGE_SIZE];
+   size_t pad = (align - w->offset % align) % align;
+   w->offset += pad;
+   return fwrite(zero, 1, pad, w->f) != pad;
+}
+
+void
+tbw_flush
+(
+ tbw_t * w
+)
+{
+   fwrite(w->buf, 1, w->nbuf, w->f);
+   w->offset += w->nbuf;
+   w->nbuf = 0;
+}
+
+void
+tbw_begin
+(
+ tbw_t      * w,
+ const char * name,
+ size_t       len
+)
+{
+   if (w->nchrom >= w->size) {
+      w->size *= 2;
+      w->toc = realloc(w->toc, w->size*sizeof(tbtoc_t));
+   }
+   while (w->names_size + len > w->names_max) {
+      w->names_max *= 2;
+      w->names = realloc(w->names, w->names_max);
+   }
+   w->toc[w->nchrom] = (tbtoc_t) {
+      .name   = w->names_size,
+      .offset = w->offset
+   };
+   memcpy(w->names + w->names_size, name, len);
+   w->names_size += len;
+   w->nruns = 0;
+   w->pos = 0;
+   w->byte = 0;
+}
+
+void
+tbw_append
+(
+ tbw_t      * w,
+ const char * seq,
+ size_t       len
+)
+{
+   for (size_t i = 0; i < len; i++) {
+      int code;
+      switch (seq[i]) {
+      case 'A': case 'a': code = 0; break;
+      case 'C': case 'c': code = 1; break;
+      case 'G': case 'g': code = 2; break;
+      case 'T': case 't': code = 3; break;
+      default:
+         // Extend the last N run or start a new one.
+         code = 0;
+         if (w->nruns > 0 && w->runs[w->nruns-1].end == w->pos) {
+            w->runs[w->nruns-1].end++;
+            break;
+         }
+         if (w->nruns >= w->runs_max) {
+            w->runs_max *= 2;
+            w->runs = realloc(w->runs, w->runs_max*sizeof(tbrun_t));
+         }
+         w->runs[w->nruns++] = (tbrun_t) {w->pos, w->pos+1};
+      }
+      w->byte |= code << 2*(w->pos % 4);
+      if (++w->pos % 4 == 0) {
+         w->buf[w->nbuf++] = w->byte;
+         w->byte = 0;
+         if (w->nbuf == TB_BUFSIZE) tbw_flush(w);
+      }
+   }
+}
+
+void
+tbw_end
+(
+ tbw_t * w
+)
+{
+   // Last partial byte, then the N runs and the next page.
+   if (w->pos % 4) w->buf[w->nbuf++] = w->byte;
+   tbw_flush(w);
+   tbw_pad(w, sizeof(int64_t));
+
+   tbtoc_t * toc = w->toc + w->nchrom++;
+   toc->length = w->pos;
+   toc->runs   = w->offset;
+   toc->nruns  = w->nruns;
+   fwrite(w->runs, sizeof(tbrun_t), w->nruns, w->f);
+   w->offset += w->nruns*sizeof(tbrun_t);
+   tbw_pad(w, TB_PAGE_SIZE);
+}
@@ -0,0 +1,74 @@
+#ifndef _TWOBIT_H
+#define _TWOBIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Packed genome cache (db/<organism>/genome.2bp), built once from the
+// FASTA genome and then mapped by the tools that read the sequence.
+//
+// All integers are little-endian.
+//   offset 0            tbhdr_t.
+//   page-aligned        bases of each chromosome, 4 per byte (2 bits each,
+//                       first base in the low bits, A=0 C=1 G=2 T=3),
+//                       followed by its N runs (tbrun_t, 8-byte aligned).
+//   toc_offset          tbtoc_t[nchrom], followed by the chromosome names
+//                       (NUL-terminated, names_size bytes).
+// Every nucleotide other than A, C, G or T (in any case) is stored as an N
+// run. Lowercase (soft-masking) is not kept. The header crc covers the TOC
+// and the names.
+
+#define TB_MAGIC     "2BP1"
+#define TB_VERSION   1
+#define TB_PAGE_SIZE 4096
+
+// Struct definitions.
+
+typedef struct {
+   char     magic[4];
+   uint32_t version;
+   uint32_t nchrom;
+   uint32_t page_size;
+   uint64_t toc_offset;
+   uint64_t names_size;
+   uint32_t crc;
+   uint32_t pad;
+} tbhdr_t;
+
+typedef struct {
+   uint64_t name;
+   uint64_t length;
+   uint64_t offset;
+   uint64_t runs;
+   uint64_t nruns;
+} tbtoc_t;
+
+// Nucleotides [beg,end) are N.
+typedef struct {
+   int64_t  beg;
+   int64_t  end;
+} tbrun_t;
+
+typedef struct {
+   char          * name;
+   long            len;
+   const uint8_t * bases;
+   long            nruns;
+   const tbrun_t * runs;
+} tbchr_t;
+
+typedef struct {
+   int        n;
+   tbchr_t  * chr;
+   char     * map;
+   size_t     size;
+   char       unpack[256][4];
+} tb_t;
+
+// Function headers.
+tb_t         * tb_open      (const char * path);
+void           tb_close     (tb_t * tb);
+long           tb_fetch     (const tb_t * tb, int chr, long beg, long end, char * buf);
+int            tb_build     (const char * path, const char * fasta, int threads);
+
+#endif